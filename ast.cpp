@@ -0,0 +1,29 @@
+#include <stdlib.h>
+#include <iostream>
+#include "ast.h"
+
+char *Arena::grow(size_t size, size_t align)
+{
+    // what doesn't fit a chunk gets one of its own
+    const size_t bytes = size + align > CHUNK_BYTES ? size + align : CHUNK_BYTES;
+    char *chunk = (char *)malloc(bytes);
+    if (!chunk) {
+        std::cout << "Error! Out of memory" << std::endl;
+        exit(0);
+    }
+    m_chunks.push_back(chunk);
+    m_end = chunk + bytes;
+    return (char *)(((uintptr_t)chunk + align - 1) & ~(uintptr_t)(align - 1));
+}
+
+void Arena::release()
+{
+    // the newest first, in case one refers to an older one
+    for (size_t i = m_destructors.size(); i-- > 0;)
+        m_destructors[i].destroy(m_destructors[i].object);
+    m_destructors.clear();
+    for (auto chunk : m_chunks)
+        free(chunk);
+    m_chunks.clear();
+    m_next = m_end = 0;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/*
+    Where the tree of a compilation unit lives. Nodes and their child
+    arrays are bumped out of CHUNK_BYTES chunks, so parsing a file takes
+    a handful of mallocs rather than a few per node, and a tree lies in
+    memory in about the order it is visited. The few objects that own
+    memory of their own, such as a String's text, have their destructor
+    run by release(), which frees the whole tree at once.
+*/
+class Arena {
+public:
+    enum { CHUNK_BYTES = 64 * 1024 };
+
+    Arena() : m_next(0), m_end(0) { }
+    ~Arena() { release(); }
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    void *allocate(size_t size, size_t align)
+    {
+        char *p = (char *)(((uintptr_t)m_next + align - 1) & ~(uintptr_t)(align - 1));
+        if (!m_next || p + size > m_end)
+            p = grow(size, align);
+        m_next = p + size;
+        return p;
+    }
+
+    template <class T, class... Args>
+    T *make(Args&&... args)
+    {
+        T *t = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        if (!std::is_trivially_destructible<T>::value)
+            m_destructors.push_back(Destructor{ t, &destroy<T> });
+        return t;
+    }
+
+    /* destroy everything made and free the chunks */
+    void release();
+
+    size_t chunks() const { return m_chunks.size(); }
+
+private:
+    struct Destructor {
+        void *object;
+        void (*destroy)(void *);
+    };
+
+    template <class T>
+    static void destroy(void *p) { ((T *)p)->~T(); }
+
+    char *grow(size_t size, size_t align);
+
+    char *m_next;
+    char *m_end;
+    std::vector<char *> m_chunks;
+    std::vector<Destructor> m_destructors;
+};
+
+/*
+    An array of plain values in an arena, such as the children of a
+    node. When it is full it moves to one twice the size, leaving the old
+    one behind until the arena is released.
+*/
+template <class T>
+class Array {
+public:
+    typedef T *iterator;
+    typedef const T *const_iterator;
+
+    Array() : m_items(0), m_size(0), m_capacity(0) { }
+
+    void push_back(Arena &arena, const T &x)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "arrays are moved with memcpy");
+        if (m_size == m_capacity) {
+            m_capacity = m_capacity ? 2 * m_capacity : 4;
+            T *items = (T *)arena.allocate(m_capacity * sizeof(T), alignof(T));
+            if (m_size)
+                memcpy(items, m_items, m_size * sizeof(T));
+            m_items = items;
+        }
+        m_items[m_size++] = x;
+    }
+
+    iterator begin() const { return m_items; }
+    iterator end() const { return m_items + m_size; }
+    uint32_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    T &operator[](uint32_t i) const { return m_items[i]; }
+
+private:
+    T *m_items;
+    uint32_t m_size;
+    uint32_t m_capacity;
+};
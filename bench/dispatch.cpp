@@ -0,0 +1,105 @@
+/*
+    Compares the switch and the threaded (computed goto) interpreter loops,
+    with the JIT as a reference point.
+
+    The program is a hand assembled version of the kind of loop found in
+    tests/mandelbrot0.prism: a counted integer loop around a few double
+    multiply/adds, all going through memory slots like generated code does.
+*/
+#include <cstdio>
+#include "vm.h"
+
+int debug = 0;
+
+enum {
+    I = 0, J = 1, ACC = 2,
+    INNER = 10000, OUTER = 1000
+};
+
+static void assemble(ToyVm& vm)
+{
+    vm.vpush(0);
+    vm.vstorel(J);
+    int outer = vm.getCurrent();
+    vm.vpush(0);
+    vm.vstorel(I);
+    int inner = vm.getCurrent();
+    // acc = acc * 0.5 + 0.25
+    vm.vloadl(ACC);
+    vm.vpush_double(0.5);
+    vm.vmul(::Type::DOUBLE);
+    vm.vpush_double(0.25);
+    vm.vadd(::Type::DOUBLE);
+    vm.vstorel(ACC);
+    // i = i + 1
+    vm.vloadl(I);
+    vm.vpush(1);
+    vm.vadd(::Type::INT);
+    vm.vstorel(I);
+    vm.vloadl(I);
+    vm.vpush(INNER);
+    vm.vclt(::Type::INT);
+    vm.vje(inner);
+    // j = j + 1
+    vm.vloadl(J);
+    vm.vpush(1);
+    vm.vadd(::Type::INT);
+    vm.vstorel(J);
+    vm.vloadl(J);
+    vm.vpush(OUTER);
+    vm.vclt(::Type::INT);
+    vm.vje(outer);
+    vm.vret();
+}
+
+static double measure(ToyVm::Dispatch dispatch, const char *name)
+{
+    ToyVm vm;
+    assemble(vm);
+    vm.set_dispatch(dispatch);
+
+    Xbyak::util::Clock clock;
+    const int runs = 5;
+    for (int i = 0; i < runs; i++) {
+        clock.begin();
+        vm.run(0);
+        clock.end();
+    }
+    const double insns = 14.0 * INNER * OUTER;
+    double cycles = (double)clock.getClock() / clock.getCount();
+    printf("%-9s %8.1f Mcycles  %5.2f cycles/insn\n", name, cycles / 1e6, cycles / insns);
+    return cycles;
+}
+
+static double measure_jit()
+{
+    ToyVm vm;
+    assemble(vm);
+    vm.recompile(0);
+
+    Xbyak::util::Clock clock;
+    const int runs = 5;
+    for (int i = 0; i < runs; i++) {
+        clock.begin();
+        vm.runByJIT();
+        clock.end();
+    }
+    const double insns = 14.0 * INNER * OUTER;
+    double cycles = (double)clock.getClock() / clock.getCount();
+    printf("%-9s %8.1f Mcycles  %5.2f cycles/insn\n", "jit", cycles / 1e6, cycles / insns);
+    return cycles;
+}
+
+int main()
+{
+    double sw = measure(ToyVm::SWITCH_DISPATCH, "switch");
+#ifdef PRISM_THREADED_DISPATCH
+    double th = measure(ToyVm::THREADED_DISPATCH, "threaded");
+    printf("speedup   %8.2fx\n", sw / th);
+#else
+    (void)sw;
+    printf("threaded dispatch not built (PRISM_THREADED_DISPATCH is off)\n");
+#endif
+    measure_jit();
+    return 0;
+}
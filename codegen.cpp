@@ -1,3 +1,5 @@
+#include <climits>
+#include <set>
 #include <typeinfo>
 #include "node.h"
 #include "codegen.h"
@@ -5,23 +7,37 @@
 
 using namespace std;
 
-int addr = 0;
-int debug = 0;
-
 /* Compile the AST into a module */
 void CodeGenContext::generate_code(Block& root)
 {
-    if (debug)
+    if (debug())
         std::cout << "Generating code...\n";
-    BasicBlock *bblock = new BasicBlock();
-    push_block(bblock);
+    push_block();
     root.codeGen(*this, true);
     //popBlock();
 }
 
+/*
+    Turn the generated code into a Program: run the peephole pass and
+    relocate the functions, then hand code and constants over to it.
+    This context runs the Program from then on; other VMs may load it.
+*/
+std::shared_ptr<const Program> CodeGenContext::link()
+{
+    std::vector<int> entries;
+    for (auto it : m_all_functions)
+        entries.push_back(it.second->pm_addr);
+    std::vector<int> where = optimize(entries);
+    for (auto it : m_all_functions)
+        it.second->pm_addr = where[it.second->pm_addr];
+    return ToyVm::link(functions()["main"]->pm_addr);
+}
+
 /* Executes the AST by running the main function */
 void CodeGenContext::run_code()
 {
+    std::shared_ptr<const Program> program = link();
+
     if (1) {
         dump();
         for(std::map<std::string , Value*>::const_iterator it = locals().begin(); it != locals().end(); it++) {
@@ -30,52 +46,66 @@ void CodeGenContext::run_code()
 
         for(std::map<std::string , Function*>::const_iterator it = functions().begin(); it != functions().end(); it++) {
             std::cout << "Function " << it->first << " addr: " << it->second->pm_addr << std::endl;
-            for(int i = 0; i < it->second->arguments.size(); it++)
+            for(int i = 0; i < it->second->arguments.size(); i++)
                 std::cout << "arg " << i << " at " << it->second->arguments[i] << endl;
         }
     }
-    run(functions()["main"]->pm_addr);
-    //recompile();
-    //runByJIT();
+    if (m_jit) {
+        recompile(program->main);
+        runByJIT();
+    } else {
+        run();
+    }
 
 }
 
-void Integer::codeGen(CodeGenContext& context)
+/* the profile of the last run, with the functions named */
+void CodeGenContext::write_profile(FILE *fp)
 {
-    if (debug)
+    std::map<uint32, std::string> names;
+    for (auto it : m_all_functions)
+        names[it.second->pm_addr] = it.first;
+    ToyVm::write_profile(fp, names);
+}
+
+ir::Value *Integer::codeGen(CodeGenContext& context)
+{
+    if (context.debug())
         std::cout << "Creating integer: " << m_value << endl;
-    context.vpush(m_value);
+    return context.ir().constant((int)m_value);
 }
 
-void Double::codeGen(CodeGenContext& context)
+ir::Value *Double::codeGen(CodeGenContext& context)
 {
-    if (debug)
+    if (context.debug())
         std::cout << "Creating double: " << m_value << endl;
-    int ref_id = context.add_constant(m_value);
-    context.vpush_constant(ref_id);
+    return context.ir().constant(m_value);
 }
 
 
-void String::codeGen(CodeGenContext &context)
+ir::Value *String::codeGen(CodeGenContext &context)
 {
-    int ref_id = context.add_constant(&m_value);
-    context.vpush_constant(ref_id);
+    return context.ir().constant(&m_value);
 }
 
-void ListLiteral::codeGen(CodeGenContext& context)
+ir::Value *ListLiteral::codeGen(CodeGenContext& context)
 {
-    int count = 0;
-    for(auto it : m_elements) {
-        it->codeGen(context);
-        count++;
+    std::vector<ir::Value*> elements;
+    for(auto it : m_elements)
+        elements.push_back(it->codeGen(context));
+
+    ir::Value *list = context.ir().emit(ir::MAKE_LIST, Type::LIST);
+    for (auto it : elements) {
+        list->args.push_back(it);
+        it->users.push_back(list);
     }
-    context.vmake_list(count);
+    return list;
 }
 
 
-void Identifier::codeGen(CodeGenContext& context)
+ir::Value *Identifier::codeGen(CodeGenContext& context)
 {
-    if (debug)
+    if (context.debug())
         std::cout << "Creating identifier reference: " << m_name << endl;
 
     Value *v = context.find_variable(m_name);
@@ -83,12 +113,12 @@ void Identifier::codeGen(CodeGenContext& context)
         std::cout << "Reference to unknown variable " << m_name << std::endl;
         exit(0);
     }
-    context.vpushm(v->addr);
+    return context.ir().read_variable(v->addr);
 }
 
-void MethodCall::codeGen(CodeGenContext& context)
+ir::Value *MethodCall::codeGen(CodeGenContext& context)
 {
-    if (debug)
+    if (context.debug())
         std::cout << "Calling function " << m_id->m_name << std::endl;
 
     Function *f = context.find_function(m_id->m_name);
@@ -99,12 +129,9 @@ void MethodCall::codeGen(CodeGenContext& context)
 
     ExpressionList::const_iterator it;
     int i = 0;
-    for (it = m_arguments->begin(); it != m_arguments->end(); it++) {
-        (**it).codeGen(context);
-        context.vpop(f->arguments[i++]);
-    }
-    int idx = f->pm_addr;
-    context.vcall(idx);
+    for (it = m_arguments->begin(); it != m_arguments->end(); it++)
+        context.ir().store(i++, (**it).codeGen(context));
+    return context.ir().call(f->pm_addr, type());
 }
 
 
@@ -120,52 +147,45 @@ Type  BinaryOperator::type() const
 
     return lhs->type();
 }
-void BinaryOperator::codeGen(CodeGenContext& context)
+ir::Value *BinaryOperator::codeGen(CodeGenContext& context)
 {
-    if (debug)
+    if (context.debug())
         std::cout << "Creating binary operation " << endl;
 
-    lhs->codeGen(context);
-    rhs->codeGen(context);
+    ir::Value *a = lhs->codeGen(context);
+    ir::Value *b = rhs->codeGen(context);
 
+    /* whether the operator exists for the type is checked when lowering */
+    ir::Op code;
     switch (op) {
-    case TPLUS:
-        context.vadd(type());
-        break;
-    case TMINUS:
-        context.encode(ToyVm::SUB, type());
-        break;
-    case TAND:
-        context.encode(ToyVm::AND, type());
-        break;
-    case TMUL:
-        context.vmul(type());
-        break;
-    case TDIV:
-        context.encode(ToyVm::DIV, type());
-        break;
-    case TCEQ:
-        context.encode(ToyVm::CMP, lhs->type());
-        break;
-    case TCLT:
-        context.encode(ToyVm::CLT, lhs->type());
-        break;
+    case TPLUS: code = ir::ADD; break;
+    case TMINUS: code = ir::SUB; break;
+    case TAND: code = ir::AND; break;
+    case TMUL: code = ir::MUL; break;
+    case TDIV: code = ir::DIV; break;
+    case TCEQ: code = ir::CMP; break;
+    case TCLT: code = ir::CLT; break;
+    default:
         /* TODO comparison */
+        std::cout << m_line_num << ": " << "Error! Operator not supported" << std::endl;
+        exit(0);
     }
-
+    Type t = code == ir::CMP || code == ir::CLT ? lhs->type() : type();
+    return context.ir().emit(code, t, a, b, m_line_num);
 }
 
-void Assignment::codeGen(CodeGenContext& context)
+ir::Value *Assignment::codeGen(CodeGenContext& context)
 {
-    if (debug)
+    if (context.debug())
         std::cout << "Creating assignment for " << lhs->m_name << endl;
     if (context.locals().find(lhs->m_name) == context.locals().end()) {
         std::cerr << "undeclared variable " << lhs->m_name << endl;
-        return;
+        return 0;
     }
 
-    rhs->codeGen(context);
-    context.vpop(context.locals()[lhs->m_name]->addr);
+    ir::Value *v = rhs->codeGen(context);
+    context.ir().write_variable(context.locals()[lhs->m_name]->addr, v);
+    return v;
 }
 
 
@@ -173,38 +193,41 @@ void Block::codeGen(CodeGenContext& context, int local_funcs_only)
 {
     for (auto it : statements) {
         if (local_funcs_only && typeid(*it) == typeid(FunctionDeclaration)) {
-            if (debug)
+            if (context.debug())
                 std::cout << "Generating code func for " << typeid(*it).name() << endl;
             (*it).codeGen(context);
         }
         if (!local_funcs_only && typeid(*it) != typeid(FunctionDeclaration)) {
-            if (debug)
+            if (context.debug())
                 std::cout << "Generating code for " << typeid(*it).name() << endl;
             (*it).codeGen(context);
         }
     }
 
-    if (debug)
+    if (context.debug())
         std::cout << "Creating block" << endl;
 }
 
-void ExpressionStatement::codeGen(CodeGenContext& context)
+ir::Value *ExpressionStatement::codeGen(CodeGenContext& context)
 {
-    if (debug)
+    if (context.debug())
         std::cout << "Generating code for " << typeid(m_expression).name() << endl;
     return m_expression.codeGen(context);
 }
 
-void VariableDeclaration::codeGen(CodeGenContext& context)
+ir::Value *VariableDeclaration::codeGen(CodeGenContext& context)
 {
-    if (debug)
+    if (context.debug())
         std::cout << "Creating variable declaration " << m_type->m_name << " " << m_name->m_name << endl;
 
-    context.locals()[m_name->m_name] = value();
+    if (!v)
+        v = new Value(context.new_slot());
+    context.locals()[m_name->m_name] = v;
     if (m_assignment_expr != NULL) {
         Assignment assn(m_name, m_assignment_expr);
         assn.codeGen(context);
     }
+    return 0;
 }
 
 #if 0
@@ -215,105 +238,369 @@ void ExternDeclaration::codeGen(CodeGenContext& context)
        cout << (**it).type->name << endl;
     }
 
-    if (debug)
+    if (context.debug())
         std::cout << "Creating external function: " << id->name << endl;
 }
 #endif
 
-void FunctionDeclaration::codeGen(CodeGenContext& context)
+/*
+    Nested functions are generated (and lowered) before the body of the
+    enclosing one, each into an ir::Function of its own. Every function
+    returns a value, falling off the end returns 0.
+*/
+ir::Value *FunctionDeclaration::codeGen(CodeGenContext& context)
 {
-    BasicBlock *bblock = new BasicBlock();
-
     Function *f = new Function();
 
-    context.push_block(bblock);
+    context.push_block();
     VariableList::const_iterator it;
     for (it = m_arguments->begin(); it != m_arguments->end(); it++) {
-        if (debug)
+        if (context.debug())
             cout << "Argument : " << (**it).m_type->m_name ;
-        Value *v = (*it)->value();
         (**it).codeGen(context);
-        if (debug)
+        Value *v = (*it)->value();
+        if (context.debug())
             cout << " at: " << v->addr << endl;
         f->arguments.push_back(v->addr);
     }
     m_block->codeGen(context, true);
+
+    /* nested functions are done, so the body is lowered right here; with
+       frames of its own the function can call itself */
     f->pm_addr = context.getCurrent();
+    context.add_function(m_id->m_name, f);
+
+    ir::Function function(m_id->m_name);
+    ir::Builder builder(&function);
+    ir::Builder *outer = context.set_builder(&builder);
+
+    function.params = m_arguments->size();
+    for (it = m_arguments->begin(); it != m_arguments->end(); it++) {
+        int index = it - m_arguments->begin();
+        builder.write_variable((*it)->value()->addr, builder.load(index, (*it)->m_type->type()));
+    }
     m_block->codeGen(context, false);
-    context.vret();
+    if (!builder.terminated())
+        builder.ret(builder.constant(0));
+
+    if (context.optimize_ir())
+        ir::optimize(function, context.opt_report());
+    if (context.debug() || context.dump_ir())
+        function.dump();
+    context.lower(function);
+    context.lower_bodies();
+    context.set_builder(outer);
     context.pop_block();
 
     context.functions().insert(std::make_pair(m_id->m_name, f));
 
-    if (debug)
+    if (context.debug())
         std::cout << "Creating function: " << m_id->m_name << endl;
+    return 0;
 }
 
-void IfStatement::codeGen(CodeGenContext& context)
+ir::Value *IfStatement::codeGen(CodeGenContext& context)
 {
-    int then_end;
-    m_eval_expr->codeGen(context);
-    int then_start = context.reserve();
+    ir::Builder &ir = context.ir();
+    ir::BasicBlock *then_block = ir.new_block();
+    ir::BasicBlock *else_block = m_else_block ? ir.new_block() : 0;
+    ir::BasicBlock *end = ir.new_block();
+
+    ir.branch(m_eval_expr->codeGen(context), then_block, else_block ? else_block : end);
+    ir.seal(then_block);
+    ir.set_block(then_block);
     m_then_block->codeGen(context, false);
+    if (!ir.terminated())
+        ir.jump(end);
 
     if (m_else_block) {
-        then_end = context.reserve();
+        ir.seal(else_block);
+        ir.set_block(else_block);
         m_else_block->codeGen(context ,false);
+        if (!ir.terminated())
+            ir.jump(end);
     }
 
-    int block_end = context.getCurrent();
-
-    if (m_else_block) {
-        context.encode_at(then_end, CodeGenContext::JMP, block_end);
-        context.encode_at(then_start, CodeGenContext::JNE, then_end);
-    } else {
-        context.encode_at(then_start, CodeGenContext::JNE, block_end);
-    }
+    ir.seal(end);
+    ir.set_block(end);
+    return 0;
 }
 
 
 
-void ReturnStatement::codeGen(CodeGenContext &context)
+ir::Value *ReturnStatement::codeGen(CodeGenContext &context)
 {
-    m_expr->codeGen(context);
+    context.ir().ret(m_expr->codeGen(context));
+    return 0;
 }
 
 
-void AssertStatement::codeGen(CodeGenContext &context)
+ir::Value *AssertStatement::codeGen(CodeGenContext &context)
 {
-    m_expr->codeGen(context);
-    context.vassert();
+    context.ir().emit(ir::ASSERT, Type::INT, m_expr->codeGen(context), m_line_num);
+    return 0;
 }
 
-void PrintStatement::codeGen(CodeGenContext &context)
+ir::Value *PrintStatement::codeGen(CodeGenContext &context)
 {
-    m_expr->codeGen(context);
-
-    context.vprint(m_expr->type());
+    context.ir().emit(ir::PRINT, m_expr->type(), m_expr->codeGen(context), m_line_num);
+    return 0;
 }
 
 
-void ForeachStatement::codeGen(CodeGenContext &context)
+/*
+    The step of a range() decides which way it counts, so it has to be
+    known when compiling; "0 - 1" is how a negative one is written.
+*/
+static bool constant_int(ir::Value *v, int *out)
+{
+    int a, b;
+    if (v->op == ir::CONST && v->type.id == Type::INT) {
+        *out = v->imm;
+        return true;
+    }
+    if (v->op == ir::SUB && v->type.id == Type::INT
+        && constant_int(v->args[0], &a) && constant_int(v->args[1], &b)) {
+        *out = a - b;
+        return true;
+    }
+    return false;
+}
+
+/*
+    A foreach counts an index from start towards stop: over a list that
+    is 0 to its length, over range(start, stop[, step]) the index is the
+    value itself and no list is built. The index is a plain Int
+    induction variable, so nothing is allocated and the optimizer and
+    JIT treat it like any other counted loop. As for while loops the
+    test is done before the first iteration and at the end of every one;
+    lowering turns the one at the end into ITER_NEXT_OR_JUMP. A step
+    other than 1 or -1 is only taken while the index is within the
+    step_limit(), as the next index could overflow.
+*/
+ir::Value *ForeachStatement::codeGen(CodeGenContext &context)
 {
+    ir::Builder &ir = context.ir();
+    // the statement is made at its closing brace, its variable in the header
+    const int line = m_var_decl->line_num();
+
+    MethodCall *call = dynamic_cast<MethodCall*>(m_expr);
+    ir::Value *list = 0, *start, *stop;
+    int step = 1;
+    if (call && call->m_id->m_name == "range" && !context.find_function("range")) {
+        std::vector<ir::Value*> args;
+        bool ok = call->m_arguments->size() == 2 || call->m_arguments->size() == 3;
+        for (auto it : *call->m_arguments) {
+            ok = ok && it->type().id == Type::INT;
+            args.push_back(it->codeGen(context));
+        }
+        if (!ok || m_var_decl->m_type->type().id != Type::INT) {
+            std::cout << m_line_num << ": " << "Error! range() takes Int start, stop and step and gives Ints" << std::endl;
+            exit(0);
+        }
+        if (args.size() == 3 && (!constant_int(args[2], &step) || step == 0)) {
+            std::cout << m_line_num << ": " << "Error! The step of range() must be a constant other than 0" << std::endl;
+            exit(0);
+        }
+        start = args[0];
+        stop = args[1];
+    } else {
+        list = m_expr->codeGen(context);
+        start = ir.constant(0);
+        stop = ir.emit(ir::LENGTH, Type::INT, list, line);
+    }
+    if (m_parallel)
+        return parallel_codeGen(context, list, start, stop, step);
+
     m_var_decl->codeGen(context);
-    m_expr->codeGen(context);
-    context.vmake_iter();
-    int pos = context.getCurrent();
-    context.viter_value();
-    context.vpop(context.locals()[m_var_decl->m_name->m_name]->addr);
+    ir::Value *limit = step == 1 || step == -1 ? 0 : step_limit(context, stop, step);
+    const int index = context.new_slot();
+    ir.write_variable(index, start);
+
+    ir::BasicBlock *body = ir.new_block();
+    ir::BasicBlock *end = ir.new_block();
+    if (step > 0)
+        ir.branch(ir.emit(ir::CLT, Type::INT, start, stop, line), body, end);
+    else
+        ir.branch(ir.emit(ir::CLT, Type::INT, stop, start, line), body, end);
+    ir.set_block(body);
+    ir::Value *i = ir.read_variable(index);
+    ir.write_variable(m_var_decl->value()->addr, list ? ir.emit(ir::ELEMENT, m_var_decl->m_type->type(), list, i, line) : i);
     m_block->codeGen(context, false);
-    context.vloop_iter(pos);
-    context.vpop(444);
-    context.vpop(444);
+    if (!ir.terminated() && !limit) {
+        // the index is inside the range, so the next one is an Int
+        ir::Value *next = ir.emit(ir::ADD, Type::INT, ir.read_variable(index), ir.constant(step), line);
+        ir.write_variable(index, next);
+        if (step > 0)
+            ir.branch(ir.emit(ir::CLT, Type::INT, next, stop, line), body, end);
+        else
+            ir.branch(ir.emit(ir::CLT, Type::INT, stop, next, line), body, end);
+    } else if (!ir.terminated()) {
+        // a longer step could overflow past stop, so test before taking it
+        ir::BasicBlock *more = ir.new_block();
+        ir::Value *i = ir.read_variable(index);
+        if (step > 0)
+            ir.branch(ir.emit(ir::CLT, Type::INT, i, limit, line), more, end);
+        else
+            ir.branch(ir.emit(ir::CLT, Type::INT, limit, i, line), more, end);
+        ir.seal(more);
+        ir.set_block(more);
+        ir.write_variable(index, ir.emit(ir::ADD, Type::INT, i, ir.constant(step), line));
+        ir.jump(body);
+    }
+
+    ir.seal(body);
+    ir.seal(end);
+    ir.set_block(end);
+    return 0;
 }
 
+/*
+    The last index a step can be taken from without passing stop, which
+    is stop - step unless that isn't an Int. Then no step is taken, and
+    the limit is the Int that no index is below (or above).
+*/
+ir::Value *ForeachStatement::step_limit(CodeGenContext &context, ir::Value *stop, int step)
+{
+    ir::Builder &ir = context.ir();
+    const int line = m_var_decl->line_num();
+    const int edge = step > 0 ? INT_MIN : INT_MAX;
+    int s;
+    if (constant_int(stop, &s))
+        return ir.constant(step > 0 ? (s < edge + step ? edge : s - step) : (s > edge + step ? edge : s - step));
+
+    const int limit = context.new_slot();
+    ir::BasicBlock *fits = ir.new_block();
+    ir::BasicBlock *end = ir.new_block();
+    ir.write_variable(limit, ir.constant(edge));
+    if (step > 0)
+        ir.branch(ir.emit(ir::CLT, Type::INT, stop, ir.constant(edge + step), line), end, fits);
+    else
+        ir.branch(ir.emit(ir::CLT, Type::INT, ir.constant(edge + step), stop, line), end, fits);
+    ir.seal(fits);
+    ir.set_block(fits);
+    ir.write_variable(limit, ir.emit(ir::SUB, Type::INT, stop, ir.constant(step), line));
+    ir.jump(end);
+    ir.seal(end);
+    ir.set_block(end);
+    return ir.read_variable(limit);
+}
+
+
+namespace {
+
+/* the variables a block reads, assigns and declares */
+class VariableUses : public Visitor {
+public:
+    std::set<std::string> read, assigned, declared;
+
+    void visit(Node *n)
+    {
+        if (Identifier *id = dynamic_cast<Identifier*>(n))
+            read.insert(id->m_name);
+        else if (Assignment *a = dynamic_cast<Assignment*>(n))
+            assigned.insert(a->lhs->m_name);
+        else if (VariableDeclaration *d = dynamic_cast<VariableDeclaration*>(n))
+            declared.insert(d->m_name->m_name);
+        // the only node that doesn't visit its expression in accept()
+        else if (ExpressionStatement *e = dynamic_cast<ExpressionStatement*>(n))
+            e->m_expression.accept(this);
+    }
+};
+
+}
 
-void WhileStatement::codeGen(CodeGenContext &context)
+/*
+    A parallel foreach runs its body as a function of its own for every
+    index, on the worker threads of the VM (see parallel.cpp). The
+    variables from outside that the body reads are passed to it after
+    the index, by value, so an iteration can't assign them; the list of
+    a foreach over a list comes last. A return only ends its iteration.
+    The body is lowered after the enclosing function, by lower_bodies.
+*/
+ir::Value *ForeachStatement::parallel_codeGen(CodeGenContext &context, ir::Value *list,
+                                              ir::Value *start, ir::Value *stop, int step)
 {
-    int start = context.getCurrent();
+    VariableUses uses;
+    m_block->accept(&uses);
+    const std::string &name = m_var_decl->m_name->m_name;
+    std::vector<std::pair<std::string, Value*> > captured;
+    std::vector<ir::Value*> values;
+    for (auto &it : uses.read) {
+        Value *v = context.find_variable(it);
+        if (!v || it == name || uses.declared.count(it))
+            continue;
+        if (uses.assigned.count(it)) {
+            std::cout << m_line_num << ": " << "Error! A parallel foreach can't assign " << it << ", it belongs to the code around it" << std::endl;
+            exit(0);
+        }
+        captured.push_back(std::make_pair(it, v));
+        values.push_back(context.ir().read_variable(v->addr));
+    }
+    if (list)
+        values.push_back(list);
+    if (values.size() > 0xff) {
+        std::cout << m_line_num << ": " << "Error! A parallel foreach can't use more than 255 variables from outside" << std::endl;
+        exit(0);
+    }
+
+    context.push_block();
+    for (auto &it : captured)
+        context.locals()[it.first] = it.second;
+    m_var_decl->codeGen(context);
+
+    ir::Function *body = new ir::Function("foreach@" + std::to_string(m_line_num));
+    const int number = context.add_body(body);
+    ir::Builder builder(body);
+    ir::Builder *outer = context.set_builder(&builder);
+    body->params = values.size() + 1;
+    ir::Value *index = builder.load(0, Type::INT);
+    for (size_t i = 0; i < captured.size(); i++)
+        builder.write_variable(captured[i].second->addr, builder.load(i + 1, values[i]->type));
+    ir::Value *element = index;
+    if (list)
+        element = builder.emit(ir::ELEMENT, m_var_decl->m_type->type(), builder.load(values.size(), Type::LIST), index);
+    builder.write_variable(m_var_decl->value()->addr, element);
     m_block->codeGen(context, false);
-    m_expr->codeGen(context);
+    if (!builder.terminated())
+        builder.ret(builder.constant(0));
+
+    if (context.optimize_ir())
+        ir::optimize(*body, context.opt_report());
+    if (context.debug() || context.dump_ir())
+        body->dump();
+    context.set_builder(outer);
+    context.pop_block();
+
+    ir::Builder &ir = context.ir();
+    ir::Value *p = ir.emit(ir::PARALLEL, Type::VOID, m_line_num);
+    p->imm = number;
+    values.insert(values.begin(), { start, stop, ir.constant(step) });
+    for (auto it : values) {
+        p->args.push_back(it);
+        it->users.push_back(p);
+    }
+    return 0;
+}
+
+/*
+    The condition is tested before the first iteration and again at the
+    end of every one, so the loop itself only has one branch.
+*/
+ir::Value *WhileStatement::codeGen(CodeGenContext &context)
+{
+    ir::Builder &ir = context.ir();
+    ir::BasicBlock *body = ir.new_block();
+    ir::BasicBlock *end = ir.new_block();
 
-    context.encode(CodeGenContext::JE, start);
+    ir.branch(m_expr->codeGen(context), body, end);
+    ir.set_block(body);
+    m_block->codeGen(context, false);
+    if (!ir.terminated())
+        ir.branch(m_expr->codeGen(context), body, end);
 
+    ir.seal(body);
+    ir.seal(end);
+    ir.set_block(end);
+    return 0;
 }
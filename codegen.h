@@ -4,6 +4,7 @@
 #include <map>
 
 #include "vm.h"
+#include "ir.h"
 
 class Block;
 
@@ -30,11 +31,6 @@ public:
 };
 
 
-class BasicBlock
-{
-
-};
-
 class Function
 {
 public:
@@ -44,20 +40,72 @@ public:
 
 class CodeGenBlock {
 public:
-    BasicBlock *block;
     std::map<std::string , Value*> locals;
     std::map<std::string , Function*> functions;
 };
 
 class CodeGenContext : public ToyVm {
     std::deque<CodeGenBlock *> blocks;
+    bool m_jit;
+    bool m_dump_ir;
+    bool m_optimize;
+    bool m_opt_report;
+    ir::Builder *m_ir;
+    int m_slots;
+
+    /* parallel foreach bodies waiting to be lowered and the PARALLEL
+       instructions that run them */
+    struct Body {
+        ir::Function *function;
+        int site;
+    };
+    std::vector<Body> m_bodies;
+
+    /* every function, nested ones too, which link() relocates and the
+       profile names */
+    std::multimap<std::string, Function*> m_all_functions;
 
 public:
 
-    CodeGenContext() { }
+    CodeGenContext() : m_jit(false), m_dump_ir(false), m_optimize(true), m_opt_report(false), m_ir(0), m_slots(0) { }
 
     void generate_code(Block& root);
+    std::shared_ptr<const Program> link();
     void run_code();
+    void write_profile(FILE *fp);
+    void set_jit(bool jit) { m_jit = jit; }
+    void set_dump_ir(bool dump) { m_dump_ir = dump; }
+    bool dump_ir() const { return m_dump_ir; }
+    void set_optimize_ir(bool optimize) { m_optimize = optimize; }
+    bool optimize_ir() const { return m_optimize; }
+    void set_opt_report(bool report) { m_opt_report = report; }
+    bool opt_report() const { return m_opt_report; }
+
+    /* the function being generated; nested functions get their own */
+    ir::Builder &ir() { return *m_ir; }
+    ir::Builder *set_builder(ir::Builder *builder)
+    {
+        ir::Builder *old = m_ir;
+        m_ir = builder;
+        return old;
+    }
+
+    /* a new variable; every variable of the program has a slot of its own */
+    int new_slot() { return m_slots++; }
+
+    /* lower.cpp: emit f as bytecode, returns its entry point */
+    int lower(ir::Function &f);
+
+    /* a parallel foreach body is lowered after the function it is in, which
+       has to start where FunctionDeclaration::codeGen expects; add_body
+       takes f and returns the number PARALLEL refers to it by */
+    int add_body(ir::Function *f)
+    {
+        m_bodies.push_back(Body{ f, -1 });
+        return m_bodies.size() - 1;
+    }
+    void set_body_site(int body, int pc) { m_bodies[body].site = pc; }
+    void lower_bodies();
 
     std::map<std::string, Value*>&locals()
     {
@@ -69,6 +117,12 @@ public:
         return blocks.front()->functions;
     }
 
+    void add_function(const std::string &name, Function *f)
+    {
+        functions().insert(std::make_pair(name, f));
+        m_all_functions.insert(std::make_pair(name, f));
+    }
+
     Function* find_function(const std::string &name)
     {
         std::deque<CodeGenBlock*>::iterator it;
@@ -89,15 +143,9 @@ public:
         return 0;
     }
 
-    BasicBlock *current_block()
-    {
-        return blocks.front()->block;
-    }
-
-    void push_block(BasicBlock *block)
+    void push_block()
     {
         blocks.push_front(new CodeGenBlock());
-        blocks.front()->block = block;
     }
 
     void pop_block()
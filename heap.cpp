@@ -0,0 +1,255 @@
+#include <chrono>
+#include <new>
+#include "vm.h"
+
+static_assert(sizeof(List) <= Heap::CELL_BYTES - 8, "a list must fit a heap cell");
+
+Heap::Heap()
+    : m_lowest(UINTPTR_MAX), m_highest(0), m_bump(0), m_bump_end(0), m_free(0), m_parent(0), m_debug(false),
+      m_old_cells(0), m_major_at(MIN_OLD_CELLS),
+      m_minor_collections(0), m_major_collections(0),
+      m_total_pause(0), m_max_pause(0), m_peak_cells(0)
+{
+    static_assert(sizeof(Cell) == CELL_BYTES, "cells must tile a chunk");
+    static_assert(sizeof(String) <= CELL_BYTES - 8, "a string must fit a heap cell");
+}
+
+Heap::~Heap()
+{
+    for (auto chunk : m_chunks) {
+        Cell *cells = (Cell *)chunk;
+        for (size_t i = 0; i < CHUNK_BYTES / CELL_BYTES; i++)
+            release(&cells[i]);
+        free(chunk);
+    }
+}
+
+const std::string *Heap::concat(const std::string *a, const std::string *b, const Roots &roots)
+{
+    Cell *cell = allocate(roots);
+    String *left = string_of(a);
+    String *right = string_of(b);
+    // the parent's strings are read as literals
+    if (m_parent && !left)
+        flatten(a);
+    if (m_parent && !right)
+        flatten(b);
+    const char *tail = right ? right->buffer->data : b->data();
+    const size_t tail_length = right ? right->length : b->size();
+
+    Buffer *buffer;
+    if (left && left->length == left->buffer->size) {
+        buffer = left->buffer;
+        if (buffer->size + tail_length > buffer->capacity) {
+            buffer->capacity = std::max(2 * buffer->capacity, buffer->size + tail_length);
+            buffer->data = (char *)realloc(buffer->data, buffer->capacity);
+        }
+    } else {
+        const char *head = left ? left->buffer->data : a->data();
+        const size_t head_length = left ? left->length : a->size();
+        buffer = new Buffer;
+        buffer->capacity = std::max(head_length + tail_length, (size_t)16);
+        buffer->data = (char *)malloc(buffer->capacity);
+        buffer->size = head_length;
+        buffer->refs = 0;
+        memcpy(buffer->data, head, head_length);
+    }
+    // b may be a, and the realloc above may have moved its text
+    if (right && right->buffer == buffer)
+        tail = buffer->data;
+    memcpy(buffer->data + buffer->size, tail, tail_length);
+    buffer->size += tail_length;
+    buffer->refs++;
+
+    cell->kind = STRING;
+    String *str = new (cell->payload) String;
+    str->buffer = buffer;
+    str->length = buffer->size;
+    return &str->text;
+}
+
+/* the String behind s, or 0 if s is a literal */
+Heap::String *Heap::string_of(const std::string *s) const
+{
+    Cell *cell = cell_of(s);
+    return cell && cell->kind == STRING ? (String *)cell->payload : 0;
+}
+
+const std::string &Heap::flatten(const std::string *s)
+{
+    String *str = string_of(s);
+    if (!str && m_parent && m_parent->string_of(s)) {
+        std::lock_guard<std::mutex> lock(m_parent->m_shared_lock);
+        return m_parent->flatten(s);
+    }
+    if (str && str->text.size() != str->length)
+        str->text.assign(str->buffer->data, str->length);
+    return *s;
+}
+
+List *Heap::new_list(int element_type, uint32_t capacity, const Roots &roots)
+{
+    Cell *cell = allocate(roots);
+    cell->kind = LIST;
+    return new (cell->payload) List(element_type, capacity);
+}
+
+Heap::Cell *Heap::allocate(const Roots &roots)
+{
+    if (m_young.size() >= NURSERY_CELLS)
+        collect(roots);
+
+    Cell *cell = m_free;
+    if (cell) {
+        m_free = cell->next;
+    } else {
+        if (m_bump == m_bump_end) {
+            char *chunk = 0;
+            if (posix_memalign((void **)&chunk, CHUNK_BYTES, CHUNK_BYTES) != 0) {
+                std::cout << "Error! Out of memory" << std::endl;
+                exit(0);
+            }
+            memset(chunk, 0, CHUNK_BYTES);
+            m_chunks.push_back(chunk);
+            m_chunk_set.insert((uintptr_t)chunk);
+            m_lowest = std::min(m_lowest, (uintptr_t)chunk);
+            m_highest = std::max(m_highest, (uintptr_t)chunk + CHUNK_BYTES);
+            m_bump = (Cell *)chunk;
+            m_bump_end = (Cell *)(chunk + CHUNK_BYTES);
+        }
+        cell = m_bump++;
+    }
+    cell->old = 0;
+    cell->marked = 0;
+    m_young.push_back(cell);
+    m_peak_cells = std::max(m_peak_cells, m_old_cells + m_young.size());
+    return cell;
+}
+
+/*
+    The cell whose object starts at p, or 0 if p is not the address of
+    an object.
+*/
+Heap::Cell *Heap::cell_of(const void *p) const
+{
+    const uintptr_t addr = (uintptr_t)p;
+    if (addr < m_lowest || addr >= m_highest)
+        return 0;
+    const uintptr_t chunk = addr & ~(uintptr_t)(CHUNK_BYTES - 1);
+    if ((addr - chunk) % CELL_BYTES != offsetof(Cell, payload) || !m_chunk_set.count(chunk))
+        return 0;
+    Cell *cell = (Cell *)(addr - offsetof(Cell, payload));
+    return cell->kind == FREE ? 0 : cell;
+}
+
+/* a minor collection only marks young objects, old ones are live anyway */
+void Heap::mark(const void *p, bool major)
+{
+    Cell *cell = cell_of(p);
+    if (!cell || cell->marked || (cell->old && !major))
+        return;
+    cell->marked = 1;
+    m_work.push_back(cell);
+}
+
+void Heap::mark_range(const IValue *begin, const IValue *end, bool major)
+{
+    for (const IValue *v = begin; v < end; v++)
+        mark(v->str_value, major);
+}
+
+void Heap::trace(Cell *cell, bool major)
+{
+    if (cell->kind != LIST)
+        return;
+    const List *list = (const List *)cell->payload;
+    if (list->element_type() == ::Type::INT || list->element_type() == ::Type::DOUBLE)
+        return;
+    for (uint32 i = 0; i < list->size(); i++)
+        mark(list->at(i).str_value, major);
+}
+
+void Heap::release(Cell *cell)
+{
+    if (cell->kind == STRING) {
+        String *str = (String *)cell->payload;
+        if (--str->buffer->refs == 0) {
+            free(str->buffer->data);
+            delete str->buffer;
+        }
+        str->~String();
+    } else if (cell->kind == LIST) {
+        ((List *)cell->payload)->~List();
+    }
+    cell->kind = FREE;
+}
+
+void Heap::collect(const Roots &roots)
+{
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const bool major = m_old_cells >= m_major_at;
+
+    mark_range(roots.stack, roots.stack_end, major);
+    mark_range(roots.frames, roots.frames_end, major);
+    while (!m_work.empty()) {
+        Cell *cell = m_work.back();
+        m_work.pop_back();
+        trace(cell, major);
+    }
+
+    size_t freed = 0;
+    if (major) {
+        m_old_cells = 0;
+        for (auto chunk : m_chunks) {
+            Cell *cells = (Cell *)chunk;
+            for (size_t i = 0; i < CHUNK_BYTES / CELL_BYTES; i++) {
+                Cell *cell = &cells[i];
+                if (cell->kind == FREE)
+                    continue;
+                if (cell->marked) {
+                    cell->marked = 0;
+                    cell->old = 1;
+                    m_old_cells++;
+                } else {
+                    release(cell);
+                    cell->next = m_free;
+                    m_free = cell;
+                    freed++;
+                }
+            }
+        }
+        m_major_at = std::max((size_t)MIN_OLD_CELLS, 2 * m_old_cells);
+        m_major_collections++;
+    } else {
+        for (auto cell : m_young) {
+            if (cell->marked) {
+                cell->marked = 0;
+                cell->old = 1;
+                m_old_cells++;
+            } else {
+                release(cell);
+                cell->next = m_free;
+                m_free = cell;
+                freed++;
+            }
+        }
+        m_minor_collections++;
+    }
+    m_young.clear();
+
+    const double pause = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    m_total_pause += pause;
+    m_max_pause = std::max(m_max_pause, pause);
+    if (m_debug)
+        printf("gc: %s collection freed %zu objects, %zu live, %.3f ms\n",
+               major ? "major" : "minor", freed, m_old_cells, pause);
+}
+
+void Heap::print_stats(FILE *fp) const
+{
+    fprintf(fp, "gc: %u minor and %u major collections, %.3f ms total pause, %.3f ms max\n",
+            m_minor_collections, m_major_collections, m_total_pause, m_max_pause);
+    fprintf(fp, "gc: heap %zu KB in %zu chunks, %zu objects live, peak %zu\n",
+            m_chunks.size() * CHUNK_BYTES / 1024, m_chunks.size(),
+            m_old_cells + m_young.size(), m_peak_cells);
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+struct IValue;
+class List;
+
+/*
+    The garbage collected heap: every string and list a program creates
+    while it runs lives here. String literals are not heap objects, they
+    belong to the constant pool and stay alive for the whole run.
+
+    Objects are kept in fixed size cells, carved out of CHUNK_BYTES
+    aligned chunks, so whether a word is the address of an object is a
+    mask and a lookup. A new object takes a cell freed by an earlier
+    collection, or else the next one of the newest chunk.
+
+    Collection is generational without moving anything. The objects
+    allocated since the last collection are the nursery; after
+    NURSERY_CELLS of them a minor collection marks what the roots reach
+    of the nursery, frees the rest of it and promotes the survivors to the
+    old generation. Lists never change once built and are only ever built
+    from older values, so an old object can't point to a young one and
+    nothing has to record such pointers. When the old generation has
+    doubled since the last major collection, the next collection marks
+    and sweeps everything instead.
+*/
+class Heap {
+public:
+    /*
+        Where a collection looks for references: the live part of the
+        operand stack and the call frames. Values carry no type at run
+        time, so every word there that is the address of an object keeps
+        it alive. Within objects the element type of a list tells which
+        words are references.
+    */
+    struct Roots {
+        const IValue *stack, *stack_end;
+        const IValue *frames, *frames_end;
+    };
+
+    enum {
+        CELL_BYTES = 64,
+        CHUNK_BYTES = 64 << 10,
+        NURSERY_CELLS = 4096,
+        MIN_OLD_CELLS = 16384
+    };
+
+    Heap();
+    ~Heap();
+
+    /*
+        These may collect first, so everything live, including the
+        operands, must be in roots.
+
+        concat returns a + b. Its text goes into a growable buffer that it
+        shares with a when a is the longest string built in that buffer so
+        far, so s = s + piece in a loop copies every piece once. The
+        std::string of the result is only filled in by flatten, which
+        everything that reads the text of a string has to call.
+    */
+    const std::string *concat(const std::string *a, const std::string *b, const Roots &roots);
+    List *new_list(int element_type, uint32_t capacity, const Roots &roots);
+    const std::string &flatten(const std::string *s);
+
+    /*
+        The heap of a worker of a parallel foreach, which also reads the
+        objects of parent. Those don't change while the loop runs, except
+        that their strings are flattened, under the parent's lock as
+        several workers may read one at once. A worker never appends to
+        the buffer of a parent's string.
+    */
+    void set_parent(Heap *parent) { m_parent = parent; }
+
+    // print every collection
+    void set_debug(bool enabled) { m_debug = enabled; }
+    void print_stats(FILE *fp) const;
+
+private:
+    enum Kind {
+        FREE,
+        STRING,
+        LIST
+    };
+
+    /*
+        Text shared by the strings concatenated onto each other. Bytes
+        below size never change, each string reads the first length of
+        them.
+    */
+    struct Buffer {
+        char *data;
+        size_t size, capacity;
+        uint32_t refs;
+    };
+
+    /* what a STRING cell holds, IValues point to text */
+    struct String {
+        std::string text;
+        Buffer *buffer;
+        size_t length;
+    };
+
+    struct Cell {
+        uint8_t kind;
+        uint8_t old;
+        uint8_t marked;
+        union {
+            Cell *next;     // in the free list
+            char payload[CELL_BYTES - 8];
+            double align;
+        };
+    };
+
+    Cell *allocate(const Roots &roots);
+    void collect(const Roots &roots);
+    Cell *cell_of(const void *p) const;
+    String *string_of(const std::string *s) const;
+    void mark(const void *p, bool major);
+    void mark_range(const IValue *begin, const IValue *end, bool major);
+    void trace(Cell *cell, bool major);
+    void release(Cell *cell);
+
+    std::vector<char *> m_chunks;
+    std::unordered_set<uintptr_t> m_chunk_set;
+    uintptr_t m_lowest, m_highest;
+    Cell *m_bump, *m_bump_end;
+    Cell *m_free;
+
+    Heap *m_parent;
+    std::mutex m_shared_lock;
+    bool m_debug;
+
+    std::vector<Cell *> m_young;
+    std::vector<Cell *> m_work;
+    size_t m_old_cells;
+    size_t m_major_at;
+
+    // statistics for --gc-stats
+    uint32_t m_minor_collections;
+    uint32_t m_major_collections;
+    double m_total_pause;
+    double m_max_pause;
+    size_t m_peak_cells;
+};
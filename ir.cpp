@@ -0,0 +1,440 @@
+#include <algorithm>
+#include <cstdio>
+#include "ir.h"
+
+namespace ir {
+
+bool Value::has_result() const
+{
+    switch (op) {
+    case STORE: case PARALLEL: case ASSERT: case PRINT:
+        return false;
+    default:
+        return !is_terminator();
+    }
+}
+
+/*
+    Whether the value only depends on its operands, so it can be moved
+    or removed.
+*/
+bool Value::is_pure() const
+{
+    switch (op) {
+    case CONST: case UNDEF: case PHI:
+    case ADD: case SUB: case MUL: case AND: case CMP: case CLT:
+    case LENGTH:
+        return true;
+    case DIV:
+        // Int division by zero traps
+        return type.id == ::Type::DOUBLE;
+    default:
+        return false;
+    }
+}
+
+const char *name(Op op)
+{
+    static const char *const names[] = {
+        "const", "undef", "load", "store", "phi",
+        "add", "sub", "mul", "div", "and", "cmp", "clt",
+        "call", "parallel", "make-list", "length", "element",
+        "assert", "print",
+        "jump", "branch", "return"
+    };
+    return names[op];
+}
+
+Function::~Function()
+{
+    for (auto v : values)
+        delete v;
+    for (auto b : all_blocks)
+        delete b;
+}
+
+BasicBlock *Function::new_block()
+{
+    all_blocks.push_back(new BasicBlock(all_blocks.size()));
+    return all_blocks.back();
+}
+
+Value *Function::new_value(Op op, ::Type type)
+{
+    Value *v = new Value(op, type);
+    v->id = values.size();
+    values.push_back(v);
+    return v;
+}
+
+const char *suffix(::Type t)
+{
+    switch (t.id) {
+    case ::Type::INT: return ".i";
+    case ::Type::DOUBLE: return ".d";
+    case ::Type::STRING: return ".s";
+    case ::Type::LIST: return ".l";
+    default: return "";
+    }
+}
+
+namespace {
+
+void print_operand(const Value *v)
+{
+    if (v->op == CONST && v->type.id == ::Type::INT)
+        printf("%d", v->imm);
+    else if (v->op == CONST && v->type.id == ::Type::DOUBLE)
+        printf("%g", v->dbl);
+    else if (v->op == CONST)
+        printf("\"%s\"", v->str->c_str());
+    else if (v->op == UNDEF)
+        printf("undef");
+    else
+        printf("%%%d", v->id);
+}
+
+}
+
+void Function::dump() const
+{
+    printf("function %s\n", name.c_str());
+    for (auto b : blocks) {
+        // what is left after the last return
+        if (b != entry() && b->preds.empty() && b->insns.empty())
+            continue;
+        printf("b%d:", b->id);
+        if (!b->preds.empty()) {
+            printf("%*s; preds", b->id < 10 ? 4 : 3, "");
+            for (auto p : b->preds)
+                printf(" b%d", p->id);
+        }
+        printf("\n");
+        for (auto v : b->insns) {
+            printf("    ");
+            if (v->has_result())
+                printf("%%%d = ", v->id);
+            printf("%s%s", ir::name(v->op), suffix(v->type));
+            if (v->op == LOAD || v->op == STORE)
+                printf(" [%d]%s", v->imm, v->args.empty() ? "" : ",");
+            else if (v->op == CALL)
+                printf(" @%d", v->imm);
+            else if (v->op == PARALLEL)
+                printf(" body %d", v->imm);
+            for (size_t i = 0; i < v->args.size(); i++) {
+                printf(i ? ", " : " ");
+                if (v->op == PHI)
+                    printf("[");
+                print_operand(v->args[i]);
+                if (v->op == PHI)
+                    printf(", b%d]", b->preds[i]->id);
+            }
+            for (size_t i = 0; i < b->succs.size() && v->is_terminator(); i++)
+                printf("%sb%d", i || !v->args.empty() ? ", " : " ", b->succs[i]->id);
+            printf("\n");
+        }
+    }
+}
+
+void replace_uses(Value *from, Value *to)
+{
+    for (auto user : from->users) {
+        std::replace(user->args.begin(), user->args.end(), from, to);
+        to->users.push_back(user);
+    }
+    from->users.clear();
+    from->forward = to;
+}
+
+/*
+    Take v out of its block; it must not have any users left.
+*/
+void remove(Value *v)
+{
+    std::vector<Value*> &insns = v->block->insns;
+    insns.erase(std::find(insns.begin(), insns.end(), v));
+    v->block = 0;
+    for (auto arg : v->args) {
+        std::vector<Value*> &u = arg->users;
+        std::vector<Value*>::iterator it = std::find(u.begin(), u.end(), v);
+        if (it != u.end())
+            u.erase(it);
+    }
+    v->args.clear();
+}
+
+/*
+    Remove the edge from -> to, along with the operands the phis in to
+    had for it.
+*/
+void remove_edge(BasicBlock *from, BasicBlock *to)
+{
+    const size_t index = std::find(to->preds.begin(), to->preds.end(), from) - to->preds.begin();
+    for (auto phi : to->insns) {
+        if (phi->op != PHI)
+            continue;
+        Value *arg = phi->args[index];
+        arg->users.erase(std::find(arg->users.begin(), arg->users.end(), phi));
+        phi->args.erase(phi->args.begin() + index);
+    }
+    to->preds.erase(to->preds.begin() + index);
+    from->succs.erase(std::find(from->succs.begin(), from->succs.end(), to));
+}
+
+Builder::Builder(Function *f)
+    : m_function(f), m_block(0)
+{
+    BasicBlock *entry = f->new_block();
+    set_block(entry);
+    seal(entry);
+}
+
+/*
+    Continue generating code in block, which goes after all blocks that
+    were started before it.
+*/
+void Builder::set_block(BasicBlock *block)
+{
+    if (!block->placed) {
+        block->placed = true;
+        m_function->blocks.push_back(block);
+    }
+    m_block = block;
+}
+
+void Builder::seal(BasicBlock *block)
+{
+    for (auto it : block->incomplete)
+        add_phi_operands(it.first, it.second);
+    block->incomplete.clear();
+    block->sealed = true;
+}
+
+namespace {
+
+/* what a value removed as a trivial phi has been replaced by */
+Value *resolve(Value *v)
+{
+    while (v->forward)
+        v = v->forward;
+    return v;
+}
+
+}
+
+void Builder::write_variable(int var, Value *value)
+{
+    if (value->var < 0 && value->op != CONST && value->op != UNDEF)
+        value->var = var;
+    m_block->defs[var] = value;
+}
+
+Value *Builder::read_variable(int var)
+{
+    return read_variable(var, m_block);
+}
+
+Value *Builder::read_variable(int var, BasicBlock *block)
+{
+    std::map<int, Value*>::iterator it = block->defs.find(var);
+    if (it != block->defs.end())
+        return it->second = resolve(it->second);
+
+    Value *v;
+    if (!block->sealed) {
+        v = new_phi(block);
+        v->var = var;
+        block->incomplete[var] = v;
+    } else if (block->preds.size() == 1) {
+        v = read_variable(var, block->preds[0]);
+    } else if (block->preds.empty()) {
+        v = undef(::Type::UNKNOWN);
+    } else {
+        // break cycles through loops with an operandless phi first
+        Value *phi = new_phi(block);
+        phi->var = var;
+        block->defs[var] = phi;
+        v = add_phi_operands(var, phi);
+    }
+    // removing a trivial phi can take v with it
+    v = resolve(v);
+    block->defs[var] = v;
+    return v;
+}
+
+Value *Builder::new_phi(BasicBlock *block)
+{
+    Value *phi = m_function->new_value(PHI, ::Type::UNKNOWN);
+    phi->block = block;
+    std::vector<Value*>::iterator pos = block->insns.begin();
+    while (pos != block->insns.end() && (*pos)->op == PHI)
+        ++pos;
+    block->insns.insert(pos, phi);
+    return phi;
+}
+
+Value *Builder::add_phi_operands(int var, Value *phi)
+{
+    for (auto pred : phi->block->preds) {
+        Value *v = resolve(read_variable(var, pred));
+        phi->args.push_back(v);
+        v->users.push_back(phi);
+        if (phi->type.id == ::Type::UNKNOWN)
+            phi->type = v->type;
+    }
+    return resolve(try_remove_trivial_phi(phi));
+}
+
+/*
+    A phi that only merges one value (and itself) is replaced by that
+    value, which may make phis using it trivial as well.
+*/
+Value *Builder::try_remove_trivial_phi(Value *phi)
+{
+    Value *same = 0;
+    for (auto op : phi->args) {
+        if (op == same || op == phi)
+            continue;
+        if (same)
+            return phi;
+        same = op;
+    }
+    if (!same)
+        same = undef(phi->type);
+
+    std::vector<Value*> users;
+    for (auto user : phi->users) {
+        if (user != phi)
+            users.push_back(user);
+    }
+    BasicBlock *block = phi->block;
+    block->insns.erase(std::find(block->insns.begin(), block->insns.end(), phi));
+    phi->block = 0;
+    replace_uses(phi, same);
+    for (auto arg : phi->args) {
+        std::vector<Value*> &u = arg->users;
+        std::vector<Value*>::iterator it = std::find(u.begin(), u.end(), phi);
+        if (it != u.end())
+            u.erase(it);
+    }
+    phi->args.clear();
+
+    for (auto user : users) {
+        if (user->op == PHI && user->block)
+            try_remove_trivial_phi(user);
+    }
+    return same;
+}
+
+Value *Builder::constant(int i)
+{
+    Value *v = m_function->new_value(CONST, ::Type::INT);
+    v->imm = i;
+    return v;
+}
+
+Value *Builder::constant(double d)
+{
+    Value *v = m_function->new_value(CONST, ::Type::DOUBLE);
+    v->dbl = d;
+    return v;
+}
+
+Value *Builder::constant(const std::string *str)
+{
+    Value *v = m_function->new_value(CONST, ::Type::STRING);
+    v->str = str;
+    return v;
+}
+
+Value *Builder::undef(::Type type)
+{
+    return m_function->new_value(UNDEF, type);
+}
+
+void Builder::append(Value *v)
+{
+    v->block = m_block;
+    m_block->insns.push_back(v);
+    for (auto arg : v->args)
+        arg->users.push_back(v);
+}
+
+Value *Builder::emit(Op op, ::Type type, int line)
+{
+    Value *v = m_function->new_value(op, type);
+    v->line = line;
+    append(v);
+    return v;
+}
+
+Value *Builder::emit(Op op, ::Type type, Value *a, int line)
+{
+    Value *v = m_function->new_value(op, type);
+    v->line = line;
+    v->args.push_back(a);
+    append(v);
+    return v;
+}
+
+Value *Builder::emit(Op op, ::Type type, Value *a, Value *b, int line)
+{
+    Value *v = m_function->new_value(op, type);
+    v->line = line;
+    v->args.push_back(a);
+    v->args.push_back(b);
+    append(v);
+    return v;
+}
+
+Value *Builder::load(int slot, ::Type type)
+{
+    Value *v = emit(LOAD, type);
+    v->imm = slot;
+    return v;
+}
+
+void Builder::store(int slot, Value *value)
+{
+    emit(STORE, value->type, value)->imm = slot;
+}
+
+Value *Builder::call(int target, ::Type type)
+{
+    Value *v = emit(CALL, type);
+    v->imm = target;
+    return v;
+}
+
+void Builder::link(BasicBlock *from, BasicBlock *to)
+{
+    from->succs.push_back(to);
+    to->preds.push_back(from);
+}
+
+void Builder::jump(BasicBlock *to)
+{
+    emit(JUMP, ::Type::VOID);
+    link(m_block, to);
+}
+
+void Builder::branch(Value *cond, BasicBlock *then, BasicBlock *otherwise)
+{
+    emit(BRANCH, ::Type::VOID, cond);
+    link(m_block, then);
+    link(m_block, otherwise);
+}
+
+/*
+    Code after a return is unreachable; it goes into a block of its own
+    that has no predecessors.
+*/
+void Builder::ret(Value *value)
+{
+    emit(RETURN, ::Type::VOID, value);
+    BasicBlock *dead = new_block();
+    set_block(dead);
+    seal(dead);
+}
+
+}
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "type.h"
+
+/*
+    SSA intermediate representation between the AST and the bytecode.
+
+    Node::codeGen builds one ir::Function per source function: a control
+    flow graph of BasicBlocks, each a list of Values that ends in a
+    terminator (JUMP, BRANCH or RETURN). Variables are not
+    stored anywhere, every assignment defines a new Value and a read finds
+    the one that reaches it, with a PHI where control flow merges (see
+    Builder::read_variable). Constants belong to no block and are
+    rematerialized wherever they are used.
+
+    lower.cpp turns a Function back into stack bytecode, which is what the
+    interpreter runs and the JIT compiles.
+*/
+namespace ir {
+
+enum Op {
+    CONST,          // Int in imm, Double in dbl, String in str
+    UNDEF,          // read of a variable that has not been assigned
+    LOAD,           // parameter imm of the function, on entry
+    STORE,          // argument imm of the next CALL = args[0]
+    PHI,            // args[i] is the value coming from block->preds[i]
+    ADD, SUB, MUL, DIV, AND, CMP, CLT,
+    CALL,           // call the function at code address imm
+    PARALLEL,       // parallel foreach body imm for each index from args[0] to args[1] by args[2]
+    MAKE_LIST,
+    LENGTH,         // number of elements of the list args[0]
+    ELEMENT,        // args[0][args[1]], type is that of the element
+    ASSERT,
+    PRINT,
+
+    // terminators
+    JUMP,
+    BRANCH,         // to succs[0] if args[0] is 1, else to succs[1]
+    RETURN
+};
+
+class BasicBlock;
+
+/*
+    An instruction and the value it defines. type is the type the
+    operation works on, which picks the typed opcode when lowering; for
+    CMP and CLT that is the type of the operands, the result is an Int.
+*/
+class Value {
+public:
+    Value(Op op, ::Type type)
+        : op(op), type(type), block(0), imm(0), dbl(0), str(0),
+          var(-1), id(-1), line(0), forward(0) { }
+
+    Op op;
+    ::Type type;
+    std::vector<Value*> args;
+    BasicBlock *block;
+
+    int imm;
+    double dbl;
+    const std::string *str;
+
+    // slot of the variable this value was first assigned to, or -1
+    int var;
+    int id;
+    int line;
+
+    std::vector<Value*> users;
+    // set when a trivial phi has been replaced by another value
+    Value *forward;
+
+    bool is_terminator() const { return op >= JUMP; }
+    bool has_result() const;
+    bool is_pure() const;
+};
+
+class BasicBlock {
+public:
+    BasicBlock(int id) : id(id), sealed(false), placed(false) { }
+
+    int id;
+    std::vector<Value*> insns;
+    std::vector<BasicBlock*> preds;
+    std::vector<BasicBlock*> succs;
+
+    // SSA construction state, see Builder
+    bool sealed;
+    bool placed;
+    std::map<int, Value*> defs;
+    std::map<int, Value*> incomplete;
+
+    Value *terminator() const
+    {
+        return !insns.empty() && insns.back()->is_terminator() ? insns.back() : 0;
+    }
+};
+
+/*
+    The blocks are kept in layout order, the order in which code was
+    generated for them, which lowering follows.
+*/
+class Function {
+public:
+    Function(const std::string &name) : name(name), params(0) { }
+    ~Function();
+
+    std::string name;
+    int params;
+    std::vector<BasicBlock*> blocks;
+    std::vector<BasicBlock*> all_blocks;
+    std::vector<Value*> values;
+
+    BasicBlock *entry() const { return blocks.front(); }
+    BasicBlock *new_block();
+    Value *new_value(Op op, ::Type type);
+
+    void dump() const;
+};
+
+void replace_uses(Value *from, Value *to);
+void remove(Value *v);
+void remove_edge(BasicBlock *from, BasicBlock *to);
+const char *name(Op op);
+// ".i", ".d", ... as in dumps
+const char *suffix(::Type t);
+
+/* opt.cpp: constant folding, loop-invariant code motion, strength reduction */
+void optimize(Function &f, bool report);
+
+/*
+    Builds a Function while the AST is walked, constructing SSA form on
+    the fly (Braun et al., "Simple and Efficient Construction of Static
+    Single Assignment Form"). A block is sealed once all its predecessors
+    are known; reads in a block that isn't sealed yet get an incomplete
+    phi whose operands are filled in by seal().
+*/
+class Builder {
+public:
+    Builder(Function *f);
+
+    Function *function() const { return m_function; }
+    BasicBlock *block() const { return m_block; }
+    bool terminated() const { return m_block->terminator() != 0; }
+
+    BasicBlock *new_block() { return m_function->new_block(); }
+    void set_block(BasicBlock *block);
+    void seal(BasicBlock *block);
+
+    void write_variable(int var, Value *value);
+    Value *read_variable(int var);
+
+    Value *constant(int i);
+    Value *constant(double d);
+    Value *constant(const std::string *str);
+    Value *undef(::Type type);
+
+    Value *emit(Op op, ::Type type, int line = 0);
+    Value *emit(Op op, ::Type type, Value *a, int line = 0);
+    Value *emit(Op op, ::Type type, Value *a, Value *b, int line = 0);
+    Value *load(int slot, ::Type type);
+    void store(int slot, Value *value);
+    Value *call(int target, ::Type type);
+
+    void jump(BasicBlock *to);
+    void branch(Value *cond, BasicBlock *then, BasicBlock *otherwise);
+    void ret(Value *value);
+
+private:
+    Value *read_variable(int var, BasicBlock *block);
+    Value *add_phi_operands(int var, Value *phi);
+    Value *try_remove_trivial_phi(Value *phi);
+    Value *new_phi(BasicBlock *block);
+    void append(Value *v);
+    void link(BasicBlock *from, BasicBlock *to);
+
+    Function *m_function;
+    BasicBlock *m_block;
+};
+
+}
@@ -0,0 +1,1124 @@
+#include <set>
+#include "vm.h"
+
+/*
+    x86-64 JIT for ToyVm bytecode.
+
+    At every jump target, call and return the generated code has the
+    operand stack in m_mem with exactly the layout the interpreter uses,
+    so both agree on every value. In between, stack entries are kept in
+    registers, and slots in the registers regalloc.cpp assigned to them.
+    Registers:
+
+        r15         : m_mem
+        r14         : operand stack pointer, an index into m_mem like sp in run()
+        r13         : the Double section of the constant pool
+        r12         : the current call frame, which slots are addressed in
+        rbx         : rsp saved around calls into C++ helpers
+        rbp         : rsp in enter(), to leave from any call depth on END_OF_CODE
+        r8-r11      : Int (and other non Double) slots
+        xmm8-xmm15  : Double slots
+        rcx, rsi, rdi, xmm2-xmm7 : operand stack entries
+        rax, rdx, xmm0, xmm1     : scratch
+
+    Every instruction starts with a label named after its pc, so branches
+    map directly onto jumps and CALL/RET onto native call/ret. Int and
+    Double arithmetic is done inline, everything that touches strings or
+    lists calls one of the helpers below.
+
+    Code is compiled either for the whole program (recompile()) or one
+    function at a time when tiered execution finds it hot. Calls to
+    functions outside the compiled range go to their native code if they
+    have any, otherwise back into the interpreter.
+*/
+
+namespace {
+
+void jit_assert(ToyVm *vm, int val)
+{
+    vm->check(val);
+}
+
+void jit_print_int(ToyVm *vm, int val)
+{
+    vm->print_int(val);
+}
+
+void jit_print_double(ToyVm *vm, double val)
+{
+    vm->print_double(val);
+}
+
+void jit_print_string(ToyVm *vm, const std::string *str)
+{
+    vm->print_string(str);
+}
+
+void jit_print_list(ToyVm *vm, const List *val)
+{
+    vm->print_list(val);
+}
+
+void jit_stack_overflow(ToyVm *vm)
+{
+    vm->stack_overflow();
+}
+
+// sp comes back sign extended, past the bottom is below m_mem (see ToyVm::stack)
+uint64 jit_concat(ToyVm *vm, uint64 sp, const IValue *frame)
+{
+    return (int32_t)vm->concat(sp, frame);
+}
+
+int jit_equal(ToyVm *vm, const std::string *a, const std::string *b)
+{
+    return vm->equal(a, b);
+}
+
+uint64 jit_make_list(ToyVm *vm, uint64 sp, const IValue *frame, uint32 n, int element_type)
+{
+    return (int32_t)vm->make_list(sp, frame, n, element_type);
+}
+
+uint64 jit_parallel(ToyVm *vm, uint64 sp, IValue *frame, uint32 entry, uint32 values, uint32 frame_size)
+{
+    return (int32_t)vm->parallel(sp, frame, entry, values, frame_size);
+}
+
+uint64 jit_call_function(ToyVm *vm, uint32 target, uint64 sp, IValue *frame)
+{
+    return (int32_t)vm->call_function(target, sp, frame);
+}
+
+const Reg64 mem(Operand::R15);
+const Reg64 vsp(Operand::R14);
+const Reg64 constants(Operand::R13);
+const Reg64 frame(Operand::R12);
+
+enum {
+    // temporaries for the operand stack: rcx, rsi, rdi and xmm2-xmm7, one
+    // bit per register in m_free_temps, xmm at bit 16 on
+    TEMPS = (1 << Operand::RCX) | (1 << Operand::RSI) | (1 << Operand::RDI) | (0xfc << 16)
+};
+
+enum Condition {
+    ALWAYS, IF_E, IF_NE, IF_L, IF_GE, IF_A, IF_BE
+};
+
+std::string entry_label(uint32 pc)
+{
+    return ".entry" + Label::toStr(pc);
+}
+
+}
+
+/*
+    Call a C++ function with the stack aligned as the ABI requires; the
+    call depth of the generated code leaves rsp at an arbitrary multiple
+    of 8. Arguments have to be in place already.
+*/
+void ToyVm::jit_call(const void *fn)
+{
+    mov(rbx, rsp);
+    and(rsp, -16);
+    mov(rax, (size_t)fn);
+    call(rax);
+    mov(rsp, rbx);
+}
+
+/*
+    uint64 enter(const uint8 *code, uint64 sp, IValue *frame) sets up the
+    registers, calls code and returns the operand stack pointer it leaves
+    behind. All generated code is run through it.
+*/
+void ToyVm::emit_enter()
+{
+    m_enter = getCurr();
+    push(rbp);
+    push(rbx);
+    push(r12);
+    push(r13);
+    push(r14);
+    push(r15);
+    mov(rbp, rsp);
+    mov(mem, (size_t)m_mem);
+    mov(vsp, rsi);
+    mov(frame, rdx);
+    mov(constants, (size_t)m_constants->doubles().data());
+    call(rdi);
+
+    m_leave = getCurr();
+    mov(rax, vsp);
+    mov(rsp, rbp);
+    pop(r15);
+    pop(r14);
+    pop(r13);
+    pop(r12);
+    pop(rbx);
+    pop(rbp);
+    ret();
+}
+
+uint32 ToyVm::enter(const uint8 *code, uint32 sp, IValue *frame)
+{
+    return ((uint64 (*)(const uint8 *, uint64, IValue *))m_enter)(code, (int32_t)sp, frame);
+}
+
+void ToyVm::push_value(const Loc &v)
+{
+    m_vstack.push_back(v);
+}
+
+/*
+    Once the compile time stack is empty, values come from the operand
+    stack in m_mem; vsp is only adjusted when the block is synced.
+*/
+ToyVm::Loc ToyVm::pop_value()
+{
+    if (m_vstack.empty())
+        return Loc(Loc::STACK, ++m_adjust);
+    Loc v = m_vstack.back();
+    m_vstack.pop_back();
+    return v;
+}
+
+/*
+    A free temporary register; when there is none the stack is written
+    back to m_mem, which frees all that are on it.
+*/
+ToyVm::Loc ToyVm::alloc_temp(bool xmm)
+{
+    const uint32 mask = xmm ? 0xffff0000 : 0xffff;
+    if (!(m_free_temps & mask))
+        flush();
+    assert(m_free_temps & mask);
+    const int bit = __builtin_ctz(m_free_temps & mask);
+    m_free_temps &= ~(1u << bit);
+    return xmm ? Loc(Loc::XMM, bit - 16) : Loc(Loc::GPR, bit);
+}
+
+void ToyVm::release(const Loc &v)
+{
+    if (v.kind == Loc::GPR)
+        m_free_temps |= 1u << v.n;
+    else if (v.kind == Loc::XMM)
+        m_free_temps |= 1u << (v.n + 16);
+}
+
+/*
+    The register v is in, -1 if it is in memory or an immediate.
+*/
+int ToyVm::register_of(const Loc &v, bool *xmm) const
+{
+    if (v.kind == Loc::GPR || v.kind == Loc::XMM) {
+        *xmm = v.kind == Loc::XMM;
+        return v.n;
+    }
+    const Interval *in = v.kind == Loc::SLOT ? interval_of(v.n) : 0;
+    if (!in)
+        return -1;
+    *xmm = in->xmm;
+    return in->reg;
+}
+
+Address ToyVm::address(const Loc &v)
+{
+    return address(v, qword);
+}
+
+Address ToyVm::address(const Loc &v, const AddressFrame &size)
+{
+    switch (v.kind) {
+    case Loc::CONSTANT:
+        return size[constants + v.n * 8];
+    case Loc::SLOT:
+        return size[frame + v.n * 8];
+    case Loc::STACK:
+        return size[mem + vsp * 8 + v.n * 8];
+    default:
+        assert(0);
+        return size[mem];
+    }
+}
+
+void ToyVm::load_gpr(const Reg64 &r, const Loc &v)
+{
+    bool xmm;
+    const int reg = register_of(v, &xmm);
+    if (v.kind == Loc::IMM)
+        mov(Reg32(r.getIdx()), v.n);
+    else if (reg < 0)
+        mov(r, address(v));
+    else if (xmm)
+        movq(r, Xmm(reg));
+    else if (reg != r.getIdx())
+        mov(r, Reg64(reg));
+}
+
+void ToyVm::load_xmm(const Xmm &x, const Loc &v)
+{
+    bool xmm;
+    const int reg = register_of(v, &xmm);
+    if (v.kind == Loc::IMM) {
+        mov(eax, v.n);
+        movq(x, rax);
+    } else if (reg < 0) {
+        movsd(x, address(v));
+    } else if (!xmm) {
+        movq(x, Reg64(reg));
+    } else if (reg != x.getIdx()) {
+        movaps(x, Xmm(reg));
+    }
+}
+
+void ToyVm::store(const Address &dst, const Loc &v)
+{
+    bool xmm;
+    const int reg = register_of(v, &xmm);
+    if (v.kind == Loc::IMM) {
+        mov(dst, v.n);
+    } else if (reg < 0) {
+        mov(rax, address(v));
+        mov(dst, rax);
+    } else if (xmm) {
+        movsd(dst, Xmm(reg));
+    } else {
+        mov(dst, Reg64(reg));
+    }
+}
+
+/*
+    STOREL: stack entries still referring to the old value of the slot get
+    a copy of it first.
+*/
+void ToyVm::assign(uint32 slot, const Loc &v)
+{
+    const Interval *in = interval_of(slot);
+    for (size_t i = 0; i < m_vstack.size(); i++) {
+        if (m_vstack[i].kind != Loc::SLOT || m_vstack[i].n != (int)slot)
+            continue;
+        Loc copy = alloc_temp(in && in->xmm);
+        if (m_vstack.empty()) {
+            // written back, nothing refers to the slot any more
+            release(copy);
+            break;
+        }
+        if (copy.kind == Loc::XMM)
+            load_xmm(Xmm(copy.n), m_vstack[i]);
+        else
+            load_gpr(Reg64(copy.n), m_vstack[i]);
+        m_vstack[i] = copy;
+    }
+
+    if (!in)
+        store(qword[frame + slot * 8], v);
+    else if (in->xmm)
+        load_xmm(Xmm(in->reg), v);
+    else
+        load_gpr(Reg64(in->reg), v);
+    release(v);
+}
+
+/*
+    Write the compile time stack to the operand stack in m_mem.
+*/
+void ToyVm::flush()
+{
+    for (size_t k = 0; k < m_vstack.size(); k++) {
+        store(qword[mem + vsp * 8 + (m_adjust - (int)k) * 8], m_vstack[k]);
+        release(m_vstack[k]);
+    }
+    m_adjust -= m_vstack.size();
+    m_vstack.clear();
+}
+
+/*
+    Bring the operand stack in m_mem and vsp up to date, as they have to
+    be at every jump target. Doesn't touch the flags.
+*/
+void ToyVm::sync()
+{
+    flush();
+    if (m_adjust)
+        lea(vsp, ptr[vsp + m_adjust]);
+    m_adjust = 0;
+}
+
+/*
+    Store or load the registers of all slots whose range covers pc, around
+    instructions that call out of the generated code.
+*/
+void ToyVm::spill_slots(uint32 pc)
+{
+    for (auto &in : m_intervals) {
+        if (!in.covers(pc))
+            continue;
+        if (in.xmm)
+            movsd(qword[frame + in.slot * 8], Xmm(in.reg));
+        else
+            mov(qword[frame + in.slot * 8], Reg64(in.reg));
+    }
+}
+
+void ToyVm::fill_slots(uint32 pc)
+{
+    for (auto &in : m_intervals) {
+        if (!in.covers(pc))
+            continue;
+        if (in.xmm)
+            movsd(Xmm(in.reg), qword[frame + in.slot * 8]);
+        else
+            mov(Reg64(in.reg), qword[frame + in.slot * 8]);
+    }
+}
+
+bool ToyVm::crosses(uint32 from, uint32 to) const
+{
+    for (auto &in : m_intervals) {
+        if (in.covers(from) != in.covers(to))
+            return true;
+    }
+    return false;
+}
+
+/*
+    The moves on the edge from one pc to another: slots whose range is
+    left are stored, then those whose range is entered are loaded.
+*/
+void ToyVm::transfer(uint32 from, uint32 to)
+{
+    for (auto &in : m_intervals) {
+        if (!in.covers(from) || in.covers(to))
+            continue;
+        if (in.xmm)
+            movsd(qword[frame + in.slot * 8], Xmm(in.reg));
+        else
+            mov(qword[frame + in.slot * 8], Reg64(in.reg));
+    }
+    for (auto &in : m_intervals) {
+        if (in.covers(from) || !in.covers(to))
+            continue;
+        if (in.xmm)
+            movsd(Xmm(in.reg), qword[frame + in.slot * 8]);
+        else
+            mov(Reg64(in.reg), qword[frame + in.slot * 8]);
+    }
+}
+
+/*
+    Jump from the instruction at from to the one at to. Conditional jumps
+    that need moves on the edge go through a stub emitted after the
+    function.
+*/
+void ToyVm::jump(uint32 from, uint32 to, int cond)
+{
+    std::string target = Label::toStr(to);
+    if (crosses(from, to)) {
+        if (cond == ALWAYS) {
+            transfer(from, to);
+        } else {
+            EdgeStub stub = { ".edge" + Label::toStr(from), from, to };
+            m_edge_stubs.push_back(stub);
+            target = stub.label;
+        }
+    }
+    const char *label = target.c_str();
+    switch (cond) {
+    case ALWAYS: jmp(label, T_NEAR); break;
+    case IF_E: je(label, T_NEAR); break;
+    case IF_NE: jne(label, T_NEAR); break;
+    case IF_L: jl(label, T_NEAR); break;
+    case IF_GE: jge(label, T_NEAR); break;
+    case IF_A: ja(label, T_NEAR); break;
+    case IF_BE: jbe(label, T_NEAR); break;
+    }
+}
+
+/*
+    Int operators; if branch is set the comparison goes straight into a
+    conditional jump to it.
+*/
+void ToyVm::lower_int(uint32 code, const Micro *branch, uint32 pc)
+{
+    Loc a = pop_value();
+    Loc b = pop_value();
+    const bool compare = code == CMP_I || code == CLT_I;
+
+    // b op a, into b if it is a temporary already
+    Loc d = b;
+    if (!(compare && branch) && b.kind != Loc::GPR)
+        d = alloc_temp(false);
+    const Reg32 dst(d.kind == Loc::GPR ? d.n : Operand::EAX);
+
+    bool xmm;
+    const int ra = register_of(a, &xmm);
+    if (ra >= 0 && xmm)
+        movq(rdx, Xmm(ra));
+    const Reg32 src(ra >= 0 && !xmm ? ra : Operand::EDX);
+
+    switch (code) {
+    case AND:
+        load_gpr(rax, b);
+        load_gpr(rdx, a);
+        test(eax, eax);
+        setne(al);
+        test(edx, edx);
+        setne(dl);
+        and(al, dl);
+        movzx(dst, al);
+        break;
+    case DIV_I:
+        load_gpr(rax, b);
+        if (ra < 0 || xmm) {
+            load_gpr(Reg64(dst.getIdx()), a);
+            cdq();
+            idiv(dst);
+        } else {
+            cdq();
+            idiv(src);
+        }
+        mov(dst, eax);
+        break;
+    default: {
+        int rb = register_of(b, &xmm);
+        if (compare && branch && rb >= 0 && !xmm) {
+            // compare in place
+        } else {
+            load_gpr(Reg64(dst.getIdx()), b);
+            rb = dst.getIdx();
+        }
+        const Reg32 lhs(rb);
+        if (a.kind == Loc::IMM) {
+            if (code == ADD_I)
+                add(lhs, a.n);
+            else if (code == SUB_I)
+                sub(lhs, a.n);
+            else if (code == MUL_I)
+                imul(lhs, lhs, a.n);
+            else
+                cmp(lhs, a.n);
+        } else if (ra < 0) {
+            const Address m = address(a, dword);
+            if (code == ADD_I)
+                add(lhs, m);
+            else if (code == SUB_I)
+                sub(lhs, m);
+            else if (code == MUL_I)
+                imul(lhs, m);
+            else
+                cmp(lhs, m);
+        } else {
+            if (code == ADD_I)
+                add(lhs, src);
+            else if (code == SUB_I)
+                sub(lhs, src);
+            else if (code == MUL_I)
+                imul(lhs, src);
+            else
+                cmp(lhs, src);
+        }
+        if (compare && !branch) {
+            if (code == CMP_I)
+                sete(al);
+            else
+                setl(al);
+            movzx(dst, al);
+        }
+        break;
+    }
+    }
+    release(a);
+    if (d.kind != b.kind || d.n != b.n)
+        release(b);
+
+    if (compare && branch) {
+        release(d);
+        sync();
+        if (code == CMP_I)
+            jump(pc, branch->imm, branch->code == JE ? IF_E : IF_NE);
+        else
+            jump(pc, branch->imm, branch->code == JE ? IF_L : IF_GE);
+    } else {
+        push_value(d);
+    }
+}
+
+/*
+    Double operators, comparisons give an Int.
+*/
+void ToyVm::lower_double(uint32 code, const Micro *branch, uint32 pc)
+{
+    Loc a = pop_value();
+    Loc b = pop_value();
+    bool xmm;
+
+    if (code == CLT_D || code == CMP_D) {
+        // b < a is a > b, == has to check for unordered as well
+        Loc d = branch ? Loc(Loc::IMM, 0) : alloc_temp(false);
+        const Loc &first = code == CLT_D ? a : b;
+        const Loc &second = code == CLT_D ? b : a;
+        int r1 = register_of(first, &xmm);
+        if (r1 < 0 || !xmm) {
+            load_xmm(xmm0, first);
+            r1 = 0;
+        }
+        int r2 = register_of(second, &xmm);
+        if (second.kind == Loc::IMM || (r2 >= 0 && !xmm)) {
+            load_xmm(xmm1, second);
+            r2 = 1;
+        }
+        if (code == CMP_D) {
+            if (r2 >= 0)
+                ucomisd(Xmm(r1), Xmm(r2));
+            else
+                ucomisd(Xmm(r1), address(second));
+            sete(al);
+            setnp(dl);
+            and(al, dl);
+        } else {
+            if (r2 >= 0)
+                comisd(Xmm(r1), Xmm(r2));
+            else
+                comisd(Xmm(r1), address(second));
+            if (!branch)
+                seta(al);
+        }
+        release(a);
+        release(b);
+        if (branch) {
+            sync();
+            jump(pc, branch->imm, branch->code == JE ? IF_A : IF_BE);
+        } else {
+            movzx(Reg32(d.n), al);
+            push_value(d);
+        }
+        return;
+    }
+
+    int ra = register_of(a, &xmm);
+    if (a.kind == Loc::IMM || (ra >= 0 && !xmm)) {
+        load_xmm(xmm1, a);
+        ra = 1;
+    }
+    Loc d = b.kind == Loc::XMM ? b : alloc_temp(true);
+    const Xmm dst(d.n);
+    load_xmm(dst, b);
+    if (ra >= 0) {
+        const Xmm src(ra);
+        if (code == ADD_D)
+            addsd(dst, src);
+        else if (code == SUB_D)
+            subsd(dst, src);
+        else if (code == MUL_D)
+            mulsd(dst, src);
+        else
+            divsd(dst, src);
+    } else {
+        const Address src = address(a);
+        if (code == ADD_D)
+            addsd(dst, src);
+        else if (code == SUB_D)
+            subsd(dst, src);
+        else if (code == MUL_D)
+            mulsd(dst, src);
+        else
+            divsd(dst, src);
+    }
+    release(a);
+    if (d.kind != b.kind || d.n != b.n)
+        release(b);
+    push_value(d);
+}
+
+/*
+    JE/JNE on an Int from the stack.
+*/
+void ToyVm::lower_branch(const Micro &micro, uint32 pc)
+{
+    Loc v = pop_value();
+    const int expect = micro.code == JE ? 1 : 0;
+    bool xmm;
+    const int reg = register_of(v, &xmm);
+    if (v.kind == Loc::IMM || (reg >= 0 && xmm)) {
+        load_gpr(rax, v);
+        cmp(eax, expect);
+    } else if (reg >= 0) {
+        cmp(Reg32(reg), expect);
+    } else {
+        cmp(address(v, dword), expect);
+    }
+    release(v);
+    sync();
+    jump(pc, micro.imm, IF_E);
+}
+
+/*
+    Compile the function in [begin, end). Jumps are only allowed within
+    it; other code enters through the stub at begin, or at the header of
+    a loop for on-stack replacement, both recorded in m_native.
+*/
+void ToyVm::emit_function(uint32 begin, uint32 end)
+{
+    std::vector<bool> leader(end - begin, false);
+    std::set<uint32> entries;
+    entries.insert(begin);
+    leader[0] = true;
+    for (uint32 pc = begin; pc < end; pc += length(m_code[pc] >> 24)) {
+        const uint32 code = m_code[pc] >> 24;
+        const uint32 imm = m_code[pc] & 0xffff;
+        if (!is_branch(code) || is_call(code))
+            continue;
+        assert(imm >= begin && imm < end);
+        leader[imm - begin] = true;
+        if (imm <= pc)
+            entries.insert(imm);
+    }
+    allocate_registers(begin, end, leader);
+
+    m_vstack.clear();
+    m_adjust = 0;
+    m_free_temps = TEMPS;
+    m_edge_stubs.clear();
+
+    uint32 prev = begin;
+    bool falls = false;
+    for (uint32 pc = begin; pc < end; pc += length(m_code[pc] >> 24)) {
+        uint32 x = m_code[pc];
+        ::Type t;
+        uint32 code, imm;
+        decode(code, t.id, imm, x);
+
+        if (falls && (leader[pc - begin] || crosses(prev, pc))) {
+            sync();
+            transfer(prev, pc);
+        }
+        L(Label::toStr(pc).c_str());
+
+        Micro micro[4];
+        const int n = expand(&m_code[pc], micro);
+        switch (micro[0].code) {
+        case PUSHI: case LOADL: case STOREL: case POP:
+        case PUSH_CONST_I: case PUSH_CONST_D: case PUSH_CONST_S:
+        case ADD_I: case SUB_I: case MUL_I: case DIV_I: case AND:
+        case CMP_I: case CLT_I:
+        case ADD_D: case SUB_D: case MUL_D: case DIV_D:
+        case CMP_D: case CLT_D:
+        case JE: case JNE:
+        case LENGTH: case ELEMENT:
+            for (int i = 0; i < n; i++) {
+                const Micro *next = i + 1 < n && (micro[i + 1].code == JE || micro[i + 1].code == JNE) ? &micro[i + 1] : 0;
+                switch (micro[i].code) {
+                case PUSHI:
+                    push_value(Loc(Loc::IMM, micro[i].imm));
+                    break;
+                case LOADL:
+                    push_value(Loc(Loc::SLOT, micro[i].imm));
+                    break;
+                case PUSH_CONST_I:
+                    push_value(Loc(Loc::IMM, m_constants->ints()[micro[i].imm]));
+                    break;
+                case PUSH_CONST_D:
+                    push_value(Loc(Loc::CONSTANT, micro[i].imm));
+                    break;
+                case PUSH_CONST_S: {
+                    Loc str = alloc_temp(false);
+                    mov(Reg64(str.n), (size_t)m_constants->strings()[micro[i].imm]);
+                    push_value(str);
+                    } break;
+                case STOREL:
+                    assign(micro[i].imm, pop_value());
+                    break;
+                case POP:
+                    release(pop_value());
+                    break;
+                case CMP_I: case CLT_I:
+                    lower_int(micro[i].code, next, pc);
+                    i += next != 0;
+                    break;
+                case CLT_D:
+                    lower_double(micro[i].code, next, pc);
+                    i += next != 0;
+                    break;
+                case ADD_I: case SUB_I: case MUL_I: case DIV_I: case AND:
+                    lower_int(micro[i].code, 0, pc);
+                    break;
+                case ADD_D: case SUB_D: case MUL_D: case DIV_D: case CMP_D:
+                    lower_double(micro[i].code, 0, pc);
+                    break;
+                case JE: case JNE:
+                    lower_branch(micro[i], pc);
+                    break;
+                case LENGTH: case ELEMENT:
+                    lower_list(micro[i].code, t, pc);
+                    break;
+                }
+            }
+            break;
+
+        case JMP:
+            sync();
+            jump(pc, imm, ALWAYS);
+            break;
+        case RET:
+            sync();
+            spill_slots(pc);
+            ret();
+            break;
+        case END_OF_CODE:
+            sync();
+            spill_slots(pc);
+            jmp(m_leave, T_NEAR);
+            break;
+
+        case ITER_NEXT_OR_JUMP: {
+            const Loc index(Loc::SLOT, m_code[pc + 1] & 0xffff);
+            const Loc length(Loc::SLOT, m_code[pc + 1] >> 16);
+            bool xmm;
+            sync();
+            int r = register_of(index, &xmm);
+            if (r >= 0) {
+                inc(Reg32(r));
+            } else {
+                inc(address(index, dword));
+                mov(eax, address(index, dword));
+                r = eax.getIdx();
+            }
+            const int rl = register_of(length, &xmm);
+            if (rl >= 0)
+                cmp(Reg32(r), Reg32(rl));
+            else
+                cmp(Reg32(r), address(length, dword));
+            jump(pc, imm, IF_L);
+            } break;
+
+        default:
+            // the rest works on the operand stack in m_mem and calls out
+            sync();
+            spill_slots(pc);
+            emit_stack_insn(code, t.id, imm, length(code) > 1 ? m_code[pc + 1] : 0, begin, end);
+            fill_slots(pc);
+            break;
+        }
+
+        falls = code != JMP && code != RET && code != END_OF_CODE;
+        prev = pc;
+    }
+
+    // code that runs into the next function enters it through its stub
+    if (falls) {
+        sync();
+        spill_slots(prev);
+        jmp(entry_label(end).c_str(), T_NEAR);
+    }
+
+    for (auto &stub : m_edge_stubs) {
+        L(stub.label.c_str());
+        transfer(stub.from, stub.to);
+        jmp(Label::toStr(stub.to).c_str(), T_NEAR);
+    }
+    for (auto e : entries) {
+        L(entry_label(e).c_str());
+        m_native[e] = getCurr();
+        transfer(~0u, e);
+        jmp(Label::toStr(e).c_str(), T_NEAR);
+    }
+}
+
+/*
+    LENGTH and ELEMENT read the List directly. The element type of a list
+    is only known at run time, ELEMENT checks whether it is unboxed Ints.
+*/
+void ToyVm::lower_list(uint32 code, ::Type t, uint32 pc)
+{
+    if (code == LENGTH) {
+        Loc list = pop_value();
+        Loc d = list.kind == Loc::GPR ? list : alloc_temp(false);
+        load_gpr(rax, list);
+        mov(Reg32(d.n), dword[rax + offsetof(List, m_size)]);
+        if (d.kind != list.kind || d.n != list.n)
+            release(list);
+        push_value(d);
+        return;
+    }
+
+    const std::string unboxed_int = ".int" + Label::toStr(pc);
+    const std::string done = ".element" + Label::toStr(pc);
+    Loc index = pop_value();
+    Loc list = pop_value();
+    Loc d = alloc_temp(t.id == ::Type::DOUBLE);
+    load_gpr(rdx, index);
+    mov(edx, edx);
+    load_gpr(rax, list);
+    release(index);
+    release(list);
+    cmp(dword[rax + offsetof(List, m_shift)], 2);
+    mov(rax, qword[rax + offsetof(List, m_data)]);
+    je(unboxed_int.c_str());
+    if (d.kind == Loc::XMM)
+        movsd(Xmm(d.n), qword[rax + rdx * 8]);
+    else
+        mov(Reg64(d.n), qword[rax + rdx * 8]);
+    jmp(done.c_str());
+    L(unboxed_int.c_str());
+    mov(edx, dword[rax + rdx * 4]);
+    if (d.kind == Loc::XMM)
+        movq(Xmm(d.n), rdx);
+    else
+        mov(Reg64(d.n), rdx);
+    L(done.c_str());
+    push_value(d);
+}
+
+/*
+    The instructions that call out to C++ or other functions, with the
+    operand stack in m_mem. operand is the second word of two word
+    instructions.
+*/
+void ToyVm::emit_stack_insn(uint32 code, int t, uint32 imm, uint32 operand, uint32 begin, uint32 end)
+{
+    const Address top_i = dword[mem + vsp * 8 + 8];
+    const Address next_i = dword[mem + vsp * 8 + 16];
+    const Address top_q = qword[mem + vsp * 8 + 8];
+    const Address next_q = qword[mem + vsp * 8 + 16];
+
+    switch (code) {
+    case ADD_S:
+        mov(rdi, (size_t)this);
+        mov(rsi, vsp);
+        mov(rdx, frame);
+        jit_call((const void *)jit_concat);
+        mov(vsp, rax);
+        break;
+    case CMP_S:
+        mov(rdi, (size_t)this);
+        mov(rsi, top_q);
+        mov(rdx, next_q);
+        jit_call((const void *)jit_equal);
+        mov(next_i, eax);
+        inc(vsp);
+        break;
+
+    case CALL:
+    case CALL_NATIVE:
+        // the callee's frame follows this one
+        add(frame, operand * sizeof(IValue));
+        mov(rax, (size_t)m_frame_limit);
+        cmp(frame, rax);
+        jbe("@f");
+        mov(rdi, (size_t)this);
+        jit_call((const void *)jit_stack_overflow);
+        L("@@");
+        if (code == CALL_NATIVE) {
+            call(m_native_functions[imm]);
+        } else if (m_compiling_all || (imm >= begin && imm < end)) {
+            call(entry_label(imm).c_str());
+        } else if (m_native[imm]) {
+            call(m_native[imm]);
+        } else {
+            mov(rdi, (size_t)this);
+            mov(esi, imm);
+            mov(rdx, vsp);
+            mov(rcx, frame);
+            jit_call((const void *)jit_call_function);
+            mov(vsp, rax);
+        }
+        sub(frame, operand * sizeof(IValue));
+        break;
+
+    case ASSERT:
+        inc(vsp);
+        mov(rdi, (size_t)this);
+        mov(esi, dword[mem + vsp * 8]);
+        jit_call((const void *)jit_assert);
+        break;
+    case PRINT_I:
+        inc(vsp);
+        mov(rdi, (size_t)this);
+        mov(esi, dword[mem + vsp * 8]);
+        jit_call((const void *)jit_print_int);
+        break;
+    case PRINT_D:
+        inc(vsp);
+        mov(rdi, (size_t)this);
+        movsd(xmm0, qword[mem + vsp * 8]);
+        jit_call((const void *)jit_print_double);
+        break;
+    case PRINT_S:
+    case PRINT_L:
+        inc(vsp);
+        mov(rdi, (size_t)this);
+        mov(rsi, qword[mem + vsp * 8]);
+        jit_call(code == PRINT_S ? (const void *)jit_print_string : (const void *)jit_print_list);
+        break;
+
+    case MAKE_LIST:
+        mov(rdi, (size_t)this);
+        mov(rsi, vsp);
+        mov(rdx, frame);
+        mov(ecx, imm);
+        mov(r8d, t);
+        jit_call((const void *)jit_make_list);
+        mov(vsp, rax);
+        break;
+    case PARALLEL:
+        mov(rdi, (size_t)this);
+        mov(rsi, vsp);
+        mov(rdx, frame);
+        mov(ecx, imm);
+        mov(r8d, t);
+        mov(r9d, operand);
+        jit_call((const void *)jit_parallel);
+        mov(vsp, rax);
+        break;
+
+    default:
+        assert(0);
+        break;
+    }
+}
+
+/*
+    Compile the whole program, one function at a time so that each gets
+    its own register allocation.
+*/
+void ToyVm::recompile(int start_pc)
+{
+    seal();
+    if (m_native.size() != m_code.size())
+        m_native.assign(m_code.size(), 0);
+    if (!m_enter)
+        emit_enter();
+
+    std::set<uint32> bounds;
+    bounds.insert(0);
+    bounds.insert(start_pc);
+    for (uint32 pc = 0; pc < m_code.size(); pc += length(m_code[pc] >> 24)) {
+        if (is_call(m_code[pc] >> 24))
+            bounds.insert(m_code[pc] & 0xffff);
+    }
+    std::set<uint32> entries = bounds;
+    for (auto e : entries) {
+        const uint32 f = function_end(e);
+        if (f && f < m_code.size())
+            bounds.insert(f);
+    }
+
+    m_compiling_all = true;
+    inLocalLabel();
+    for (auto it = bounds.begin(); it != bounds.end(); ++it) {
+        auto next = it;
+        ++next;
+        emit_function(*it, next == bounds.end() ? m_code.size() : *next);
+    }
+    outLocalLabel();
+    ready();
+    m_compiling_all = false;
+    m_jit_entry = m_native[start_pc];
+}
+
+/*
+    A function extends from its entry point to the first RET after it;
+    nested functions are emitted before the entry point of the enclosing
+    one, so they never overlap. Returns 0 if there is no RET.
+*/
+uint32 ToyVm::function_end(uint32 entry)
+{
+    for (uint32 pc = entry; pc < m_code.size(); pc += length(m_code[pc] >> 24)) {
+        uint32 code = m_code[pc] >> 24;
+        if (code == RET)
+            return pc + 1;
+        if (code == END_OF_CODE)
+            break;
+    }
+    return 0;
+}
+
+/*
+    Compile the function at entry, if that has not been done yet, and
+    turn every CALL to it into a CALL_NATIVE. Returns its native entry
+    point, or 0 if it can't be compiled.
+*/
+const uint8 *ToyVm::tier_up(uint32 entry)
+{
+    if (m_native[entry])
+        return m_native[entry];
+    const uint32 end = function_end(entry);
+    if (!m_tiering || !end)
+        return 0;
+    try {
+        if (!m_enter)
+            emit_enter();
+        inLocalLabel();
+        emit_function(entry, end);
+        outLocalLabel();
+        ready();
+    } catch (Xbyak::Error err) {
+        // most likely the code buffer is full; keep interpreting
+        if (m_debug)
+            printf("tier-up of %d failed: %s\n", entry, Xbyak::ConvertErrorToString(err));
+        m_tiering = false;
+        return 0;
+    }
+    if (m_debug)
+        printf("tier-up: compiled %d..%d\n", entry, end - 1);
+
+    const uint32 index = m_native_functions.size();
+    m_native_functions.push_back(m_native[entry]);
+    for (uint32 pc = 0; pc < m_code.size(); pc += length(m_code[pc] >> 24)) {
+        if ((m_code[pc] >> 24) != CALL || (m_code[pc] & 0xffff) != entry)
+            continue;
+        // the frame size in the second word stays
+        m_code.set(pc, (CALL_NATIVE << 24) | index);
+        if (pc < m_threaded.size()) {
+            m_threaded[pc].word = m_code[pc];
+            m_threaded[pc].handler = m_handlers[CALL_NATIVE];
+        }
+    }
+    return m_native[entry];
+}
+
+/*
+    Count a taken backward branch to header. When the loop gets hot,
+    compile the function it is in and return the native address of the
+    loop header, so the interpreter can continue there.
+*/
+const uint8 *ToyVm::backedge(uint32 header)
+{
+    if (++m_loop_counts[header] != HOT_LOOP)
+        return 0;
+    if (m_native[header])
+        return m_native[header];
+
+    // the innermost function entry point before the header
+    std::set<uint32> entries;
+    entries.insert(m_start_pc);
+    for (uint32 pc = 0; pc < m_code.size(); pc += length(m_code[pc] >> 24)) {
+        if (is_call(m_code[pc] >> 24))
+            entries.insert(m_code[pc] & 0xffff);
+    }
+    for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+        if (*it <= header && function_end(*it) > header)
+            return tier_up(*it) ? m_native[header] : 0;
+    }
+    return 0;
+}
+
+void ToyVm::runByJIT()
+{
+    if (m_debug) {
+        printf("Size = %ld\n", getSize());
+        FILE *fp = fopen("distmp.tmp", "wb");
+        fwrite(getCode(), 1, getSize(), fp);
+        fclose(fp);
+        system("objdump -m i386 -M x86-64,intel -b binary -D distmp.tmp; rm distmp.tmp");
+    }
+    sigjmp_buf recover;
+    if (sigsetjmp(recover, 1)) {
+        m_recover = 0;
+        operand_stack_overflow();
+    }
+    m_recover = &recover;
+    m_sp = enter(m_jit_entry, STACK_SLOTS - 1, m_frames);
+    m_recover = 0;
+    m_out.flush();
+}
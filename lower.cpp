@@ -0,0 +1,665 @@
+#include <algorithm>
+#include <set>
+#include "codegen.h"
+
+/*
+    Lowering from SSA form to stack bytecode.
+
+    A value whose only use comes later in the same block is left on the
+    operand stack for it, as long as the uses come in stack order; other
+    values that are used get a slot in the function's frame. Constants are
+    pushed where they are used.
+
+    The frame starts with the parameters, where the caller stored them,
+    and is rounded up to whole cache lines. Arguments of calls are stored
+    right after it, which is where the callee's frame starts.
+
+    Phis become copies on the edges into their block. To avoid most of
+    them, a phi shares its slot with each operand whose live range does
+    not overlap with it (or anything else in the slot), which for
+    variables updated in a loop gives the slot of the variable back.
+
+    A loop that ends in "i = i + 1; branch i < n" with i and n in slots,
+    which is how every foreach ends, gets a single ITER_NEXT_OR_JUMP for
+    the increment, the test and the branch.
+
+    Copies for the fall through edge of a conditional branch are done
+    inline, and so are those for the taken edge if the other edge doesn't
+    need what they overwrite; otherwise they go in a stub after the
+    blocks. All
+    returns jump to a single RET at the end of the function, which is
+    where ToyVm::function_end expects it.
+*/
+
+namespace {
+
+struct Stub {
+    int label;
+    std::vector<std::pair<ir::Value*, int> > copies;
+    ir::BasicBlock *target;
+};
+
+struct Fixup {
+    int pc;
+    ToyVm::Code code;
+    int label;
+};
+
+/* lists of only Ints or only Doubles are stored unboxed */
+::Type element_type(const ir::Value *list)
+{
+    if (list->args.empty())
+        return ::Type::UNKNOWN;
+    const int t = list->args[0]->type.id;
+    for (auto arg : list->args) {
+        if (arg->type.id != t)
+            return ::Type::UNKNOWN;
+    }
+    return t == ::Type::INT || t == ::Type::DOUBLE ? t : ::Type::UNKNOWN;
+}
+
+class Lowering {
+public:
+    Lowering(CodeGenContext &vm, ir::Function &f) : m_vm(vm), m_f(f) { }
+    int run();
+
+private:
+    typedef std::vector<std::pair<ir::Value*, int> > Copies;
+
+    void find_reachable();
+    void count_uses();
+    void choose_stack_values();
+    void compute_liveness();
+    void coalesce();
+    void assign_slots();
+    void fuse_loop_tests();
+
+    bool needs_slot(const ir::Value *v) const;
+    std::vector<ir::Value*> pushed_args(const ir::Value *v) const;
+    int position(const ir::Value *v) const;
+    bool live_at_def(const ir::Value *b, const ir::Value *a) const;
+    int find(int id);
+
+    Copies copies(ir::BasicBlock *from, ir::BasicBlock *to);
+    void emit_copies(const Copies &c);
+    bool can_hoist(const Copies &c, ir::BasicBlock *from, ir::BasicBlock *to) const;
+    void emit_insn(ir::Value *v, ir::BasicBlock *next);
+    void push(ir::Value *v);
+    void typed(ir::Value *v, bool ok);
+    void jump_to(ToyVm::Code code, int label);
+    int label_of(ir::BasicBlock *b) const { return b->id; }
+    int new_label();
+    int stub(const Copies &c, ir::BasicBlock *target);
+
+    CodeGenContext &m_vm;
+    ir::Function &m_f;
+    std::vector<ir::BasicBlock*> m_layout;
+    std::vector<bool> m_reachable;
+
+    // indexed by value id
+    std::vector<int> m_uses;
+    std::vector<ir::Value*> m_user;
+    std::vector<bool> m_on_stack;
+    std::vector<int> m_class;
+    std::vector<int> m_slot;
+    std::vector<bool> m_fused;
+
+    // indexed by block id
+    std::vector<std::vector<bool> > m_live_in;
+    std::vector<std::vector<bool> > m_live_out;
+
+    int m_frame_size;
+
+    std::vector<int> m_labels;
+    std::vector<Fixup> m_fixups;
+    std::vector<Stub> m_stubs;
+};
+
+int Lowering::run()
+{
+    find_reachable();
+    count_uses();
+    choose_stack_values();
+    compute_liveness();
+    coalesce();
+    assign_slots();
+    fuse_loop_tests();
+
+    const int entry = m_vm.getCurrent();
+    m_labels.assign(m_f.all_blocks.size() + 1, -1);
+    for (size_t i = 0; i < m_layout.size(); i++) {
+        ir::BasicBlock *b = m_layout[i];
+        m_labels[label_of(b)] = m_vm.getCurrent();
+        for (auto v : b->insns) {
+            if (v->op != ir::PHI)
+                emit_insn(v, i + 1 < m_layout.size() ? m_layout[i + 1] : 0);
+        }
+    }
+    for (size_t i = 0; i < m_stubs.size(); i++) {
+        m_labels[m_stubs[i].label] = m_vm.getCurrent();
+        emit_copies(m_stubs[i].copies);
+        jump_to(ToyVm::JMP, label_of(m_stubs[i].target));
+    }
+    m_labels[m_f.all_blocks.size()] = m_vm.getCurrent();
+    m_vm.vret();
+
+    for (auto &fix : m_fixups)
+        m_vm.encode_at(fix.pc, fix.code, m_labels[fix.label]);
+    return entry;
+}
+
+void Lowering::find_reachable()
+{
+    m_reachable.assign(m_f.all_blocks.size(), false);
+    std::vector<ir::BasicBlock*> work(1, m_f.entry());
+    m_reachable[m_f.entry()->id] = true;
+    while (!work.empty()) {
+        ir::BasicBlock *b = work.back();
+        work.pop_back();
+        for (auto s : b->succs) {
+            if (!m_reachable[s->id]) {
+                m_reachable[s->id] = true;
+                work.push_back(s);
+            }
+        }
+    }
+    for (auto b : m_f.blocks) {
+        if (m_reachable[b->id])
+            m_layout.push_back(b);
+    }
+}
+
+void Lowering::count_uses()
+{
+    m_uses.assign(m_f.values.size(), 0);
+    m_user.assign(m_f.values.size(), 0);
+    for (auto b : m_layout) {
+        for (auto v : b->insns) {
+            for (size_t i = 0; i < v->args.size(); i++) {
+                if (v->op == ir::PHI && !m_reachable[b->preds[i]->id])
+                    continue;
+                m_uses[v->args[i]->id]++;
+                m_user[v->args[i]->id] = v;
+            }
+        }
+    }
+}
+
+/*
+    The arguments an instruction takes from the operand stack, in the
+    order they are pushed.
+*/
+std::vector<ir::Value*> Lowering::pushed_args(const ir::Value *v) const
+{
+    if (v->op == ir::PHI)
+        return std::vector<ir::Value*>();
+    return v->args;
+}
+
+/*
+    Start with every value that has a single use later in its block on
+    the operand stack, then move those that are not on top of the stack
+    when they are used to a slot, until everything fits.
+*/
+void Lowering::choose_stack_values()
+{
+    m_on_stack.assign(m_f.values.size(), false);
+    for (auto b : m_layout) {
+        for (auto v : b->insns) {
+            ir::Value *user = m_user[v->id];
+            m_on_stack[v->id] = v->has_result() && v->op != ir::PHI
+                && m_uses[v->id] == 1 && user->block == b && user->op != ir::PHI;
+        }
+
+        for (bool changed = true; changed;) {
+            changed = false;
+            std::vector<ir::Value*> stack;
+            for (auto v : b->insns) {
+                if (changed)
+                    break;
+                const std::vector<ir::Value*> args = pushed_args(v);
+                size_t k = 0;
+                while (k < args.size() && m_on_stack[args[k]->id])
+                    k++;
+                for (size_t j = k; j < args.size(); j++) {
+                    if (m_on_stack[args[j]->id]) {
+                        m_on_stack[args[j]->id] = false;
+                        changed = true;
+                    }
+                }
+                if (stack.size() < k || !std::equal(args.begin(), args.begin() + k, stack.end() - k)) {
+                    for (size_t j = 0; j < k; j++)
+                        m_on_stack[args[j]->id] = false;
+                    changed = true;
+                    continue;
+                }
+                stack.resize(stack.size() - k);
+                if (m_on_stack[v->id])
+                    stack.push_back(v);
+            }
+            for (size_t i = 0; i < stack.size() && !changed; i++) {
+                m_on_stack[stack[i]->id] = false;
+                changed = true;
+            }
+        }
+    }
+}
+
+bool Lowering::needs_slot(const ir::Value *v) const
+{
+    return v->has_result() && v->op != ir::CONST && v->op != ir::UNDEF && m_uses[v->id] > 0 && !m_on_stack[v->id];
+}
+
+/*
+    Index of v in its block, with all phis at -1 as they are defined at
+    the same time on entry.
+*/
+int Lowering::position(const ir::Value *v) const
+{
+    if (v->op == ir::PHI)
+        return -1;
+    const std::vector<ir::Value*> &insns = v->block->insns;
+    return std::find(insns.begin(), insns.end(), v) - insns.begin();
+}
+
+void Lowering::compute_liveness()
+{
+    const size_t n = m_f.values.size();
+    m_live_in.assign(m_f.all_blocks.size(), std::vector<bool>(n, false));
+    m_live_out.assign(m_f.all_blocks.size(), std::vector<bool>(n, false));
+
+    std::vector<std::vector<bool> > upward(m_f.all_blocks.size(), std::vector<bool>(n, false));
+    for (auto b : m_layout) {
+        for (auto v : b->insns) {
+            for (size_t i = 0; i < v->args.size(); i++) {
+                ir::Value *a = v->args[i];
+                if (!needs_slot(a))
+                    continue;
+                if (v->op == ir::PHI) {
+                    if (m_reachable[b->preds[i]->id])
+                        m_live_out[b->preds[i]->id][a->id] = true;
+                } else if (a->block != b) {
+                    upward[b->id][a->id] = true;
+                }
+            }
+        }
+    }
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t i = m_layout.size(); i-- > 0;) {
+            ir::BasicBlock *b = m_layout[i];
+            std::vector<bool> &out = m_live_out[b->id];
+            for (auto s : b->succs) {
+                const std::vector<bool> &in = m_live_in[s->id];
+                for (size_t j = 0; j < n; j++) {
+                    if (in[j] && !out[j])
+                        out[j] = changed = true;
+                }
+            }
+            std::vector<bool> &in = m_live_in[b->id];
+            for (size_t j = 0; j < n; j++) {
+                const bool live = upward[b->id][j] || (out[j] && m_f.values[j]->block != b);
+                if (live && !in[j])
+                    in[j] = changed = true;
+            }
+        }
+    }
+}
+
+/*
+    Whether b is live right after a is defined. In SSA form two values
+    interfere exactly when one is live at the definition of the other.
+*/
+bool Lowering::live_at_def(const ir::Value *b, const ir::Value *a) const
+{
+    ir::BasicBlock *block = a->block;
+    if (a == b)
+        return false;
+    if (b->block == block) {
+        if (a->op == ir::PHI && b->op == ir::PHI)
+            return true;
+        if (position(b) >= position(a))
+            return false;
+    } else if (!m_live_in[block->id][b->id]) {
+        return false;
+    }
+    if (m_live_out[block->id][b->id])
+        return true;
+    const std::vector<ir::Value*> &insns = block->insns;
+    for (size_t i = position(a) + 1; i < insns.size(); i++) {
+        if (insns[i]->op != ir::PHI && std::find(insns[i]->args.begin(), insns[i]->args.end(), b) != insns[i]->args.end())
+            return true;
+    }
+    return false;
+}
+
+int Lowering::find(int id)
+{
+    while (m_class[id] != id)
+        id = m_class[id] = m_class[m_class[id]];
+    return id;
+}
+
+void Lowering::coalesce()
+{
+    m_class.resize(m_f.values.size());
+    std::vector<std::vector<ir::Value*> > members(m_f.values.size());
+    for (size_t i = 0; i < m_class.size(); i++) {
+        m_class[i] = i;
+        members[i].push_back(m_f.values[i]);
+    }
+
+    for (auto b : m_layout) {
+        for (auto phi : b->insns) {
+            if (phi->op != ir::PHI || !needs_slot(phi))
+                continue;
+            for (size_t i = 0; i < phi->args.size(); i++) {
+                ir::Value *arg = phi->args[i];
+                if (!m_reachable[b->preds[i]->id] || !needs_slot(arg))
+                    continue;
+                int x = find(phi->id), y = find(arg->id);
+                if (x == y)
+                    continue;
+                bool interfere = false;
+                for (auto p : members[x]) {
+                    for (auto q : members[y]) {
+                        if (live_at_def(p, q) || live_at_def(q, p)) {
+                            interfere = true;
+                            break;
+                        }
+                    }
+                    if (interfere)
+                        break;
+                }
+                if (interfere)
+                    continue;
+                m_class[y] = x;
+                members[x].insert(members[x].end(), members[y].begin(), members[y].end());
+                members[y].clear();
+            }
+        }
+    }
+}
+
+void Lowering::assign_slots()
+{
+    std::map<int, int> class_slot;
+    std::set<int> taken;
+    int next = m_f.params, args = 0;
+    m_slot.assign(m_f.values.size(), -1);
+
+    // a parameter stays where the caller put it, the first class to ask wins
+    for (auto v : m_f.values) {
+        if (v->op == ir::STORE)
+            args = std::max(args, v->imm + 1);
+        // a PARALLEL run in order passes the index and its values like a call
+        if (v->op == ir::PARALLEL)
+            args = std::max(args, (int)v->args.size() - 2);
+        if (v->op != ir::LOAD || !needs_slot(v) || !v->block || !m_reachable[v->block->id])
+            continue;
+        const int c = find(v->id);
+        if (!class_slot.count(c) && !taken.count(v->imm)) {
+            class_slot[c] = v->imm;
+            taken.insert(v->imm);
+        }
+    }
+    for (auto v : m_f.values) {
+        if (!needs_slot(v) || !v->block || !m_reachable[v->block->id])
+            continue;
+        const int c = find(v->id);
+        if (!class_slot.count(c))
+            class_slot[c] = next++;
+        m_slot[v->id] = class_slot[c];
+    }
+
+    // an empty frame still takes a line, so runaway recursion is caught
+    m_frame_size = (std::max(next, 1) + ToyVm::FRAME_ALIGN - 1) & ~(ToyVm::FRAME_ALIGN - 1);
+    if (m_frame_size + args > ToyVm::MAX_FRAME) {
+        std::cout << "Error! Too many locals in " << m_f.name << std::endl;
+        exit(0);
+    }
+}
+
+/*
+    Mark the add and the comparison of blocks ending in
+
+        x = add.i i, 1; c = clt.i x, n; branch c
+
+    where x and i share a slot and n has one; the branch does all three.
+*/
+void Lowering::fuse_loop_tests()
+{
+    m_fused.assign(m_f.values.size(), false);
+    for (auto b : m_layout) {
+        const std::vector<ir::Value*> &insns = b->insns;
+        const size_t n = insns.size();
+        if (n < 3 || insns[n - 1]->op != ir::BRANCH)
+            continue;
+        ir::Value *add = insns[n - 3], *cmp = insns[n - 2];
+        if (insns[n - 1]->args[0] != cmp || cmp->op != ir::CLT || cmp->type.id != ::Type::INT
+            || cmp->args[0] != add || !m_on_stack[cmp->id])
+            continue;
+        if (add->op != ir::ADD || add->type.id != ::Type::INT
+            || add->args[1]->op != ir::CONST || add->args[1]->imm != 1)
+            continue;
+        const int slot = m_slot[add->id];
+        if (slot < 0 || m_slot[add->args[0]->id] != slot || m_slot[cmp->args[1]->id] < 0)
+            continue;
+        m_fused[add->id] = m_fused[cmp->id] = true;
+    }
+}
+
+Lowering::Copies Lowering::copies(ir::BasicBlock *from, ir::BasicBlock *to)
+{
+    Copies c;
+    const size_t index = std::find(to->preds.begin(), to->preds.end(), from) - to->preds.begin();
+    for (auto phi : to->insns) {
+        if (phi->op != ir::PHI || !needs_slot(phi))
+            continue;
+        ir::Value *arg = phi->args[index];
+        if (arg->op == ir::UNDEF || m_slot[arg->id] == m_slot[phi->id])
+            continue;
+        c.push_back(std::make_pair(arg, m_slot[phi->id]));
+    }
+    return c;
+}
+
+/*
+    The copies on an edge happen at the same time. Unless a copy
+    overwrites a slot that a later one reads, each is done on its own.
+*/
+void Lowering::emit_copies(const Copies &c)
+{
+    bool overlap = false;
+    for (size_t i = 0; i < c.size(); i++) {
+        for (size_t j = i + 1; j < c.size(); j++) {
+            if (needs_slot(c[j].first) && m_slot[c[j].first->id] == c[i].second)
+                overlap = true;
+        }
+    }
+    for (size_t i = 0; i < c.size(); i++) {
+        push(c[i].first);
+        if (!overlap)
+            m_vm.vstorel(c[i].second);
+    }
+    for (size_t i = c.size(); overlap && i-- > 0;)
+        m_vm.vstorel(c[i].second);
+}
+
+/*
+    Whether the copies c on one edge out of block from can be done before
+    its branch, as they don't overwrite anything the other edge, to block
+    to, still needs.
+*/
+bool Lowering::can_hoist(const Copies &c, ir::BasicBlock *from, ir::BasicBlock *to) const
+{
+    const size_t index = std::find(to->preds.begin(), to->preds.end(), from) - to->preds.begin();
+    for (auto copy : c) {
+        for (auto v : m_f.values) {
+            if (m_slot[v->id] == copy.second && m_live_in[to->id][v->id])
+                return false;
+        }
+        for (auto phi : to->insns) {
+            ir::Value *arg = phi->op == ir::PHI ? phi->args[index] : 0;
+            if (arg && needs_slot(arg) && m_slot[arg->id] == copy.second)
+                return false;
+        }
+    }
+    return true;
+}
+
+void Lowering::push(ir::Value *v)
+{
+    if (m_on_stack[v->id])
+        return;
+    switch (v->op) {
+    case ir::CONST:
+        if (v->type.id == ::Type::INT)
+            m_vm.vpush_int(v->imm);
+        else if (v->type.id == ::Type::DOUBLE)
+            m_vm.vpush_double(v->dbl);
+        else
+            m_vm.vpush_string(v->str);
+        break;
+    case ir::UNDEF:
+        m_vm.vpush(0);
+        break;
+    default:
+        assert(m_slot[v->id] >= 0);
+        m_vm.vloadl(m_slot[v->id]);
+        break;
+    }
+}
+
+void Lowering::typed(ir::Value *v, bool ok)
+{
+    if (ok)
+        return;
+    if (v->op == ir::PRINT)
+        std::cout << v->line << ": " << "Error! Cannot print value of type " << v->type.name() << std::endl;
+    else
+        std::cout << v->line << ": " << "Error! Operator not supported for type " << v->type.name() << std::endl;
+    exit(0);
+}
+
+void Lowering::jump_to(ToyVm::Code code, int label)
+{
+    Fixup fix = { m_vm.getCurrent(), code, label };
+    m_fixups.push_back(fix);
+    m_vm.encode(code, (uint16)0);
+}
+
+int Lowering::new_label()
+{
+    m_labels.push_back(-1);
+    return m_labels.size() - 1;
+}
+
+int Lowering::stub(const Copies &c, ir::BasicBlock *target)
+{
+    Stub s = { new_label(), c, target };
+    m_stubs.push_back(s);
+    return s.label;
+}
+
+void Lowering::emit_insn(ir::Value *v, ir::BasicBlock *next)
+{
+    ir::BasicBlock *b = v->block;
+    if (v->op == ir::LOAD && (m_slot[v->id] == v->imm || (!m_on_stack[v->id] && m_slot[v->id] < 0)))
+        return;
+    if (m_fused[v->id])
+        return;
+
+    for (auto arg : pushed_args(v))
+        push(arg);
+
+    switch (v->op) {
+    case ir::LOAD: m_vm.vloadl(v->imm); break;
+    case ir::STORE: m_vm.vstorel(m_frame_size + v->imm); break;
+    case ir::ADD: typed(v, m_vm.vadd(v->type)); break;
+    case ir::SUB: typed(v, m_vm.vsub(v->type)); break;
+    case ir::MUL: typed(v, m_vm.vmul(v->type)); break;
+    case ir::DIV: typed(v, m_vm.vdiv(v->type)); break;
+    case ir::AND: typed(v, m_vm.vand(v->type)); break;
+    case ir::CMP: typed(v, m_vm.vcmp(v->type)); break;
+    case ir::CLT: typed(v, m_vm.vclt(v->type)); break;
+    case ir::CALL: m_vm.vcall(v->imm, m_frame_size); break;
+    case ir::PARALLEL:
+        m_vm.set_body_site(v->imm, m_vm.getCurrent());
+        m_vm.vparallel(0, v->args.size() - 3, m_frame_size);
+        break;
+    case ir::MAKE_LIST: m_vm.vmake_list(v->args.size(), element_type(v)); break;
+    case ir::LENGTH: m_vm.vlength(); break;
+    case ir::ELEMENT: m_vm.velement(v->type); break;
+    case ir::ASSERT: m_vm.vassert(); break;
+    case ir::PRINT: typed(v, m_vm.vprint(v->type)); break;
+
+    case ir::JUMP: {
+        ir::BasicBlock *to = b->succs[0];
+        emit_copies(copies(b, to));
+        if (to != next)
+            jump_to(ToyVm::JMP, label_of(to));
+        } break;
+    case ir::BRANCH: {
+        ir::BasicBlock *t = b->succs[0], *f = b->succs[1];
+        ir::Value *cond = v->args[0];
+        Copies ct = copies(b, t);
+        const Copies cf = copies(b, f);
+        if (m_fused[cond->id]) {
+            // copies may read the index, so they all come after the increment
+            ir::Value *index = cond->args[0];
+            Fixup fix = { m_vm.getCurrent(), ToyVm::ITER_NEXT_OR_JUMP, ct.empty() ? label_of(t) : stub(ct, t) };
+            m_fixups.push_back(fix);
+            m_vm.viter_next_or_jump(0, m_slot[index->id], m_slot[cond->args[1]->id]);
+        } else {
+            if (!ct.empty() && can_hoist(ct, b, f)) {
+                emit_copies(ct);
+                ct.clear();
+            }
+            if (t == next && ct.empty()) {
+                jump_to(ToyVm::JNE, cf.empty() ? label_of(f) : stub(cf, f));
+                break;
+            }
+            jump_to(ToyVm::JE, ct.empty() ? label_of(t) : stub(ct, t));
+        }
+        emit_copies(cf);
+        if (f != next)
+            jump_to(ToyVm::JMP, label_of(f));
+        } break;
+    case ir::RETURN:
+        if (next || !m_stubs.empty())
+            jump_to(ToyVm::JMP, m_f.all_blocks.size());
+        break;
+
+    case ir::CONST: case ir::UNDEF: case ir::PHI:
+        break;
+    }
+
+    if (!v->has_result() || m_on_stack[v->id])
+        return;
+    if (m_slot[v->id] >= 0)
+        m_vm.vstorel(m_slot[v->id]);
+    else
+        m_vm.encode(ToyVm::POP);
+}
+
+}
+
+int CodeGenContext::lower(ir::Function &f)
+{
+    Lowering lowering(*this, f);
+    return lowering.run();
+}
+
+void CodeGenContext::lower_bodies()
+{
+    std::vector<int> entries;
+    for (size_t i = 0; i < m_bodies.size(); i++) {
+        entries.push_back(lower(*m_bodies[i].function));
+        delete m_bodies[i].function;
+    }
+    for (size_t i = 0; i < m_bodies.size(); i++)
+        patch_entry(m_bodies[i].site, entries[i]);
+    m_bodies.clear();
+}
@@ -1,34 +1,171 @@
 #include <iostream>
 #include <cstdio>
+#include <memory>
+#include <thread>
 
 #include "node.h"
 #include "codegen.h"
 
-
-extern Block* programBlock;
-extern int yyparse();
-extern int error_count;
-
 extern "C"
 double print(double x) {
   printf("%f\n",x);
   return x;
 }
 
-extern FILE *yyin;
-extern int debug;
+
+static void usage()
+{
+    printf("usage: parser [options] [file.prism]\n"
+           "  --jit                   compile to native code instead of interpreting\n"
+           "  --interpret             only interpret, don't compile hot functions and loops\n"
+           "  --no-peephole           don't fuse instructions into superinstructions\n"
+           "  --dump-ir               print the SSA form of every function before lowering it\n"
+           "  --no-optimize           don't fold constants or move code out of loops\n"
+           "  --opt-report            print what was folded, hoisted and strength-reduced\n"
+           "  --gc-stats              print collection counts, pause times and heap size at exit\n"
+           "  --threads N             run parallel foreach on N worker threads, one per core by default\n"
+           "  --isolates N            run the program N times at once, each in a VM of its own\n"
+           "  --debug                 print what the compiler, the JIT and the collector do\n"
+           "  --trace                 record the last interpreted instructions, printed when an assert fails\n"
+           "  --profile FILE          interpret only and write executions and cycles per opcode,\n"
+           "                          opcode pair, function and block to FILE as YAML\n"
+           "  --pair-histogram FILE   run unfused code and write the executed opcode pairs to FILE\n"
+           "  --fuse-from FILE        only use superinstructions that are hot in the histogram in FILE\n");
+    exit(1);
+}
+
+/*
+    Run program on n VMs at once, one thread each, the way a host runs
+    many scripts in one process. They share the program and nothing
+    else; the output of each is written out once all are done, followed
+    by its collector stats if asked for.
+*/
+static void run_isolates(const std::shared_ptr<const Program> &program, int n, bool jit, bool tiering, int threads,
+                         bool tracing, bool debug, bool gc_stats)
+{
+    std::vector<std::string> output(n);
+    std::vector<std::unique_ptr<ToyVm>> vms;
+    std::vector<std::thread> running;
+    for (int i = 0; i < n; i++) {
+        vms.emplace_back(new ToyVm);
+        ToyVm &vm = *vms.back();
+        vm.set_output(&output[i]);
+        vm.set_tiering(tiering);
+        vm.set_threads(threads);
+        vm.set_tracing(tracing);
+        vm.set_debug(debug);
+        vm.load(program);
+    }
+    for (int i = 0; i < n; i++) {
+        running.push_back(std::thread([&, i]() {
+            ToyVm &vm = *vms[i];
+            if (jit) {
+                vm.recompile(program->main);
+                vm.runByJIT();
+            } else {
+                vm.run();
+            }
+        }));
+    }
+    for (auto &t : running)
+        t.join();
+    for (int i = 0; i < n; i++) {
+        fwrite(output[i].data(), 1, output[i].size(), stdout);
+        if (gc_stats)
+            vms[i]->print_gc_stats();
+    }
+}
 
 int main(int argc, char **argv)
 {
-    if (argc == 2)
-        yyin = fopen(argv[1], "r");
-    else
-        yyin = fopen("../prism/test.prism","r");
-    yyparse();
+    const char *filename = "../prism/test.prism";
+    const char *histogram = 0;
+    const char *fuse_from = 0;
+    const char *profile = 0;
+    int threads = 0;
+    int isolates = 0;
+    bool peephole = true;
+    bool jit = false;
+    bool tiering = true;
+    bool dump_ir = false;
+    bool optimize = true;
+    bool opt_report = false;
+    bool gc_stats = false;
+    bool tracing = false;
+    bool debug = false;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--jit")
+            jit = true;
+        else if (arg == "--interpret")
+            tiering = false;
+        else if (arg == "--no-peephole")
+            peephole = false;
+        else if (arg == "--dump-ir")
+            dump_ir = true;
+        else if (arg == "--no-optimize")
+            optimize = false;
+        else if (arg == "--opt-report")
+            opt_report = true;
+        else if (arg == "--gc-stats")
+            gc_stats = true;
+        else if (arg == "--trace")
+            tracing = true;
+        else if (arg == "--threads" && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if (arg == "--isolates" && i + 1 < argc)
+            isolates = atoi(argv[++i]);
+        else if (arg == "--debug")
+            debug = true;
+        else if (arg == "--profile" && i + 1 < argc)
+            profile = argv[++i];
+        else if (arg == "--pair-histogram" && i + 1 < argc)
+            histogram = argv[++i];
+        else if (arg == "--fuse-from" && i + 1 < argc)
+            fuse_from = argv[++i];
+        else if (arg[0] == '-')
+            usage();
+        else
+            filename = argv[i];
+    }
+    if (isolates && (profile || histogram)) {
+        printf("--profile and --pair-histogram count a single VM, they can't be used with --isolates\n");
+        usage();
+    }
 
-    if (error_count == 0) {
+    ParseContext parser;
+    if (!parser.parse_file(filename)) {
+        std::cout << "Can't read " << filename << std::endl;
+        return 1;
+    }
+
+    if (parser.errors == 0) {
+        Block *programBlock = parser.program;
         CodeGenContext context;
 
+        if (fuse_from) {
+            FILE *fp = fopen(fuse_from, "r");
+            if (!fp || !context.select_fusions(fp)) {
+                std::cout << "Can't read opcode pair histogram " << fuse_from << std::endl;
+                return 1;
+            }
+            fclose(fp);
+        }
+        if (!peephole || histogram)
+            context.set_fusion(false);
+        if (histogram)
+            context.collect_pair_histogram();
+        context.set_jit(jit);
+        context.set_tiering(tiering);
+        context.set_dump_ir(dump_ir);
+        context.set_optimize_ir(optimize);
+        context.set_opt_report(opt_report);
+        context.set_tracing(tracing);
+        context.set_profiling(profile != 0);
+        context.set_threads(threads);
+        context.set_debug(debug);
+
         Context root(0);
 
         Visitor *tv = new TypeVisitor;
@@ -38,7 +175,29 @@ int main(int argc, char **argv)
         std::cout << programBlock->yaml() << std::endl;
 
         context.generate_code(*programBlock);
+        parser.release_tree();
+        if (isolates) {
+            run_isolates(context.link(), isolates, jit, tiering, threads, tracing, debug, gc_stats);
+            return 0;
+        }
         context.run_code();
+        if (gc_stats)
+            context.print_gc_stats();
+
+        if (histogram) {
+            FILE *fp = fopen(histogram, "w");
+            context.write_pair_histogram(fp);
+            fclose(fp);
+        }
+        if (profile) {
+            FILE *fp = fopen(profile, "w");
+            if (!fp) {
+                std::cout << "Can't write profile " << profile << std::endl;
+                return 1;
+            }
+            context.write_profile(fp);
+            fclose(fp);
+        }
     }
 
     return 0;
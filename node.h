@@ -2,6 +2,9 @@
 #include <vector>
 #include <typeinfo>
 #include "codegen.h"
+#include "ast.h"
+#include "number.h"
+#include "parse.h"
 
 #include "yaml-cpp/yaml.h"
 
@@ -10,12 +13,10 @@ class Statement;
 class Expression;
 class VariableDeclaration;
 
-typedef std::vector<Statement*> StatementList;
-typedef std::vector<Expression*> ExpressionList;
-typedef std::vector<VariableDeclaration*> VariableList;
+typedef Array<Statement*> StatementList;
+typedef Array<Expression*> ExpressionList;
+typedef Array<VariableDeclaration*> VariableList;
 
-extern int addr;
-extern int line_num;
 
 #define PRINT_ID(x) printf("%*s %s", indent, "", x );
 #define INDENT printf("%*s", indent, "");
@@ -40,32 +41,35 @@ public:
     Context* m_parent;
 };
 
+/*
+    Nodes are made in the Arena of their ParseContext and never deleted
+    one by one, so they have no virtual destructor. A node visits its
+    children in accept(), in the order they appear in the source.
+*/
 class Node {
 public:
     Node()
     {
-        m_line_num = line_num;
+        m_line_num = ParseContext::current_line();
     }
 
-    virtual ~Node() {}
     virtual Value *value() { return NULL; }
     virtual Type type() const = 0;
     virtual YAML::Node yaml() const = 0;
-    virtual void codeGen(CodeGenContext& context) { }
+    virtual ir::Value *codeGen(CodeGenContext& context) { return 0; }
     virtual void set_context(Context* parent) = 0;
 
+    /* the line the parser was at when it made the node */
+    int line_num() const { return m_line_num; }
+
     virtual void accept(Visitor* v)
     {
         v->visit(this);
-        for(auto it : m_children)
-            it->accept(v);
     }
 
-    void add_child(Node* child) { m_children.push_back(child); }
 protected:
     Context* m_context;
     int m_line_num;
-    std::list<Node*> m_children;
 };
 
 class Expression : public Node {
@@ -101,7 +105,7 @@ public:
         m_context = parent;
     }
 
-    void codeGen(CodeGenContext& context);
+    ir::Value *codeGen(CodeGenContext& context);
 };
 
 class Double : public Expression {
@@ -117,8 +121,9 @@ public:
     YAML::Node yaml() const
     {
         YAML::Node node;
+        char buf[FORMAT_DOUBLE_MAX];
         node["id"] = "double";
-        node["value"] = m_value;
+        node["value"] = std::string(buf, format_double(m_value, buf));
         return node;
     }
 
@@ -127,16 +132,29 @@ public:
         m_context = parent;
     }
 
-    void codeGen(CodeGenContext& context);
+    ir::Value *codeGen(CodeGenContext& context);
 };
 
 class String : public Expression {
 public:
     std::string m_value;
-    String(const std::string* value) :
-        m_value(*value)
-    {
-        m_value = m_value.substr(1, m_value.length() - 2);
+    /* text is the literal as written, quotes and escapes included */
+    String(const char *text, size_t length)
+    {
+        for (size_t i = 1; i + 1 < length; i++) {
+            char c = text[i];
+            if (c == '\\' && i + 2 < length) {
+                switch (text[++i]) {
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case 'r': c = '\r'; break;
+                case '0': c = '\0'; break;
+                case '\\': case '"': case '\'': c = text[i]; break;
+                default: m_value += '\\'; c = text[i]; break;
+                }
+            }
+            m_value += c;
+        }
     }
 
     Type type() const
@@ -157,13 +175,14 @@ public:
         m_context = parent;
     }
 
-    void codeGen(CodeGenContext& context);
+    ir::Value *codeGen(CodeGenContext& context);
 
 };
 
 class Typename : public Expression {
 public:
-    std::string m_name;
+    // in the symbol table of the ParseContext
+    const std::string &m_name;
     Typename(const std::string& name) : m_name(name) { }
 
     Type type() const
@@ -193,18 +212,13 @@ public:
         m_context = parent;
     }
 
-    void codeGen(CodeGenContext& context) {};
+    ir::Value *codeGen(CodeGenContext& context) { return 0; }
 };
 
 class ListLiteral : public Expression {
 
-    std::vector<Expression*> m_elements;
+    ExpressionList m_elements;
 public:
-    ListLiteral()
-    {
-        for(auto it : m_elements)
-            add_child(it);
-    }
 
     Type type() const
     {
@@ -228,17 +242,18 @@ public:
             it->set_context(m_context);
     }
 
-    void add(Expression *x)
+    void add(Arena &arena, Expression *x)
     {
-        m_elements.push_back(x);
+        m_elements.push_back(arena, x);
     }
 
-    void codeGen(CodeGenContext& context);
+    ir::Value *codeGen(CodeGenContext& context);
 };
 
 class Identifier : public Expression {
 public:
-    std::string m_name;
+    // in the symbol table of the ParseContext
+    const std::string &m_name;
     Identifier(const std::string& name) : m_name(name) { }
     void print(int indent) const
     {
@@ -277,7 +292,7 @@ public:
         m_context = parent;
     }
 
-    void codeGen(CodeGenContext& context);
+    ir::Value *codeGen(CodeGenContext& context);
 };
 
 class MethodCall : public Expression {
@@ -287,18 +302,17 @@ public:
     ExpressionList* m_arguments;
 
     MethodCall(Identifier* id, ExpressionList* arguments) :
-        m_id(id), m_arguments(arguments)
+        m_id(id), m_arguments(arguments) { }
+
+    void accept(Visitor* v)
     {
-        add_child(m_id);
+        v->visit(this);
+        m_id->accept(v);
         for(auto it : *m_arguments)
-            add_child(it);
-    }
-    MethodCall(Identifier* id) : m_id(id)
-    {
-        add_child(m_id);
+            it->accept(v);
     }
 
-    void codeGen(CodeGenContext& context);
+    ir::Value *codeGen(CodeGenContext& context);
 
     Type type() const
     {
@@ -347,13 +361,17 @@ public:
     Expression* rhs;
 
     BinaryOperator(Expression* lhs, int op, Expression* rhs) :
-        lhs(lhs), rhs(rhs), op(op)
+        lhs(lhs), rhs(rhs), op(op) { }
+
+    void accept(Visitor* v)
     {
-        add_child(lhs);
-        add_child(rhs);
+        v->visit(this);
+        lhs->accept(v);
+        rhs->accept(v);
     }
+
     void print(int indent) const;
-    void codeGen(CodeGenContext& context);
+    ir::Value *codeGen(CodeGenContext& context);
 
     Type type() const;
 
@@ -380,13 +398,16 @@ public:
     Identifier* lhs;
     Expression* rhs;
     Assignment(Identifier* lhs, Expression* rhs) :
-        lhs(lhs), rhs(rhs)
+        lhs(lhs), rhs(rhs) { }
+
+    void accept(Visitor* v)
     {
-        add_child(lhs);
-        add_child(rhs);
+        v->visit(this);
+        lhs->accept(v);
+        rhs->accept(v);
     }
 
-    void codeGen(CodeGenContext& context);
+    ir::Value *codeGen(CodeGenContext& context);
 
     Type type() const
     {
@@ -414,16 +435,16 @@ public:
 class Block : public Expression {
     StatementList statements;
 public:
-    Block()
+    void add_statement(Arena &arena, Statement *stmt)
     {
-        for(auto it : statements)
-            add_child(it);
+        statements.push_back(arena, stmt);
     }
 
-    void add_statement(Statement *stmt)
+    void accept(Visitor* v)
     {
-        statements.push_back(stmt);
-        add_child(stmt);
+        v->visit(this);
+        for(auto it : statements)
+            it->accept(v);
     }
 
     void codeGen(CodeGenContext& context, int local_funcs_only);
@@ -478,7 +499,7 @@ public:
         m_expression.set_context(parent);
     }
 
-    void codeGen(CodeGenContext& context);
+    ir::Value *codeGen(CodeGenContext& context);
 };
 
 
@@ -489,27 +510,23 @@ public:
     Expression* m_assignment_expr;
     Value *v;
     VariableDeclaration(Typename* type, Identifier* id) :
-        m_type(type), m_name(id), v(0)
-    {
-        add_child(m_type);
-        add_child(m_name);
-    }
+        m_type(type), m_name(id), m_assignment_expr(0), v(0) { }
 
     VariableDeclaration(Typename* type, Identifier* id, Expression *assignmentExpr) :
-        m_type(type), m_name(id), m_assignment_expr(assignmentExpr), v(0)
-    {
-        add_child(m_type);
-        add_child(m_name);
-        add_child(m_assignment_expr);
-    }
+        m_type(type), m_name(id), m_assignment_expr(assignmentExpr), v(0) { }
 
-    Value *value()
+    void accept(Visitor* visitor)
     {
-        if (v == NULL)
-            v = new Value(addr++);
-        return v;
+        visitor->visit(this);
+        m_type->accept(visitor);
+        m_name->accept(visitor);
+        if (m_assignment_expr)
+            m_assignment_expr->accept(visitor);
     }
 
+    // the slot codeGen gave the variable
+    Value *value() { return v; }
+
     Type type() const
     {
         m_context->m_locals[m_name->m_name] = m_type->type();
@@ -536,7 +553,7 @@ public:
             m_assignment_expr->set_context(m_context);
     }
 
-    void codeGen(CodeGenContext& context);
+    ir::Value *codeGen(CodeGenContext& context);
 };
 
 class FunctionDeclaration : public Statement {
@@ -549,16 +566,19 @@ public:
                         Identifier* id,
                         VariableList* arguments,
                         Block* block) :
-        m_type(type), m_id(id), m_arguments(arguments), m_block(block)
+        m_type(type), m_id(id), m_arguments(arguments), m_block(block) { }
+
+    void accept(Visitor* v)
     {
-        add_child(m_type);
-        add_child(m_id);
-        add_child(m_block);
+        v->visit(this);
+        m_type->accept(v);
+        m_id->accept(v);
+        m_block->accept(v);
         for(auto it : *m_arguments)
-            add_child(it);
+            it->accept(v);
     }
 
-    void codeGen(CodeGenContext& context);
+    ir::Value *codeGen(CodeGenContext& context);
 
     Type type() const
     {
@@ -607,7 +627,7 @@ public:
 
     }
 
-    void codeGen(CodeGenContext& context);
+    ir::Value *codeGen(CodeGenContext& context);
 };
 #endif
 
@@ -619,13 +639,16 @@ public:
     Block* m_then_block;
     Block* m_else_block;
 
-    IfStatement(Expression *evalExpr, Block* thenBlock, Block *elseBlock) :
-        m_eval_expr(evalExpr), m_then_block(thenBlock), m_else_block(elseBlock)
+    IfStatement(Expression *evalExpr, Block* thenBlock, Block *elseBlock = 0) :
+        m_eval_expr(evalExpr), m_then_block(thenBlock), m_else_block(elseBlock) { }
+
+    void accept(Visitor* v)
     {
-        add_child(m_eval_expr);
-        add_child(m_then_block);
+        v->visit(this);
+        m_eval_expr->accept(v);
+        m_then_block->accept(v);
         if (m_else_block)
-            add_child(m_else_block);
+            m_else_block->accept(v);
     }
 
     Type type() const
@@ -633,7 +656,7 @@ public:
         return Type::VOID;
     }
 
-    void codeGen(CodeGenContext& context);
+    ir::Value *codeGen(CodeGenContext& context);
     YAML::Node yaml() const
     {
         YAML::Node node;
@@ -660,9 +683,12 @@ class ReturnStatement : public Statement
 {
 public:
     ReturnStatement(Expression *expr):
-        m_expr(expr)
+        m_expr(expr) { }
+
+    void accept(Visitor* v)
     {
-        add_child(m_expr);
+        v->visit(this);
+        m_expr->accept(v);
     }
 
     Type type() const
@@ -670,7 +696,7 @@ public:
         return Type::VOID;
     }
 
-    void codeGen(CodeGenContext &context);
+    ir::Value *codeGen(CodeGenContext &context);
     YAML::Node yaml() const
     {
         YAML::Node node;
@@ -694,9 +720,12 @@ class AssertStatement : public Statement
 {
 public:
     AssertStatement(Expression *expr):
-        m_expr(expr)
+        m_expr(expr) { }
+
+    void accept(Visitor* v)
     {
-        add_child(m_expr);
+        v->visit(this);
+        m_expr->accept(v);
     }
 
 
@@ -705,7 +734,7 @@ public:
         return Type::VOID;
     }
 
-    void codeGen(CodeGenContext &context);
+    ir::Value *codeGen(CodeGenContext &context);
     YAML::Node yaml() const
     {
         YAML::Node node;
@@ -728,9 +757,12 @@ class PrintStatement : public Statement
 {
 public:
     PrintStatement(Expression *expr):
-        m_expr(expr)
+        m_expr(expr) { }
+
+    void accept(Visitor* v)
     {
-        add_child(m_expr);
+        v->visit(this);
+        m_expr->accept(v);
     }
 
     Type type() const
@@ -738,7 +770,7 @@ public:
         return Type::VOID;
     }
 
-    void codeGen(CodeGenContext &context);
+    ir::Value *codeGen(CodeGenContext &context);
     YAML::Node yaml() const
     {
         YAML::Node node;
@@ -763,13 +795,20 @@ class ForeachStatement : public Statement
     VariableDeclaration *m_var_decl;
     Expression *m_expr;
     Block *m_block;
+    bool m_parallel;
+
+    ir::Value *parallel_codeGen(CodeGenContext &context, ir::Value *list, ir::Value *start, ir::Value *stop, int step);
+    ir::Value *step_limit(CodeGenContext &context, ir::Value *stop, int step);
 public:
-    ForeachStatement(VariableDeclaration *var, Expression *expr, Block *block):
-        m_var_decl(var), m_expr(expr), m_block(block)
+    ForeachStatement(VariableDeclaration *var, Expression *expr, Block *block, bool parallel = false):
+        m_var_decl(var), m_expr(expr), m_block(block), m_parallel(parallel) { }
+
+    void accept(Visitor* v)
     {
-        add_child(m_var_decl);
-        add_child(m_expr);
-        add_child(m_block);
+        v->visit(this);
+        m_var_decl->accept(v);
+        m_expr->accept(v);
+        m_block->accept(v);
     }
 
     Type type() const
@@ -777,12 +816,14 @@ public:
         return Type::VOID;
     }
 
-    void codeGen(CodeGenContext &context);
+    ir::Value *codeGen(CodeGenContext &context);
 
     YAML::Node yaml() const
     {
         YAML::Node node;
         node["id"] = "foreach";
+        if (m_parallel)
+            node["parallel"] = true;
         node["var"] = m_var_decl->yaml();
         node["iter"] = m_expr->yaml();
         node["block"] = m_block->yaml();
@@ -804,10 +845,13 @@ class WhileStatement : public Statement
     Block *m_block;
 public:
     WhileStatement(Expression *expr, Block *block):
-       m_expr(expr), m_block(block)
+       m_expr(expr), m_block(block) { }
+
+    void accept(Visitor* v)
     {
-        add_child(m_expr);
-        add_child(m_block);
+        v->visit(this);
+        m_expr->accept(v);
+        m_block->accept(v);
     }
 
     Type type() const
@@ -815,7 +859,7 @@ public:
         return Type::VOID;
     }
 
-    void codeGen(CodeGenContext &context);
+    ir::Value *codeGen(CodeGenContext &context);
 
     YAML::Node yaml() const
     {
@@ -0,0 +1,362 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include "number.h"
+
+namespace {
+
+typedef unsigned __int128 uint128;
+
+/*
+    Schubfach. A finite positive double is c 2^q; the decimals that read
+    back as it are those in the rounding interval around it. With k
+    chosen so that c 2^q 10^-k has a few digits left of the point, the
+    interval is scaled by 10^-k, approximated by the 126 bit g 2^r, and
+    the shortest candidate is either one with a digit less, which is a
+    multiple of 10 in the scaled interval, or one of the two integers
+    around the scaled value.
+*/
+const int K_MIN = -324;
+const int K_MAX = 292;
+const int Q_MIN = -1074;
+const uint64_t C_MIN = 1ull << 52;
+const uint64_t MASK_63 = (1ull << 63) - 1;
+
+// floor(q log10(2)), floor(q log10(3/4 2)) and floor(e log2(10))
+int flog10pow2(int q)
+{
+    return (int)((q * 661971961083LL) >> 41);
+}
+
+int flog10_three_quarters_pow2(int q)
+{
+    return (int)((q * 661971961083LL - 274743187321LL) >> 41);
+}
+
+int flog2pow10(int e)
+{
+    return (int)((e * 913124641741LL) >> 38);
+}
+
+/* an unsigned integer of up to 40 words, enough for 2^1200 */
+struct Big {
+    uint32_t w[40];
+    int n;
+
+    Big(int bit) : n(bit / 32 + 1)
+    {
+        memset(w, 0, sizeof(w));
+        w[bit / 32] = 1u << (bit % 32);
+    }
+
+    void mul10()
+    {
+        uint64_t carry = 0;
+        for (int i = 0; i < n; i++) {
+            carry += (uint64_t)w[i] * 10;
+            w[i] = (uint32_t)carry;
+            carry >>= 32;
+        }
+        if (carry)
+            w[n++] = (uint32_t)carry;
+    }
+
+    void div10()
+    {
+        uint64_t rem = 0;
+        for (int i = n - 1; i >= 0; i--) {
+            rem = rem << 32 | w[i];
+            w[i] = (uint32_t)(rem / 10);
+            rem %= 10;
+        }
+        while (n > 1 && !w[n - 1])
+            n--;
+    }
+
+    uint32_t at(int i) const
+    {
+        return i < n ? w[i] : 0;
+    }
+
+    // floor(this / 2^s), which has to fit
+    uint128 shifted(int s) const
+    {
+        const int word = s / 32;
+        const int bit = s % 32;
+        uint128 r = 0;
+        for (int i = 3; i >= 0; i--)
+            r = r << 32 | at(word + i);
+        r >>= bit;
+        if (bit)
+            r |= (uint128)at(word + 4) << (128 - bit);
+        return r;
+    }
+};
+
+/*
+    10^-k = beta 2^r with 2^125 <= beta < 2^126; g = floor(beta) + 1,
+    split into its high and low 63 bits.
+*/
+struct Powers {
+    uint64_t g1[K_MAX - K_MIN + 1];
+    uint64_t g0[K_MAX - K_MIN + 1];
+
+    Powers()
+    {
+        // 10^m for m >= 0
+        Big p(0);
+        for (int m = 0; m <= -K_MIN; m++) {
+            const int f = flog2pow10(m);
+            uint128 beta;
+            if (f <= 125)
+                beta = p.shifted(0) << (125 - f);
+            else
+                beta = p.shifted(f - 125);
+            set(-m, beta);
+            p.mul10();
+        }
+        // floor(2^N / 10^j) for j > 0, then 2^(125 - flog2pow10(-j)) / 10^j
+        const int N = 1200;
+        Big q(N);
+        for (int j = 1; j <= K_MAX; j++) {
+            q.div10();
+            set(j, q.shifted(N - (125 - flog2pow10(-j))));
+        }
+    }
+
+    void set(int k, uint128 beta)
+    {
+        const uint128 g = beta + 1;
+        g1[k - K_MIN] = (uint64_t)(g >> 63);
+        g0[k - K_MIN] = (uint64_t)g & MASK_63;
+    }
+};
+
+const Powers &powers()
+{
+    static const Powers table;
+    return table;
+}
+
+/* g cp 2^-127 rounded to odd */
+uint64_t rop(uint64_t g1, uint64_t g0, uint64_t cp)
+{
+    const uint64_t x1 = (uint64_t)(((uint128)g0 * cp) >> 64);
+    const uint128 y = (uint128)g1 * cp;
+    const uint64_t z = ((uint64_t)y >> 1) + x1;
+    const uint64_t vbp = (uint64_t)(y >> 64) + (z >> 63);
+    return vbp | (((z & MASK_63) + MASK_63) >> 63);
+}
+
+/* c 2^q as f 10^e */
+void to_decimal(int q, uint64_t c, int dk, uint64_t &f, int &e)
+{
+    const uint64_t out = c & 1;
+    const uint64_t cb = c << 2;
+    const uint64_t cbr = cb + 2;
+    uint64_t cbl;
+    int k;
+    if (c != C_MIN || q == Q_MIN) {
+        cbl = cb - 2;
+        k = flog10pow2(q);
+    } else {
+        // the interval below a power of two is half as wide
+        cbl = cb - 1;
+        k = flog10_three_quarters_pow2(q);
+    }
+    const int h = q + flog2pow10(-k) + 2;
+    const uint64_t g1 = powers().g1[k - K_MIN];
+    const uint64_t g0 = powers().g0[k - K_MIN];
+
+    const uint64_t vb = rop(g1, g0, cb << h);
+    const uint64_t vbl = rop(g1, g0, cbl << h);
+    const uint64_t vbr = rop(g1, g0, cbr << h);
+
+    const uint64_t s = vb >> 2;
+    if (s >= 10) {
+        const uint64_t sp10 = 10 * (s / 10);
+        const uint64_t tp10 = sp10 + 10;
+        const bool upin = vbl + out <= sp10 << 2;
+        const bool wpin = (tp10 << 2) + out <= vbr;
+        if (upin != wpin) {
+            f = upin ? sp10 : tp10;
+            e = k + dk;
+            return;
+        }
+    }
+    const uint64_t t = s + 1;
+    const bool uin = vbl + out <= s << 2;
+    const bool win = (t << 2) + out <= vbr;
+    e = k + dk;
+    if (uin != win) {
+        f = uin ? s : t;
+        return;
+    }
+    const int64_t cmp = (int64_t)(vb - ((s + t) << 1));
+    f = cmp < 0 || (cmp == 0 && (s & 1) == 0) ? s : t;
+}
+
+int write_digits(char *buf, const char *digits, int len, int point)
+{
+    char *p = buf;
+    if (point > -5 && point <= 17) {
+        if (point <= 0) {
+            *p++ = '0';
+            *p++ = '.';
+            for (int i = point; i < 0; i++)
+                *p++ = '0';
+            memcpy(p, digits, len);
+            p += len;
+        } else if (point >= len) {
+            memcpy(p, digits, len);
+            p += len;
+            for (int i = len; i < point; i++)
+                *p++ = '0';
+            *p++ = '.';
+            *p++ = '0';
+        } else {
+            memcpy(p, digits, point);
+            p += point;
+            *p++ = '.';
+            memcpy(p, digits + point, len - point);
+            p += len - point;
+        }
+        return p - buf;
+    }
+
+    *p++ = digits[0];
+    if (len > 1) {
+        *p++ = '.';
+        memcpy(p, digits + 1, len - 1);
+        p += len - 1;
+    }
+    int exp = point - 1;
+    *p++ = 'e';
+    *p++ = exp < 0 ? '-' : '+';
+    if (exp < 0)
+        exp = -exp;
+    char tmp[4];
+    int n = 0;
+    do {
+        tmp[n++] = '0' + exp % 10;
+        exp /= 10;
+    } while (exp);
+    while (n)
+        *p++ = tmp[--n];
+    return p - buf;
+}
+
+}
+
+int format_double(double d, char *buf)
+{
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    const uint64_t t = bits & (C_MIN - 1);
+    const int bq = (int)(bits >> 52) & 0x7ff;
+    char *p = buf;
+
+    if (bq == 0x7ff) {
+        const char *text = t ? "nan" : bits >> 63 ? "-inf" : "inf";
+        memcpy(buf, text, strlen(text));
+        return strlen(text);
+    }
+    if (bits >> 63)
+        *p++ = '-';
+
+    uint64_t f;
+    int e = 0;
+    if (bq != 0) {
+        const int mq = -Q_MIN + 1 - bq;
+        const uint64_t c = C_MIN | t;
+        if (mq > 0 && mq < 53 && (c >> mq) << mq == c)
+            f = c >> mq;    // an integer
+        else
+            to_decimal(-mq, c, 0, f, e);
+    } else if (t != 0) {
+        to_decimal(Q_MIN, t, 0, f, e);
+    } else {
+        memcpy(p, "0.0", 3);
+        return p - buf + 3;
+    }
+
+    while (f % 10 == 0) {
+        f /= 10;
+        e++;
+    }
+    char digits[20];
+    char *end = digits + sizeof(digits);
+    char *first = end;
+    do {
+        *--first = '0' + f % 10;
+        f /= 10;
+    } while (f);
+    const int len = end - first;
+    return p - buf + write_digits(p, first, len, len + e);
+}
+
+/*
+    Digits times a power of ten is exact in double arithmetic when both
+    fit in 53 bits (Clinger's fast path); other literals go to strtod,
+    which rounds correctly. The lexer only produces digits with a point.
+*/
+double parse_double(const char *s, size_t n)
+{
+    static const double p10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    // trailing zeros after the point change nothing
+    size_t end = n;
+    const char *point = (const char *)memchr(s, '.', n);
+    if (point) {
+        while (end > (size_t)(point - s) + 1 && s[end - 1] == '0')
+            end--;
+    }
+
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int scale = 0;
+    bool fast = true;
+    for (size_t i = 0; i < end; i++) {
+        if (s[i] == '.')
+            continue;
+        if (s[i] < '0' || s[i] > '9') {
+            fast = false;
+            break;
+        }
+        if (mantissa || s[i] != '0')
+            digits++;
+        mantissa = mantissa * 10 + (s[i] - '0');
+        if (point && s + i > point)
+            scale++;
+        if (digits > 15) {
+            fast = false;
+            break;
+        }
+    }
+    if (fast && scale <= 22)
+        return (double)mantissa / p10[scale];
+
+    char buf[64];
+    if (n < sizeof(buf)) {
+        memcpy(buf, s, n);
+        buf[n] = 0;
+        return strtod(buf, 0);
+    }
+    return strtod(std::string(s, n).c_str(), 0);
+}
+
+long long parse_integer(const char *s, size_t n)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < n; i++) {
+        const unsigned digit = s[i] - '0';
+        if (value > (INT64_MAX - digit) / 10)
+            return INT64_MAX;
+        value = value * 10 + digit;
+    }
+    return (long long)value;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+    Conversions between Doubles and text that don't depend on the locale
+    and don't allocate.
+
+    format_double writes the shortest decimal that reads back as exactly
+    d, the one closest to d if there are several, using the Schubfach
+    algorithm (R. Giulietti, "The Schubfach way to render doubles").
+    Numbers from 1e-5 up to 1e17 are written out in full with at least
+    one decimal ("0.1", "3.0"), others in scientific notation ("1e-7",
+    "2.5e+20"). buf must have room for FORMAT_DOUBLE_MAX characters; the
+    result is not terminated and the return value is its length.
+
+    parse_double reads a TDOUBLE literal such as "12.5", parse_integer a
+    TINTEGER one, saturating like strtoll. Neither needs a terminating
+    nul, so both read straight from the source.
+*/
+enum { FORMAT_DOUBLE_MAX = 32 };
+
+int format_double(double d, char *buf);
+double parse_double(const char *s, size_t n);
+long long parse_integer(const char *s, size_t n);
@@ -0,0 +1,576 @@
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <map>
+#include <set>
+#include "ir.h"
+
+/*
+    Optimizations on the SSA form of a function, run before it is lowered:
+
+    - constant folding, including branches on a constant condition; blocks
+      that can no longer be reached are removed
+    - loop-invariant code motion: a pure instruction in a loop whose
+      operands are all defined outside of it moves to the block that
+      enters the loop, innermost loops first
+    - strength reduction: an Int multiply of an induction variable by a
+      constant becomes an induction variable of its own, stepped by an add
+    - removal of pure instructions whose result is unused
+
+    With report set every change is printed, see --opt-report.
+*/
+namespace ir {
+
+namespace {
+
+struct Loop {
+    BasicBlock *header;
+    // the one block outside the loop that enters it, or 0
+    BasicBlock *preheader;
+    // the blocks that jump back to the header
+    std::vector<BasicBlock*> latches;
+    std::set<BasicBlock*> blocks;
+    int line;
+
+    bool contains(const Value *v) const { return v->block && blocks.count(v->block); }
+};
+
+class Optimizer {
+public:
+    Optimizer(Function &f, bool report) : m_f(f), m_report(report) { }
+
+    void run();
+
+private:
+    Value *int_constant(int i);
+    Value *double_constant(double d);
+    Value *fold(Value *v);
+    void fold_constants();
+    bool fold_branch(BasicBlock *b);
+    void remove_unreachable();
+    void remove_trivial_phis();
+
+    void compute_dominators();
+    bool dominates(BasicBlock *a, BasicBlock *b);
+    void find_loops();
+
+    bool invariant(const Loop &loop, const Value *v);
+    void hoist_invariants(const Loop &loop);
+    void reduce_strength(const Loop &loop);
+    void insert_early(Value *v, BasicBlock *b);
+    void insert_after(Value *v, Value *pos);
+    void remove_dead_code();
+
+    Function &m_f;
+    bool m_report;
+
+    std::vector<BasicBlock*> m_rpo;
+    std::map<BasicBlock*, int> m_order;
+    std::map<BasicBlock*, BasicBlock*> m_idom;
+    std::vector<Loop> m_loops;
+};
+
+void Optimizer::run()
+{
+    remove_unreachable();
+    fold_constants();
+    remove_trivial_phis();
+
+    compute_dominators();
+    find_loops();
+    for (size_t i = 0; i < m_loops.size(); i++)
+        hoist_invariants(m_loops[i]);
+    for (size_t i = 0; i < m_loops.size(); i++)
+        reduce_strength(m_loops[i]);
+
+    remove_dead_code();
+}
+
+Value *Optimizer::int_constant(int i)
+{
+    Value *v = m_f.new_value(CONST, ::Type::INT);
+    v->imm = i;
+    return v;
+}
+
+Value *Optimizer::double_constant(double d)
+{
+    Value *v = m_f.new_value(CONST, ::Type::DOUBLE);
+    v->dbl = d;
+    return v;
+}
+
+/*
+    The constant v evaluates to, or 0. Results are computed the way the
+    interpreter would, only what it would not trap or fail on is folded.
+*/
+Value *Optimizer::fold(Value *v)
+{
+    if (v->args.size() != 2 || v->op < ADD || v->op > CLT)
+        return 0;
+    const Value *a = v->args[0], *b = v->args[1];
+    if (a->op != CONST || b->op != CONST || a->type.id != v->type.id || b->type.id != v->type.id)
+        return 0;
+
+    if (v->type.id == ::Type::INT) {
+        // wrap around on overflow like the machine does
+        const unsigned x = a->imm, y = b->imm;
+        int r;
+        switch (v->op) {
+        case ADD: r = int(x + y); break;
+        case SUB: r = int(x - y); break;
+        case MUL: r = int(x * y); break;
+        case DIV:
+            if (b->imm == 0 || (a->imm == INT_MIN && b->imm == -1))
+                return 0;
+            r = a->imm / b->imm;
+            break;
+        case AND: r = a->imm && b->imm; break;
+        case CMP: r = a->imm == b->imm; break;
+        default: r = a->imm < b->imm; break;
+        }
+        return int_constant(r);
+    }
+    if (v->type.id == ::Type::DOUBLE) {
+        switch (v->op) {
+        case ADD: return double_constant(a->dbl + b->dbl);
+        case SUB: return double_constant(a->dbl - b->dbl);
+        case MUL: return double_constant(a->dbl * b->dbl);
+        case DIV: return double_constant(a->dbl / b->dbl);
+        case CMP: return int_constant(a->dbl == b->dbl);
+        case CLT: return int_constant(a->dbl < b->dbl);
+        default: return 0;
+        }
+    }
+    if (v->type.id == ::Type::STRING && v->op == CMP)
+        return int_constant(*a->str == *b->str);
+    return 0;
+}
+
+void Optimizer::fold_constants()
+{
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (auto b : m_f.blocks) {
+            for (size_t i = 0; i < b->insns.size(); i++) {
+                Value *v = b->insns[i];
+                Value *c = fold(v);
+                if (!c)
+                    continue;
+                if (m_report)
+                    printf("%s: line %d: folded %s%s to a constant\n",
+                           m_f.name.c_str(), v->line, name(v->op), suffix(v->type));
+                c->line = v->line;
+                replace_uses(v, c);
+                remove(v);
+                i--;
+                changed = true;
+            }
+            if (fold_branch(b)) {
+                remove_unreachable();
+                changed = true;
+                break;
+            }
+        }
+    }
+}
+
+/*
+    A branch on a constant becomes a jump. Only 0 and 1 are taken as
+    constant conditions, which is all comparisons produce.
+*/
+bool Optimizer::fold_branch(BasicBlock *b)
+{
+    Value *br = b->terminator();
+    if (!br || br->op != BRANCH || br->args[0]->op != CONST || br->args[0]->type.id != ::Type::INT)
+        return false;
+    const int cond = br->args[0]->imm;
+    if (cond != 0 && cond != 1)
+        return false;
+
+    if (m_report)
+        printf("%s: line %d: condition is always %s\n",
+               m_f.name.c_str(), br->args[0]->line, cond ? "true" : "false");
+    BasicBlock *dropped = b->succs[cond ? 1 : 0];
+    remove(br);
+    remove_edge(b, dropped);
+    Value *jump = m_f.new_value(JUMP, ::Type::VOID);
+    jump->block = b;
+    b->insns.push_back(jump);
+    return true;
+}
+
+/*
+    Blocks no longer reached from the entry lose their edges and their
+    instructions, so nothing that is reachable refers to them.
+*/
+void Optimizer::remove_unreachable()
+{
+    std::set<BasicBlock*> reached;
+    std::vector<BasicBlock*> work(1, m_f.entry());
+    reached.insert(m_f.entry());
+    while (!work.empty()) {
+        BasicBlock *b = work.back();
+        work.pop_back();
+        for (auto s : b->succs) {
+            if (reached.insert(s).second)
+                work.push_back(s);
+        }
+    }
+
+    std::vector<BasicBlock*> dead;
+    for (auto b : m_f.blocks) {
+        if (!reached.count(b))
+            dead.push_back(b);
+    }
+    for (auto b : dead) {
+        while (!b->succs.empty())
+            remove_edge(b, b->succs.back());
+    }
+    for (auto b : dead) {
+        // values are only used by instructions they dominate
+        while (!b->insns.empty()) {
+            Value *v = b->insns.back();
+            v->users.clear();
+            remove(v);
+        }
+    }
+
+    std::vector<BasicBlock*> blocks;
+    for (auto b : m_f.blocks) {
+        if (reached.count(b))
+            blocks.push_back(b);
+    }
+    m_f.blocks = blocks;
+}
+
+/* phis left with one operand by removed edges */
+void Optimizer::remove_trivial_phis()
+{
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (auto b : m_f.blocks) {
+            for (size_t i = 0; i < b->insns.size() && b->insns[i]->op == PHI; i++) {
+                Value *phi = b->insns[i];
+                Value *same = 0;
+                bool trivial = true;
+                for (auto arg : phi->args) {
+                    if (arg == phi || arg == same)
+                        continue;
+                    if (same)
+                        trivial = false;
+                    same = arg;
+                }
+                if (!trivial || !same)
+                    continue;
+                std::vector<Value*> &u = phi->users;
+                u.erase(std::remove(u.begin(), u.end(), phi), u.end());
+                replace_uses(phi, same);
+                remove(phi);
+                changed = true;
+                break;
+            }
+        }
+    }
+}
+
+/*
+    Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm".
+*/
+void Optimizer::compute_dominators()
+{
+    std::set<BasicBlock*> visited;
+    std::vector<std::pair<BasicBlock*, size_t> > stack;
+    std::vector<BasicBlock*> postorder;
+    stack.push_back(std::make_pair(m_f.entry(), 0));
+    visited.insert(m_f.entry());
+    while (!stack.empty()) {
+        BasicBlock *b = stack.back().first;
+        size_t &next = stack.back().second;
+        if (next < b->succs.size()) {
+            BasicBlock *s = b->succs[next++];
+            if (visited.insert(s).second)
+                stack.push_back(std::make_pair(s, 0));
+        } else {
+            postorder.push_back(b);
+            stack.pop_back();
+        }
+    }
+    m_rpo.assign(postorder.rbegin(), postorder.rend());
+    for (size_t i = 0; i < m_rpo.size(); i++)
+        m_order[m_rpo[i]] = i;
+
+    m_idom[m_f.entry()] = m_f.entry();
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = 1; i < m_rpo.size(); i++) {
+            BasicBlock *b = m_rpo[i];
+            BasicBlock *idom = 0;
+            for (auto p : b->preds) {
+                if (!m_idom.count(p))
+                    continue;
+                if (!idom) {
+                    idom = p;
+                    continue;
+                }
+                BasicBlock *x = p, *y = idom;
+                while (x != y) {
+                    while (m_order[x] > m_order[y])
+                        x = m_idom[x];
+                    while (m_order[y] > m_order[x])
+                        y = m_idom[y];
+                }
+                idom = x;
+            }
+            if (m_idom[b] != idom) {
+                m_idom[b] = idom;
+                changed = true;
+            }
+        }
+    }
+}
+
+bool Optimizer::dominates(BasicBlock *a, BasicBlock *b)
+{
+    while (b != a && b != m_f.entry())
+        b = m_idom[b];
+    return b == a;
+}
+
+/*
+    A natural loop per block that an edge jumps back to from a block it
+    dominates, sorted so that inner loops come before the loops around
+    them.
+*/
+void Optimizer::find_loops()
+{
+    std::map<BasicBlock*, Loop> loops;
+    for (auto b : m_rpo) {
+        for (auto s : b->succs) {
+            if (!dominates(s, b))
+                continue;
+            Loop &loop = loops[s];
+            loop.header = s;
+            loop.latches.push_back(b);
+        }
+    }
+
+    for (auto &it : loops) {
+        Loop &loop = it.second;
+        loop.blocks.insert(loop.header);
+        std::vector<BasicBlock*> work(loop.latches);
+        while (!work.empty()) {
+            BasicBlock *b = work.back();
+            work.pop_back();
+            if (!loop.blocks.insert(b).second)
+                continue;
+            for (auto p : b->preds)
+                work.push_back(p);
+        }
+
+        loop.preheader = 0;
+        for (auto p : loop.header->preds) {
+            if (loop.blocks.count(p))
+                continue;
+            if (loop.preheader) {
+                loop.preheader = 0;
+                break;
+            }
+            loop.preheader = p;
+        }
+        // the first line in it, that of the condition of a while
+        loop.line = 0;
+        for (auto b : loop.blocks) {
+            for (auto v : b->insns) {
+                if (v->line && (!loop.line || v->line < loop.line))
+                    loop.line = v->line;
+            }
+        }
+        m_loops.push_back(loop);
+    }
+
+    std::stable_sort(m_loops.begin(), m_loops.end(), [](const Loop &a, const Loop &b) {
+        return a.blocks.size() < b.blocks.size();
+    });
+}
+
+bool Optimizer::invariant(const Loop &loop, const Value *v)
+{
+    if (!v->is_pure() || v->op == PHI)
+        return false;
+    for (auto arg : v->args) {
+        if (loop.contains(arg))
+            return false;
+    }
+    return true;
+}
+
+/*
+    Pure instructions cannot trap, so they can go to the end of the
+    preheader even when that branches around the loop. Blocks are walked
+    in order, so an instruction that depends on another invariant one
+    follows it out.
+*/
+void Optimizer::hoist_invariants(const Loop &loop)
+{
+    if (!loop.preheader)
+        return;
+    for (auto b : m_rpo) {
+        if (!loop.blocks.count(b))
+            continue;
+        for (size_t i = 0; i < b->insns.size(); i++) {
+            Value *v = b->insns[i];
+            if (!invariant(loop, v))
+                continue;
+            b->insns.erase(b->insns.begin() + i--);
+            insert_early(v, loop.preheader);
+            if (m_report)
+                printf("%s: line %d: hoisted %s%s out of the loop at line %d\n",
+                       m_f.name.c_str(), v->line, name(v->op), suffix(v->type), loop.line);
+        }
+    }
+}
+
+/*
+    Put v into b after the definitions of its operands, but ahead of the
+    rest of the block, so it stays out of the way of the comparison the
+    block ends with.
+*/
+void Optimizer::insert_early(Value *v, BasicBlock *b)
+{
+    size_t pos = 0;
+    while (pos < b->insns.size() && b->insns[pos]->op == PHI)
+        pos++;
+    for (size_t i = pos; i < b->insns.size(); i++) {
+        if (std::find(v->args.begin(), v->args.end(), b->insns[i]) != v->args.end())
+            pos = i + 1;
+    }
+    b->insns.insert(b->insns.begin() + pos, v);
+    v->block = b;
+}
+
+void Optimizer::insert_after(Value *v, Value *pos)
+{
+    std::vector<Value*> &insns = pos->block->insns;
+    insns.insert(std::find(insns.begin(), insns.end(), pos) + 1, v);
+    v->block = pos->block;
+}
+
+/*
+    i = phi [init, preheader], [i + step, latch] is a basic induction
+    variable when step is a constant. i * k then equals another one,
+    j = phi [init * k, preheader], [j + step * k, latch], which replaces
+    the multiply by an add. The same goes for (i + step) * k, which is
+    j + step * k. Only Int multiplies are reduced, with Doubles the sums
+    would round differently.
+*/
+void Optimizer::reduce_strength(const Loop &loop)
+{
+    BasicBlock *h = loop.header;
+    if (!loop.preheader || loop.latches.size() != 1 || h->preds.size() != 2)
+        return;
+    const int in = h->preds[0] == loop.preheader ? 0 : 1;
+
+    std::vector<Value*> phis;
+    for (auto v : h->insns) {
+        if (v->op == PHI)
+            phis.push_back(v);
+    }
+    for (auto i : phis) {
+        Value *init = i->args[in], *next = i->args[1 - in];
+        if (i->type.id != ::Type::INT || next->op != ADD || next->type.id != ::Type::INT || !loop.contains(next))
+            continue;
+        Value *step = next->args[0] == i ? next->args[1] : next->args[0];
+        if ((next->args[0] != i && next->args[1] != i) || step->op != CONST || step->type.id != ::Type::INT)
+            continue;
+
+        // one derived induction variable per factor
+        std::map<int, std::pair<Value*, Value*> > derived;
+        std::vector<Value*> users(i->users);
+        users.insert(users.end(), next->users.begin(), next->users.end());
+        for (auto mul : users) {
+            if (mul->op != MUL || mul->type.id != ::Type::INT || !mul->block || !loop.contains(mul))
+                continue;
+            Value *base = mul->args[0] == i || mul->args[0] == next ? mul->args[0] : mul->args[1];
+            Value *k = base == mul->args[0] ? mul->args[1] : mul->args[0];
+            if ((base != i && base != next) || k->op != CONST || k->type.id != ::Type::INT)
+                continue;
+
+            if (!derived.count(k->imm)) {
+                const int dstep = int(unsigned(step->imm) * unsigned(k->imm));
+                const int dinit = int(unsigned(init->imm) * unsigned(k->imm));
+                Value *start;
+                if (init->op == CONST) {
+                    start = int_constant(dinit);
+                } else {
+                    start = m_f.new_value(MUL, ::Type::INT);
+                    start->line = mul->line;
+                    start->args.push_back(init);
+                    start->args.push_back(int_constant(k->imm));
+                    for (auto arg : start->args)
+                        arg->users.push_back(start);
+                    insert_early(start, loop.preheader);
+                }
+
+                Value *j = m_f.new_value(PHI, ::Type::INT);
+                j->block = h;
+                h->insns.insert(h->insns.begin(), j);
+                Value *jnext = m_f.new_value(ADD, ::Type::INT);
+                jnext->line = next->line;
+                jnext->args.push_back(j);
+                jnext->args.push_back(int_constant(dstep));
+                for (auto arg : jnext->args)
+                    arg->users.push_back(jnext);
+                insert_after(jnext, next);
+
+                j->args.resize(2);
+                j->args[in] = start;
+                j->args[1 - in] = jnext;
+                start->users.push_back(j);
+                jnext->users.push_back(j);
+                derived[k->imm] = std::make_pair(j, jnext);
+            }
+
+            if (m_report)
+                printf("%s: line %d: reduced mul.i to an add in the loop at line %d\n",
+                       m_f.name.c_str(), mul->line, loop.line);
+            const std::pair<Value*, Value*> &d = derived[k->imm];
+            replace_uses(mul, base == i ? d.first : d.second);
+            remove(mul);
+        }
+    }
+}
+
+void Optimizer::remove_dead_code()
+{
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (auto b : m_f.blocks) {
+            for (size_t i = 0; i < b->insns.size(); i++) {
+                Value *v = b->insns[i];
+                bool used = false;
+                for (auto u : v->users)
+                    used |= u != v;
+                if (used || !v->is_pure())
+                    continue;
+                v->users.clear();
+                remove(v);
+                i--;
+                changed = true;
+            }
+        }
+    }
+}
+
+}
+
+void optimize(Function &f, bool report)
+{
+    Optimizer(f, report).run();
+}
+
+}
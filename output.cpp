@@ -0,0 +1,30 @@
+#include <stdint.h>
+#include "output.h"
+#include "number.h"
+
+/* the digits of n, written backwards from end; returns where they start */
+static char *format_digits(char *end, uint64_t n)
+{
+    do {
+        *--end = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    return end;
+}
+
+void Output::write_int(int i)
+{
+    char buf[16];
+    char *end = buf + sizeof(buf);
+    const uint64_t n = i < 0 ? -(int64_t)i : i;
+    char *p = format_digits(end, n);
+    if (i < 0)
+        *--p = '-';
+    write(p, end - p);
+}
+
+void Output::write_double(double d)
+{
+    char buf[FORMAT_DOUBLE_MAX];
+    write(buf, format_double(d, buf));
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+/*
+    Everything a program prints goes through one buffer that is written
+    to stdout when it fills up and when the program stops, instead of
+    through a printf per value. Numbers are formatted here rather than
+    by libc, Doubles as the shortest text that reads back the same (see
+    number.h).
+
+    Anything else that writes to stdout while a program runs (errors,
+    debug traces) has to flush() first to keep the output in order.
+
+    A worker of a parallel foreach captures its output in a string
+    instead, which the VM that started the loop writes out in order, and
+    so can a host that runs several VMs at once.
+*/
+class Output {
+public:
+    enum { SIZE = 1 << 16 };
+
+    Output() : m_used(0), m_capture(0) { }
+    ~Output() { flush(); }
+
+    void write(const char *s, size_t n)
+    {
+        if (n > SIZE - m_used) {
+            flush();
+            if (n > SIZE) {
+                emit(s, n);
+                return;
+            }
+        }
+        memcpy(m_buffer + m_used, s, n);
+        m_used += n;
+    }
+
+    void write(const std::string &s) { write(s.data(), s.size()); }
+
+    // as printf("%d"), and as format_double
+    void write_int(int i);
+    void write_double(double d);
+
+    void flush()
+    {
+        if (m_used)
+            emit(m_buffer, m_used);
+        m_used = 0;
+        if (!m_capture)
+            fflush(stdout);
+    }
+
+    /* flushes to the end of to from now on, or to stdout again if it's 0 */
+    void capture(std::string *to)
+    {
+        flush();
+        m_capture = to;
+    }
+
+private:
+    void emit(const char *s, size_t n)
+    {
+        if (m_capture)
+            m_capture->append(s, n);
+        else
+            fwrite(s, 1, n, stdout);
+    }
+
+    char m_buffer[SIZE];
+    size_t m_used;
+    std::string *m_capture;
+};
@@ -0,0 +1,242 @@
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include "vm.h"
+
+/*
+    Parallel foreach.
+
+    The body of a parallel foreach is compiled as a function of its own,
+    whose parameter 0 is the index and the others are the values of the
+    variables it uses from outside (see ForeachStatement::codeGen).
+    PARALLEL hands the indices out to worker VMs, each with its own
+    operand stack, frames and heap, which run the body on copies of those
+    values, so the iterations share nothing but what they only read.
+
+    The index range is split evenly between the workers. A worker takes
+    grain indices at a time from the front of its own span, and when that
+    is empty steals the upper half of the largest span left, so uneven
+    iterations still keep every worker busy to the end.
+
+    What a worker prints while it runs a piece of the range goes to a
+    string of that piece; once all are done the pieces are written out by
+    index, so the output is the same as that of a plain foreach. If an
+    iteration fails, the iterations before it still run, and their output
+    and that of the failing one up to the failure come out before the
+    failure is reported, as if the loop had run in order.
+*/
+
+namespace {
+
+/* the indices [next, end) of a worker that others can steal from */
+struct Span {
+    std::mutex lock;
+    int64_t next, end;
+};
+
+/* the output of the indices from begin on, as one worker ran them */
+struct Piece {
+    int64_t begin;
+    std::string text;
+};
+
+}
+
+struct ToyVm::Job {
+    uint32 entry;
+    std::vector<IValue> values;
+    int64_t start, step, grain;
+    std::vector<Span> spans;
+    std::vector<std::vector<Piece> > pieces;
+
+    // the first index that failed, count if none did yet, and how
+    std::atomic<int64_t> failed;
+    Failure failure;
+    std::mutex failure_lock;
+
+    Job(int workers) : spans(workers), pieces(workers) { }
+
+    bool take(int self, int64_t &begin, int64_t &end);
+    void fail(int64_t i, const Failure &f);
+};
+
+bool ToyVm::Job::take(int self, int64_t &begin, int64_t &end)
+{
+    Span &own = spans[self];
+    for (;;) {
+        {
+            std::lock_guard<std::mutex> lock(own.lock);
+            if (own.next < own.end && own.next < failed) {
+                begin = own.next;
+                end = std::min(own.end, begin + grain);
+                own.next = end;
+                return true;
+            }
+        }
+
+        int victim = -1;
+        int64_t most = 0;
+        for (int w = 0; w < (int)spans.size(); w++) {
+            std::lock_guard<std::mutex> lock(spans[w].lock);
+            const int64_t left = std::min<int64_t>(spans[w].end, failed) - spans[w].next;
+            if (w != self && left > most) {
+                victim = w;
+                most = left;
+            }
+        }
+        if (victim < 0)
+            return false;
+
+        int64_t from, to;
+        {
+            std::lock_guard<std::mutex> lock(spans[victim].lock);
+            Span &v = spans[victim];
+            if (v.next >= v.end)
+                continue;
+            to = v.end;
+            from = v.end - v.next < 2 * grain ? v.next : v.next + (v.end - v.next) / 2;
+            v.end = from;
+        }
+        std::lock_guard<std::mutex> lock(own.lock);
+        own.next = from;
+        own.end = to;
+    }
+}
+
+void ToyVm::Job::fail(int64_t i, const Failure &f)
+{
+    std::lock_guard<std::mutex> lock(failure_lock);
+    if (i < failed) {
+        failed = i;
+        failure = f;
+    }
+}
+
+/*
+    Make this worker ready to run code of parent: the Program parent
+    runs, shared, whose call sites tiering never patched.
+*/
+void ToyVm::adopt(ToyVm &parent)
+{
+    load(parent.m_program);
+    m_dispatch = parent.m_dispatch;
+    set_debug(parent.m_debug);
+    m_parent = &parent;
+    m_heap.set_parent(&parent.m_heap);
+}
+
+void ToyVm::work(Job &job, int self)
+{
+    std::vector<Piece> &pieces = job.pieces[self];
+    const uint32 n = job.values.size();
+    int64_t begin, end;
+    sigjmp_buf recover;
+    while (job.take(self, begin, end)) {
+        pieces.push_back(Piece{ begin, std::string() });
+        m_out.capture(&pieces.back().text);
+        // read after a jump back from the SIGSEGV handler
+        volatile int64_t i = begin;
+        if (sigsetjmp(recover, 1)) {
+            m_recover = 0;
+            job.fail(i, Failure{ Failure::OPERAND_STACK_OVERFLOW });
+        } else {
+            m_recover = &recover;
+            for (; i < end && i < job.failed; i++) {
+                m_frames[0].int_value = job.start + i * job.step;
+                for (uint32 k = 0; k < n; k++)
+                    m_frames[k + 1] = job.values[k];
+                try {
+                    interpret(job.entry, STACK_SLOTS - 1, m_frames);
+                } catch (const Failure &f) {
+                    job.fail(i, f);
+                    break;
+                }
+            }
+            m_recover = 0;
+        }
+        m_out.capture(0);
+    }
+}
+
+/*
+    PARALLEL: run the function at entry for every index from start
+    towards stop in steps of step. These are on the stack below the
+    values for its other parameters, which are on top, the last one
+    first. Returns sp with all of them popped.
+
+    A worker runs a nested parallel foreach itself, in order, and so
+    does a VM with a single thread.
+*/
+uint32 ToyVm::parallel(uint32 sp, IValue *frame, uint32 entry, uint32 values, uint32 frame_size)
+{
+    const IValue *top = &stack(sp + 1);
+    const int64_t step = top[values].int_value;
+    const int64_t stop = top[values + 1].int_value;
+    const int64_t start = top[values + 2].int_value;
+    int64_t count = 0;
+    if (step > 0 && start < stop)
+        count = (stop - start + step - 1) / step;
+    else if (step < 0 && start > stop)
+        count = (start - stop - step - 1) / -step;
+
+    int threads = m_threads ? m_threads : std::thread::hardware_concurrency();
+    threads = (int)std::min<int64_t>(std::min(threads, (int)MAX_WORKERS), count);
+    if (m_parent || threads < 2) {
+        IValue *callee = push_frame(frame, frame_size);
+        for (int64_t i = 0; i < count; i++) {
+            callee[0].int_value = start + i * step;
+            for (uint32 k = 0; k < values; k++)
+                callee[k + 1] = top[values - 1 - k];
+            if (m_parent)
+                interpret(entry, sp, callee);
+            else if (m_native[entry])
+                enter(m_native[entry], sp, callee);
+            else
+                call_function(entry, sp, callee);
+        }
+        return sp + values + 3;
+    }
+
+    Job job(threads);
+    job.entry = entry;
+    for (uint32 k = 0; k < values; k++)
+        job.values.push_back(top[values - 1 - k]);
+    job.start = start;
+    job.step = step;
+    job.grain = std::max<int64_t>(1, count / (threads * 16));
+    job.failed = count;
+    for (int w = 0; w < threads; w++) {
+        job.spans[w].next = count * w / threads;
+        job.spans[w].end = count * (w + 1) / threads;
+    }
+
+    while ((int)m_workers.size() < threads)
+        m_workers.push_back(new ToyVm);
+    std::vector<std::thread> running;
+    for (int w = 0; w < threads; w++) {
+        m_workers[w]->adopt(*this);
+        running.push_back(std::thread(&ToyVm::work, m_workers[w], std::ref(job), w));
+    }
+    for (auto &t : running)
+        t.join();
+
+    std::vector<Piece *> order;
+    for (auto &pieces : job.pieces) {
+        for (auto &piece : pieces)
+            order.push_back(&piece);
+    }
+    std::sort(order.begin(), order.end(), [](const Piece *a, const Piece *b) { return a->begin < b->begin; });
+    for (auto piece : order) {
+        if (piece->begin > job.failed)
+            break;
+        m_out.write(piece->text);
+    }
+    if (job.failed < count) {
+        if (job.failure.kind == Failure::CALL_STACK_OVERFLOW)
+            stack_overflow();
+        if (job.failure.kind == Failure::OPERAND_STACK_OVERFLOW)
+            operand_stack_overflow();
+        check(0);
+    }
+    return sp + values + 3;
+}
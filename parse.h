@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "ast.h"
+
+class Block;
+
+/* a token's text, as where it is in the source of its ParseContext */
+struct Lexeme {
+    uint32_t offset;
+    uint32_t length;
+};
+
+/*
+    Everything about parsing one source file. The scanner (tokens.l) and
+    the parser (parser.y) are reentrant and keep their state in here, so
+    any number of files can be parsed at once, one ParseContext each.
+
+    The file is memory mapped and scanned in place: tokens are Lexemes
+    into the mapping rather than strings, numbers are read straight from
+    it and each identifier and type name is copied out once, to the
+    symbol table, which the tree refers to. So the ParseContext has to
+    outlive the tree it parsed.
+
+    The tree itself is made in arena, and release_tree() frees it all
+    at once when code has been generated from it.
+
+    A Node takes its line number from the ParseContext that is parsing
+    on the thread that creates it, see current_line().
+*/
+class ParseContext {
+public:
+    ParseContext();
+    ~ParseContext();
+    ParseContext(const ParseContext &) = delete;
+    ParseContext &operator=(const ParseContext &) = delete;
+
+    /* parse the file at path; false if it can't be read */
+    bool parse_file(const char *path);
+
+    Lexeme lexeme(const char *text, size_t length) const
+    {
+        Lexeme l = { (uint32_t)(text - m_source), (uint32_t)length };
+        return l;
+    }
+    const char *text(Lexeme l) const { return m_source + l.offset; }
+    /* the one copy of the name l */
+    const std::string &symbol(Lexeme l);
+
+    void release_tree()
+    {
+        program = 0;
+        arena.release();
+    }
+
+    // the top level block, once parsed
+    Block *program;
+    Arena arena;
+    int line;
+    int errors;
+
+    static int current_line() { return s_current ? s_current->line : 0; }
+
+private:
+    bool load(int fd);
+    bool parse();
+
+    struct Name {
+        const char *text;
+        uint32_t length;
+        bool operator==(const Name &other) const;
+    };
+    struct NameHash {
+        size_t operator()(const Name &name) const;
+    };
+
+    // the source and the two nuls the scanner needs after it, in
+    // m_mapped bytes of mapping or, if it can't be mapped, in m_read
+    char *m_source;
+    size_t m_size;
+    size_t m_mapped;
+    std::vector<char> m_read;
+    std::unordered_map<Name, std::string, NameHash> m_symbols;
+
+    static thread_local ParseContext *s_current;
+};
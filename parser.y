@@ -1,17 +1,14 @@
+%code requires {
+    #include "parse.h"
+}
 %{
+    #include <climits>
     #include <cstdio>
     #include "node.h"
-    Block *programBlock; /* the top level root node of our final AST */
-
-    int line_num = 1;
-    int error_count = 0;
-    extern int yylex();
-    void yyerror(const char *s)
-    {
-      printf("ERROR: line %d: %s\n", line_num, s);
-      error_count++;
-    }
 %}
+%define api.pure full
+%parse-param { ParseContext *context } { void *scanner }
+%lex-param { void *scanner }
 %error-verbose
 
 
@@ -25,9 +22,9 @@
     Typename *type;
     ListLiteral *listliteral;
     VariableDeclaration *var_decl;
-    std::vector<VariableDeclaration*> *varvec;
-    std::vector<Expression*> *exprvec;
-    std::string *string;
+    VariableList *varvec;
+    ExpressionList *exprvec;
+    Lexeme lexeme;
     int token;
 }
 
@@ -35,11 +32,11 @@
    match our tokens.l lex file. We also define the node type
    they represent.
  */
-%token <string> TIDENTIFIER TTYPENAME TINTEGER TDOUBLE TSTRING
+%token <lexeme> TIDENTIFIER TTYPENAME TINTEGER TDOUBLE TSTRING
 %token <token> TCEQ TCNE TCLT TCLE TCGT TCGE TEQUAL
 %token <token> TLPAREN TRPAREN TLBRACE TRBRACE TLBRACKET TRBRACKET TCOMMA TDOT TSEMICOLON TCOLON TNEWLINE
 %token <token> TPLUS TMINUS TMUL TDIV TAND
-%token <token> TEXTERN TIF TELSE TRETURN TFUNC TASSERT TPRINT TFOREACH TWHILE
+%token <token> TEXTERN TIF TELSE TRETURN TFUNC TASSERT TPRINT TFOREACH TPARALLEL TWHILE
 
 /* Define the type of node our nonterminal symbols represent.
    The types refer to the %union declaration above. Ex: when
@@ -62,15 +59,24 @@
 %left TPLUS TMINUS
 %left TMUL TDIV
 
+%code {
+    int yylex(YYSTYPE *lval, void *scanner);
+    void yyerror(ParseContext *context, void *scanner, const char *s)
+    {
+      printf("ERROR: line %d: %s\n", context->line, s);
+      context->errors++;
+    }
+}
+
 %start program
 
 %%
 
-program : stmts { programBlock = $1; }
+program : stmts { context->program = $1; }
         ;
 
-stmts : stmt { $$ = new Block(); $$->add_statement($<stmt>1); }
-      | stmts stmt { $1->add_statement($<stmt>2); }
+stmts : stmt { $$ = context->arena.make<Block>(); $$->add_statement(context->arena, $<stmt>1); }
+      | stmts stmt { $1->add_statement(context->arena, $<stmt>2); }
       | stmts TNEWLINE {}
       | stmts error { yyclearin; yyerrok; }
       ;
@@ -84,34 +90,35 @@ stmt : var_decl TSEMICOLON
      | return_stmt TSEMICOLON
      | assert_stmt TSEMICOLON
      | print_stmt TSEMICOLON
-     | expr TSEMICOLON { $$ = new ExpressionStatement(*$1); }
+     | expr TSEMICOLON { $$ = context->arena.make<ExpressionStatement>(*$1); }
      ;
 
 block : TLBRACE stmts TRBRACE { $$ = $2; }
-      | TLBRACE TRBRACE { $$ = new Block(); }
+      | TLBRACE TRBRACE { $$ = context->arena.make<Block>(); }
       ;
 
-var_decl : type ident { $$ = new VariableDeclaration($1, $2); }
-         | type ident TEQUAL expr { $$ = new VariableDeclaration($1, $2, $4); }
+var_decl : type ident { $$ = context->arena.make<VariableDeclaration>($1, $2); }
+         | type ident TEQUAL expr { $$ = context->arena.make<VariableDeclaration>($1, $2, $4); }
          ;
 
-if_stmt  : TIF TLPAREN expr TRPAREN block TELSE block { $$ = new IfStatement($3, $5, $7); }
-         | TIF TLPAREN expr TRPAREN block  { $$ = new IfStatement($3, $5, 0); }
+if_stmt  : TIF TLPAREN expr TRPAREN block TELSE block { $$ = context->arena.make<IfStatement>($3, $5, $7); }
+         | TIF TLPAREN expr TRPAREN block  { $$ = context->arena.make<IfStatement>($3, $5); }
          ;
 
-assert_stmt: TASSERT expr { $$ = new AssertStatement($2); }
+assert_stmt: TASSERT expr { $$ = context->arena.make<AssertStatement>($2); }
          ;
 
-print_stmt: TPRINT expr { $$ = new PrintStatement($2); }
+print_stmt: TPRINT expr { $$ = context->arena.make<PrintStatement>($2); }
          ;
 
-return_stmt: TRETURN expr { $$ = new ReturnStatement($2); }
+return_stmt: TRETURN expr { $$ = context->arena.make<ReturnStatement>($2); }
          ;
 
-foreach_stmt: TFOREACH TLPAREN var_decl TCOLON expr TRPAREN block { $$ = new ForeachStatement($3, $5, $7); }
+foreach_stmt: TFOREACH TLPAREN var_decl TCOLON expr TRPAREN block { $$ = context->arena.make<ForeachStatement>($3, $5, $7); }
+         | TPARALLEL TFOREACH TLPAREN var_decl TCOLON expr TRPAREN block { $$ = context->arena.make<ForeachStatement>($4, $6, $8, true); }
          ;
 
-while_stmt: TWHILE TLPAREN expr TRPAREN block { $$ = new WhileStatement($3, $5); }
+while_stmt: TWHILE TLPAREN expr TRPAREN block { $$ = context->arena.make<WhileStatement>($3, $5); }
          ;
 
 
@@ -119,25 +126,33 @@ while_stmt: TWHILE TLPAREN expr TRPAREN block { $$ = new WhileStatement($3, $5);
 //         ;
 
 func_decl : TFUNC ident TEQUAL type TLPAREN func_decl_args TRPAREN block
-            { $$ = new FunctionDeclaration($4, $2, $6, $8); }
+            { $$ = context->arena.make<FunctionDeclaration>($4, $2, $6, $8); }
           ;
 
-func_decl_args : /*blank*/  { $$ = new VariableList(); }
-          | var_decl { $$ = new VariableList(); $$->push_back($<var_decl>1); }
-          | func_decl_args TCOMMA var_decl { $1->push_back($<var_decl>3); }
+func_decl_args : /*blank*/  { $$ = context->arena.make<VariableList>(); }
+          | var_decl { $$ = context->arena.make<VariableList>(); $$->push_back(context->arena, $<var_decl>1); }
+          | func_decl_args TCOMMA var_decl { $1->push_back(context->arena, $<var_decl>3); }
           ;
 
-ident : TIDENTIFIER { $$ = new Identifier(*$1); delete $1; }
+ident : TIDENTIFIER { $$ = context->arena.make<Identifier>(context->symbol($1)); }
       ;
 
-type : TTYPENAME { $$ = new Typename(*$1); delete $1; }
+type : TTYPENAME { $$ = context->arena.make<Typename>(context->symbol($1)); }
       ;
 
-numeric : TINTEGER { $$ = new Integer(atol($1->c_str())); delete $1; }
-        | TDOUBLE { $$ = new Double(atof($1->c_str())); delete $1; }
+numeric : TINTEGER
+          {
+              const long long value = parse_integer(context->text($1), $1.length);
+              if (value > INT_MAX) {
+                  const std::string literal(context->text($1), $1.length);
+                  yyerror(context, scanner, ("integer " + literal + " doesn't fit an Int").c_str());
+              }
+              $$ = context->arena.make<Integer>(value);
+          }
+        | TDOUBLE { $$ = context->arena.make<Double>(parse_double(context->text($1), $1.length)); }
         ;
 
-string : TSTRING { $$ = new String($1); delete $1; }
+string : TSTRING { $$ = context->arena.make<String>(context->text($1), $1.length); }
        ;
 
 literal : numeric
@@ -147,28 +162,28 @@ literal : numeric
 list_literal : TLBRACKET list_elements TRBRACKET { $$ = $2; }
              ;
 
-list_elements  : /*blank*/  { $$ = new ListLiteral(); }
-               | expr { $$ = new ListLiteral(); $$->add($1); }
-               | list_elements TCOMMA expr { $1->add($3); }
+list_elements  : /*blank*/  { $$ = context->arena.make<ListLiteral>(); }
+               | expr { $$ = context->arena.make<ListLiteral>(); $$->add(context->arena, $1); }
+               | list_elements TCOMMA expr { $1->add(context->arena, $3); }
                ;
 
-expr : ident TEQUAL expr { $$ = new Assignment($<ident>1, $3); }
-     | ident TLPAREN call_args TRPAREN { $$ = new MethodCall($1, $3);  }
+expr : ident TEQUAL expr { $$ = context->arena.make<Assignment>($<ident>1, $3); }
+     | ident TLPAREN call_args TRPAREN { $$ = context->arena.make<MethodCall>($1, $3);  }
      | ident { $<ident>$ = $1; }
      | literal
      | list_literal
-     | expr TAND expr { $$ = new BinaryOperator($1, $2, $3); }
-     | expr TPLUS expr { $$ = new BinaryOperator($1, $2, $3); }
-     | expr TMINUS expr { $$ = new BinaryOperator($1, $2, $3); }
-     | expr TMUL expr { $$ = new BinaryOperator($1, $2, $3); }
-     | expr TDIV expr { $$ = new BinaryOperator($1, $2, $3); }
-     | expr comparison expr { $$ = new BinaryOperator($1, $2, $3); }
+     | expr TAND expr { $$ = context->arena.make<BinaryOperator>($1, $2, $3); }
+     | expr TPLUS expr { $$ = context->arena.make<BinaryOperator>($1, $2, $3); }
+     | expr TMINUS expr { $$ = context->arena.make<BinaryOperator>($1, $2, $3); }
+     | expr TMUL expr { $$ = context->arena.make<BinaryOperator>($1, $2, $3); }
+     | expr TDIV expr { $$ = context->arena.make<BinaryOperator>($1, $2, $3); }
+     | expr comparison expr { $$ = context->arena.make<BinaryOperator>($1, $2, $3); }
      | TLPAREN expr TRPAREN { $$ = $2; }
      ;
 
-call_args : /*blank*/  { $$ = new ExpressionList(); }
-          | expr { $$ = new ExpressionList(); $$->push_back($1); }
-          | call_args TCOMMA expr  { $1->push_back($3); }
+call_args : /*blank*/  { $$ = context->arena.make<ExpressionList>(); }
+          | expr { $$ = context->arena.make<ExpressionList>(); $$->push_back(context->arena, $1); }
+          | call_args TCOMMA expr  { $1->push_back(context->arena, $3); }
           ;
 
 comparison : TCEQ | TCNE | TCLT | TCLE | TCGT | TCGE
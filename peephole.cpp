@@ -0,0 +1,183 @@
+#include <algorithm>
+#include <map>
+#include "vm.h"
+
+/*
+    Peephole superinstruction pass.
+
+    The code generator emits plain stack code, so an assignment like
+    "c = a + b" becomes "push [a]; push [b]; add-int; pop [c]" and every
+    loop condition ends in "clt; je". optimize() replaces such sequences
+    with a single superinstruction, which saves the dispatches and the
+    operand stack traffic in between.
+
+    A sequence is only fused when nothing jumps into the middle of it, and
+    all code addresses (branch targets, function entry points) are
+    relocated afterwards since fused code is shorter.
+*/
+
+namespace {
+
+struct Fusion {
+    ToyVm::Code fused;
+    int count;
+    ToyVm::Code pattern[4];
+};
+
+/* Tried in order, so longer patterns come before their prefixes. */
+const Fusion fusions[] = {
+    { ToyVm::ADD_I_MM_M, 4, { ToyVm::LOADL, ToyVm::LOADL, ToyVm::ADD_I, ToyVm::STOREL } },
+    { ToyVm::ADD_D_MM_M, 4, { ToyVm::LOADL, ToyVm::LOADL, ToyVm::ADD_D, ToyVm::STOREL } },
+    { ToyVm::SUB_I_MM_M, 4, { ToyVm::LOADL, ToyVm::LOADL, ToyVm::SUB_I, ToyVm::STOREL } },
+    { ToyVm::SUB_D_MM_M, 4, { ToyVm::LOADL, ToyVm::LOADL, ToyVm::SUB_D, ToyVm::STOREL } },
+    { ToyVm::MUL_I_MM_M, 4, { ToyVm::LOADL, ToyVm::LOADL, ToyVm::MUL_I, ToyVm::STOREL } },
+    { ToyVm::MUL_D_MM_M, 4, { ToyVm::LOADL, ToyVm::LOADL, ToyVm::MUL_D, ToyVm::STOREL } },
+    { ToyVm::ADD_I_MI_M, 4, { ToyVm::LOADL, ToyVm::PUSHI, ToyVm::ADD_I, ToyVm::STOREL } },
+    { ToyVm::ADD_I_MM, 3, { ToyVm::LOADL, ToyVm::LOADL, ToyVm::ADD_I } },
+    { ToyVm::ADD_D_MM, 3, { ToyVm::LOADL, ToyVm::LOADL, ToyVm::ADD_D } },
+    { ToyVm::SUB_I_MM, 3, { ToyVm::LOADL, ToyVm::LOADL, ToyVm::SUB_I } },
+    { ToyVm::SUB_D_MM, 3, { ToyVm::LOADL, ToyVm::LOADL, ToyVm::SUB_D } },
+    { ToyVm::MUL_I_MM, 3, { ToyVm::LOADL, ToyVm::LOADL, ToyVm::MUL_I } },
+    { ToyVm::MUL_D_MM, 3, { ToyVm::LOADL, ToyVm::LOADL, ToyVm::MUL_D } },
+    { ToyVm::CLT_I_JE, 2, { ToyVm::CLT_I, ToyVm::JE } },
+    { ToyVm::CLT_I_JNE, 2, { ToyVm::CLT_I, ToyVm::JNE } },
+    { ToyVm::CLT_D_JE, 2, { ToyVm::CLT_D, ToyVm::JE } },
+    { ToyVm::CLT_D_JNE, 2, { ToyVm::CLT_D, ToyVm::JNE } },
+    { ToyVm::CMP_I_JE, 2, { ToyVm::CMP_I, ToyVm::JE } },
+    { ToyVm::CMP_I_JNE, 2, { ToyVm::CMP_I, ToyVm::JNE } },
+    { ToyVm::LOADL_STOREL, 2, { ToyVm::LOADL, ToyVm::STOREL } },
+    { ToyVm::PUSHI_STOREL, 2, { ToyVm::PUSHI, ToyVm::STOREL } },
+    { ToyVm::LOADL_LOADL, 2, { ToyVm::LOADL, ToyVm::LOADL } },
+};
+
+bool has_operand(int code)
+{
+    switch (code) {
+    case ToyVm::PUSHI: case ToyVm::LOADL: case ToyVm::STOREL:
+    case ToyVm::JE: case ToyVm::JNE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+}
+
+std::vector<int> ToyVm::optimize(const std::vector<int> &entries)
+{
+    const int end = m_code.size();
+
+    std::vector<bool> target(end + 1, false);
+    for (int pc = 0; pc < end; pc += length(m_code[pc] >> 24)) {
+        if (is_branch(m_code[pc] >> 24))
+            target[m_code[pc] & 0xffff] = true;
+    }
+    for (auto it : entries)
+        target[it] = true;
+
+    Buffer out;
+    std::vector<int> where(end + 1, -1);
+    for (int pc = 0; pc < end;) {
+        const Fusion *match = 0;
+        for (const Fusion &f : fusions) {
+            if (!m_fusions[f.fused] || pc + f.count > end)
+                continue;
+            int i = 0;
+            while (i < f.count && (m_code[pc + i] >> 24) == (uint32)f.pattern[i] && (i == 0 || !target[pc + i]))
+                i++;
+            if (i == f.count) {
+                match = &f;
+                break;
+            }
+        }
+
+        where[pc] = out.size();
+        if (!match) {
+            for (int i = 0; i < length(m_code[pc] >> 24); i++)
+                out.push_back(m_code[pc + i]);
+            pc += length(m_code[pc] >> 24);
+            continue;
+        }
+
+        uint32 operands[3] = { 0, 0, 0 };
+        int n = 0;
+        for (int i = 0; i < match->count; i++) {
+            if (has_operand(match->pattern[i]))
+                operands[n++] = m_code[pc + i] & 0xffff;
+        }
+        out.push_back((match->fused << 24) | operands[0]);
+        if (length(match->fused) > 1)
+            out.push_back(operands[1] | (operands[2] << 16));
+        pc += match->count;
+    }
+    where[end] = out.size();
+
+    for (int pc = 0; pc < (int)out.size(); pc += length(out[pc] >> 24)) {
+        if (is_branch(out[pc] >> 24)) {
+            int to = where[out[pc] & 0xffff];
+            assert(to >= 0);
+            out[pc] = (out[pc] & 0xffff0000) | to;
+        }
+    }
+    for (auto &it : m_labels)
+        it.second = where[it.second];
+
+    m_code.own().swap(out);
+    m_threaded.clear();
+    return where;
+}
+
+void ToyVm::set_fusion(bool enabled)
+{
+    m_fusions.assign(NUM_CODES, enabled);
+}
+
+/*
+    Enable only the superinstructions that pay off on the workload the
+    histogram was collected on: every adjacent pair of a pattern has to
+    make up at least 1% of all executed pairs.
+*/
+bool ToyVm::select_fusions(FILE *histogram)
+{
+    std::map<std::pair<int, int>, uint64> counts;
+    uint64 total = 0;
+    char a[64], b[64];
+    unsigned long long n;
+    while (fscanf(histogram, "%63s %63s %llu", a, b, &n) == 3) {
+        int first = code_from_name(a);
+        int second = code_from_name(b);
+        if (first < 0 || second < 0)
+            return false;
+        counts[std::make_pair(first, second)] += n;
+        total += n;
+    }
+    if (!feof(histogram) || total == 0)
+        return false;
+
+    set_fusion(false);
+    for (const Fusion &f : fusions) {
+        uint64 weakest = ~(uint64)0;
+        for (int i = 0; i + 1 < f.count; i++)
+            weakest = std::min(weakest, counts[std::make_pair((int)f.pattern[i], (int)f.pattern[i + 1])]);
+        m_fusions[f.fused] = weakest * 100 >= total;
+    }
+    return true;
+}
+
+void ToyVm::collect_pair_histogram()
+{
+    m_pair_counts.assign(NUM_CODES * NUM_CODES, 0);
+    m_prev_code = NUM_CODES;
+}
+
+void ToyVm::write_pair_histogram(FILE *fp)
+{
+    std::vector<std::pair<uint64, int> > pairs;
+    for (int i = 0; i < (int)m_pair_counts.size(); i++) {
+        if (m_pair_counts[i])
+            pairs.push_back(std::make_pair(m_pair_counts[i], i));
+    }
+    std::sort(pairs.rbegin(), pairs.rend());
+    for (auto it : pairs)
+        fprintf(fp, "%s %s %llu\n", name(it.second / NUM_CODES), name(it.second % NUM_CODES), (unsigned long long)it.first);
+}
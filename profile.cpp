@@ -0,0 +1,176 @@
+#include <algorithm>
+#include <set>
+#include "yaml-cpp/yaml.h"
+#include "vm.h"
+
+/*
+    The profile report, written as YAML after a run with --profile:
+
+    - totals: instructions executed and the cycles charged to them
+    - opcodes: executions and cycles of each opcode, the most expensive
+      first
+    - pairs: the most frequent opcode pairs, the candidates for new
+      superinstructions
+    - functions: calls, executed instructions and cycles of each function,
+      where a function runs from its entry point to the next one
+    - blocks: the hottest straight line ranges of bytecode, which is what
+      JIT thresholds should catch early
+
+    Cycles are time stamp counter ticks and include the dispatch to the
+    next instruction, but not the profiler's own bookkeeping; clock_overhead
+    is the cost of reading the counter, for judging the cheapest opcodes.
+*/
+
+namespace {
+
+const size_t MAX_PAIRS = 50;
+const size_t MAX_BLOCKS = 50;
+
+struct Range {
+    uint32 begin, end;
+    uint64 count, instructions, cycles;
+};
+
+bool hotter(const Range &a, const Range &b)
+{
+    return a.cycles > b.cycles;
+}
+
+uint64 clock_overhead()
+{
+    uint64 best = ~0ull;
+    for (int i = 0; i < 1000; i++) {
+        const uint64 start = Xbyak::util::Clock::getRdtsc();
+        best = std::min(best, Xbyak::util::Clock::getRdtsc() - start);
+    }
+    return best;
+}
+
+}
+
+void ToyVm::write_profile(FILE *fp, const std::map<uint32, std::string> &names)
+{
+    const uint32 end = m_code.size();
+    if (m_pc_counts.size() != end) {
+        fprintf(fp, "# no interpreted code ran\n");
+        return;
+    }
+
+    // function entry points and block leaders
+    std::set<uint32> entries;
+    std::vector<bool> leader(end + 1, false);
+    for (auto it : names)
+        entries.insert(it.first);
+    entries.insert(m_start_pc);
+    for (uint32 pc = 0; pc < end; pc += length(m_code[pc] >> 24)) {
+        const uint32 code = m_code[pc] >> 24;
+        if (is_branch(code))
+            leader[m_code[pc] & 0xffff] = true;
+        if (is_call(code))
+            entries.insert(m_code[pc] & 0xffff);
+        if (is_branch(code) || code == RET || code == CALL_NATIVE)
+            leader[pc + length(code)] = true;
+    }
+    for (auto e : entries)
+        leader[e] = true;
+
+    uint64 total_count = 0, total_cycles = 0;
+    std::vector<Range> opcodes(NUM_CODES);
+    std::vector<Range> blocks;
+    for (uint32 pc = 0; pc < end; pc += length(m_code[pc] >> 24)) {
+        const uint32 code = m_code[pc] >> 24;
+        total_count += m_pc_counts[pc];
+        total_cycles += m_pc_cycles[pc];
+        opcodes[code].begin = code;
+        opcodes[code].count += m_pc_counts[pc];
+        opcodes[code].cycles += m_pc_cycles[pc];
+
+        if (pc == 0 || leader[pc]) {
+            Range r = { pc, pc, m_pc_counts[pc], 0, 0 };
+            blocks.push_back(r);
+        }
+        blocks.back().end = pc + length(code);
+        blocks.back().instructions += m_pc_counts[pc];
+        blocks.back().cycles += m_pc_cycles[pc];
+    }
+
+    YAML::Emitter out;
+    out << YAML::BeginMap;
+    out << YAML::Key << "instructions" << YAML::Value << total_count;
+    out << YAML::Key << "cycles" << YAML::Value << total_cycles;
+    out << YAML::Key << "clock_overhead" << YAML::Value << clock_overhead();
+
+    std::sort(opcodes.begin(), opcodes.end(), hotter);
+    out << YAML::Key << "opcodes" << YAML::Value << YAML::BeginSeq;
+    for (const Range &r : opcodes) {
+        if (!r.count)
+            continue;
+        out << YAML::Flow << YAML::BeginMap;
+        out << YAML::Key << "opcode" << YAML::Value << name(r.begin);
+        out << YAML::Key << "count" << YAML::Value << r.count;
+        out << YAML::Key << "cycles" << YAML::Value << r.cycles;
+        out << YAML::EndMap;
+    }
+    out << YAML::EndSeq;
+
+    std::vector<std::pair<uint64, int> > pairs;
+    for (int i = 0; i < (int)m_pair_counts.size(); i++) {
+        if (m_pair_counts[i])
+            pairs.push_back(std::make_pair(m_pair_counts[i], i));
+    }
+    std::sort(pairs.rbegin(), pairs.rend());
+    if (pairs.size() > MAX_PAIRS)
+        pairs.resize(MAX_PAIRS);
+    out << YAML::Key << "pairs" << YAML::Value << YAML::BeginSeq;
+    for (auto it : pairs) {
+        out << YAML::Flow << YAML::BeginMap;
+        out << YAML::Key << "first" << YAML::Value << name(it.second / NUM_CODES);
+        out << YAML::Key << "second" << YAML::Value << name(it.second % NUM_CODES);
+        out << YAML::Key << "count" << YAML::Value << it.first;
+        out << YAML::EndMap;
+    }
+    out << YAML::EndSeq;
+
+    out << YAML::Key << "functions" << YAML::Value << YAML::BeginSeq;
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+        auto next = it;
+        ++next;
+        Range r = { *it, next == entries.end() ? end : *next, m_pc_counts[*it], 0, 0 };
+        for (uint32 pc = r.begin; pc < r.end; pc++) {
+            r.instructions += m_pc_counts[pc];
+            r.cycles += m_pc_cycles[pc];
+        }
+        if (!r.instructions)
+            continue;
+        auto named = names.find(r.begin);
+        out << YAML::Flow << YAML::BeginMap;
+        out << YAML::Key << "name" << YAML::Value
+            << (named != names.end() ? named->second : "@" + std::to_string(r.begin));
+        out << YAML::Key << "begin" << YAML::Value << r.begin;
+        out << YAML::Key << "end" << YAML::Value << r.end;
+        out << YAML::Key << "calls" << YAML::Value << r.count;
+        out << YAML::Key << "instructions" << YAML::Value << r.instructions;
+        out << YAML::Key << "cycles" << YAML::Value << r.cycles;
+        out << YAML::EndMap;
+    }
+    out << YAML::EndSeq;
+
+    std::sort(blocks.begin(), blocks.end(), hotter);
+    if (blocks.size() > MAX_BLOCKS)
+        blocks.resize(MAX_BLOCKS);
+    out << YAML::Key << "blocks" << YAML::Value << YAML::BeginSeq;
+    for (const Range &r : blocks) {
+        if (!r.instructions)
+            break;
+        out << YAML::Flow << YAML::BeginMap;
+        out << YAML::Key << "begin" << YAML::Value << r.begin;
+        out << YAML::Key << "end" << YAML::Value << r.end;
+        out << YAML::Key << "count" << YAML::Value << r.count;
+        out << YAML::Key << "cycles" << YAML::Value << r.cycles;
+        out << YAML::EndMap;
+    }
+    out << YAML::EndSeq;
+    out << YAML::EndMap;
+
+    fprintf(fp, "%s\n", out.c_str());
+}
@@ -0,0 +1,369 @@
+#include <algorithm>
+#include <map>
+#include "vm.h"
+
+/*
+    Register allocation for the JIT.
+
+    The code generator gives every variable its own slot in the call
+    frame, and the bytecode moves all values through the operand stack. When compiling a
+    function the JIT keeps the operand stack in registers within a basic
+    block (see jit.cpp); this file decides which slots get a register of
+    their own, by linear scan over their live ranges:
+
+    - a slot's range runs from its first to its last access in the
+      function, extended over every loop it is accessed in, so variables
+      carried around a loop stay in their register for the whole loop;
+    - its class follows from the instructions that consume or produce its
+      value: Double slots go into an XMM register, the rest into a GPR.
+      Slots copied into each other get the same class, and slots used both
+      ways stay in memory;
+    - ranges are handed out in order of their start, and when registers
+      run out the range that ends last stays in memory.
+
+    Outside its range a slot lives in the frame as usual, the JIT loads
+    and stores the register on every edge into and out of the range and
+    around calls, as the callee uses the same registers. Slots past the
+    end of the frame are the arguments of a call and stay in memory.
+*/
+
+namespace {
+
+enum {
+    USE_INT = 1,
+    USE_DOUBLE = 2,
+    USE_RAW = 4
+};
+
+// registers slots may be allocated to; temporaries and scratch use the rest
+const int slot_gprs[] = { Operand::R8, Operand::R9, Operand::R10, Operand::R11 };
+const int slot_xmms[] = { 8, 9, 10, 11, 12, 13, 14, 15 };
+
+struct Entry {
+    int slot;
+    int use;
+};
+
+struct UnionFind {
+    std::map<uint32, uint32> parent;
+
+    uint32 find(uint32 x)
+    {
+        std::map<uint32, uint32>::iterator it = parent.find(x);
+        if (it == parent.end() || it->second == x)
+            return x;
+        return it->second = find(it->second);
+    }
+
+    void unite(uint32 a, uint32 b)
+    {
+        uint32 ra = find(a), rb = find(b);
+        if (ra != rb)
+            parent[ra] = rb;
+    }
+};
+
+void write_back(std::vector<Entry> &stack, std::map<uint32, int> &uses)
+{
+    for (auto e : stack) {
+        if (e.slot >= 0)
+            uses[e.slot] |= USE_RAW;
+    }
+    stack.clear();
+}
+
+ToyVm::Code arith_of(uint32 code)
+{
+    switch (code) {
+    case ToyVm::ADD_I_MM: case ToyVm::ADD_I_MM_M: case ToyVm::ADD_I_MI_M: return ToyVm::ADD_I;
+    case ToyVm::ADD_D_MM: case ToyVm::ADD_D_MM_M: return ToyVm::ADD_D;
+    case ToyVm::SUB_I_MM: case ToyVm::SUB_I_MM_M: return ToyVm::SUB_I;
+    case ToyVm::SUB_D_MM: case ToyVm::SUB_D_MM_M: return ToyVm::SUB_D;
+    case ToyVm::MUL_I_MM: case ToyVm::MUL_I_MM_M: return ToyVm::MUL_I;
+    case ToyVm::MUL_D_MM: case ToyVm::MUL_D_MM_M: return ToyVm::MUL_D;
+    case ToyVm::CLT_I_JE: case ToyVm::CLT_I_JNE: return ToyVm::CLT_I;
+    case ToyVm::CLT_D_JE: case ToyVm::CLT_D_JNE: return ToyVm::CLT_D;
+    case ToyVm::CMP_I_JE: case ToyVm::CMP_I_JNE: return ToyVm::CMP_I;
+    default: return ToyVm::NUM_CODES;
+    }
+}
+
+}
+
+/*
+    Break the instruction at insn back up into the plain instructions it
+    was fused from, which is what both the analysis below and the lowering
+    in jit.cpp work on. Returns how many were written to out.
+*/
+int ToyVm::expand(const uint32 *insn, Micro *out)
+{
+    const uint32 code = insn[0] >> 24;
+    const uint32 imm = insn[0] & 0xffff;
+    const uint32 b = length(code) > 1 ? insn[1] & 0xffff : 0;
+    const uint32 c = length(code) > 1 ? insn[1] >> 16 : 0;
+    Micro *p = out;
+
+    switch (code) {
+    case LOADL_LOADL:
+        *p++ = Micro(LOADL, imm);
+        *p++ = Micro(LOADL, b);
+        break;
+    case LOADL_STOREL:
+        *p++ = Micro(LOADL, imm);
+        *p++ = Micro(STOREL, b);
+        break;
+    case PUSHI_STOREL:
+        *p++ = Micro(PUSHI, imm);
+        *p++ = Micro(STOREL, b);
+        break;
+    case ADD_I_MM: case ADD_D_MM: case SUB_I_MM: case SUB_D_MM:
+    case MUL_I_MM: case MUL_D_MM:
+        *p++ = Micro(LOADL, imm);
+        *p++ = Micro(LOADL, b);
+        *p++ = Micro(arith_of(code), 0);
+        break;
+    case ADD_I_MM_M: case ADD_D_MM_M: case SUB_I_MM_M: case SUB_D_MM_M:
+    case MUL_I_MM_M: case MUL_D_MM_M:
+        *p++ = Micro(LOADL, imm);
+        *p++ = Micro(LOADL, b);
+        *p++ = Micro(arith_of(code), 0);
+        *p++ = Micro(STOREL, c);
+        break;
+    case ADD_I_MI_M:
+        *p++ = Micro(LOADL, imm);
+        *p++ = Micro(PUSHI, b);
+        *p++ = Micro(ADD_I, 0);
+        *p++ = Micro(STOREL, c);
+        break;
+    case CLT_I_JE: case CLT_D_JE: case CMP_I_JE:
+        *p++ = Micro(arith_of(code), 0);
+        *p++ = Micro(JE, imm);
+        break;
+    case CLT_I_JNE: case CLT_D_JNE: case CMP_I_JNE:
+        *p++ = Micro(arith_of(code), 0);
+        *p++ = Micro(JNE, imm);
+        break;
+    default:
+        *p++ = Micro(code, imm);
+        break;
+    }
+    return p - out;
+}
+
+const ToyVm::Interval *ToyVm::interval_of(uint32 slot) const
+{
+    std::map<uint32, int>::const_iterator it = m_slot_interval.find(slot);
+    return it == m_slot_interval.end() ? 0 : &m_intervals[it->second];
+}
+
+/*
+    Allocate registers for the slots used by the function in [begin, end);
+    leader[pc - begin] is set for every jump target in it. The result is
+    left in m_intervals, which only holds ranges that got a register.
+*/
+void ToyVm::allocate_registers(uint32 begin, uint32 end, const std::vector<bool> &leader)
+{
+    std::map<uint32, Interval> ranges;
+    std::map<uint32, int> uses;
+    std::vector<std::pair<uint32, uint32> > loops;
+    std::vector<Entry> stack;
+    UnionFind copies;
+    uint32 frame_size = ~0u;
+
+    for (uint32 pc = begin; pc < end; pc += length(m_code[pc] >> 24)) {
+        const uint32 code = m_code[pc] >> 24;
+        if (is_call(code) || code == CALL_NATIVE)
+            frame_size = m_code[pc + 1];
+        if (is_branch(code) && !is_call(code) && (m_code[pc] & 0xffff) <= pc)
+            loops.push_back(std::make_pair(m_code[pc] & 0xffff, pc));
+
+        // the operand stack is written back at every jump target
+        if (leader[pc - begin])
+            write_back(stack, uses);
+
+        Micro micro[4];
+        const int n = expand(&m_code[pc], micro);
+        for (int i = 0; i < n; i++) {
+            const uint32 imm = micro[i].imm;
+            Entry a = { -1, 0 }, b = { -1, 0 };
+            int use = 0, result = 0;
+
+            switch (micro[i].code) {
+            case PUSHI: case PUSH_CONST_I:
+                stack.push_back(Entry{ -1, USE_INT });
+                continue;
+            case PUSH_CONST_D:
+                stack.push_back(Entry{ -1, USE_DOUBLE });
+                continue;
+            case PUSH_CONST_S:
+                stack.push_back(Entry{ -1, USE_RAW });
+                continue;
+            case POP:
+                if (!stack.empty())
+                    stack.pop_back();
+                continue;
+            case LOADL:
+            case STOREL:
+                if (!ranges.count(imm))
+                    ranges[imm] = Interval(imm, pc, pc);
+                ranges[imm].end = pc;
+                if (micro[i].code == LOADL) {
+                    stack.push_back(Entry{ (int)imm, 0 });
+                    continue;
+                }
+                if (!stack.empty()) {
+                    a = stack.back();
+                    stack.pop_back();
+                }
+                if (a.slot >= 0)
+                    copies.unite(imm, a.slot);
+                else
+                    uses[imm] |= a.use ? a.use : USE_RAW;
+                continue;
+
+            case ADD_I: case SUB_I: case MUL_I: case DIV_I:
+            case AND: case CMP_I: case CLT_I:
+                use = USE_INT;
+                result = USE_INT;
+                break;
+            case ADD_D: case SUB_D: case MUL_D: case DIV_D:
+                use = USE_DOUBLE;
+                result = USE_DOUBLE;
+                break;
+            case CMP_D: case CLT_D:
+                use = USE_DOUBLE;
+                result = USE_INT;
+                break;
+            case JE: case JNE:
+                use = USE_INT;
+                break;
+
+            case LENGTH:
+                if (!stack.empty()) {
+                    a = stack.back();
+                    stack.pop_back();
+                }
+                if (a.slot >= 0)
+                    uses[a.slot] |= USE_RAW;
+                stack.push_back(Entry{ -1, USE_INT });
+                continue;
+            case ELEMENT:
+                // the index is on top of the list
+                for (int k = 0; k < 2 && !stack.empty(); k++) {
+                    if (stack.back().slot >= 0)
+                        uses[stack.back().slot] |= k == 0 ? USE_INT : USE_RAW;
+                    stack.pop_back();
+                }
+                stack.push_back(Entry{ -1, ((m_code[pc] >> 16) & 0xff) == ::Type::DOUBLE ? USE_DOUBLE : USE_INT });
+                continue;
+            case ITER_NEXT_OR_JUMP:
+                write_back(stack, uses);
+                for (auto slot : { m_code[pc + 1] & 0xffff, m_code[pc + 1] >> 16 }) {
+                    if (!ranges.count(slot))
+                        ranges[slot] = Interval(slot, pc, pc);
+                    ranges[slot].end = pc;
+                    uses[slot] |= USE_INT;
+                }
+                continue;
+
+            default:
+                // everything else works on the operand stack in m_mem
+                write_back(stack, uses);
+                continue;
+            }
+
+            if (!stack.empty()) {
+                a = stack.back();
+                stack.pop_back();
+            }
+            if (a.slot >= 0)
+                uses[a.slot] |= use;
+            if (result) {
+                if (!stack.empty()) {
+                    b = stack.back();
+                    stack.pop_back();
+                }
+                if (b.slot >= 0)
+                    uses[b.slot] |= use;
+                stack.push_back(Entry{ -1, result });
+            }
+        }
+    }
+
+    // slots that are copied into each other share their class
+    std::map<uint32, int> classes;
+    for (auto it : uses)
+        classes[copies.find(it.first)] |= it.second;
+
+    std::vector<Interval> candidates;
+    for (auto it : ranges) {
+        Interval range = it.second;
+        const int use = classes[copies.find(range.slot)];
+        if (((use & USE_INT) && (use & USE_DOUBLE)) || range.slot >= frame_size)
+            continue;
+        range.xmm = (use & USE_DOUBLE) != 0;
+        candidates.push_back(range);
+    }
+
+    // extend the ranges over the loops they take part in
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (auto &range : candidates) {
+            for (auto loop : loops) {
+                if (range.start <= loop.second && range.end >= loop.first
+                    && (range.start > loop.first || range.end < loop.second)) {
+                    range.start = std::min(range.start, loop.first);
+                    range.end = std::max(range.end, loop.second);
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    std::sort(candidates.begin(), candidates.end(),
+              [](const Interval &a, const Interval &b) { return a.start < b.start; });
+
+    std::vector<int> free_gprs(slot_gprs, slot_gprs + NUM_OF_ARRAY(slot_gprs));
+    std::vector<int> free_xmms(slot_xmms, slot_xmms + NUM_OF_ARRAY(slot_xmms));
+    std::vector<Interval *> active;
+    for (auto &range : candidates) {
+        std::vector<int> &pool = range.xmm ? free_xmms : free_gprs;
+
+        for (size_t i = 0; i < active.size();) {
+            if (active[i]->end < range.start) {
+                (active[i]->xmm ? free_xmms : free_gprs).push_back(active[i]->reg);
+                active.erase(active.begin() + i);
+            } else {
+                i++;
+            }
+        }
+
+        if (!pool.empty()) {
+            range.reg = pool.back();
+            pool.pop_back();
+            active.push_back(&range);
+            continue;
+        }
+        Interval *spill = 0;
+        for (auto other : active) {
+            if (other->xmm == range.xmm && (!spill || other->end > spill->end))
+                spill = other;
+        }
+        if (spill && spill->end > range.end) {
+            range.reg = spill->reg;
+            spill->reg = -1;
+            *std::find(active.begin(), active.end(), spill) = &range;
+        }
+    }
+
+    m_intervals.clear();
+    m_slot_interval.clear();
+    for (auto range : candidates) {
+        if (range.reg < 0)
+            continue;
+        m_slot_interval[range.slot] = m_intervals.size();
+        m_intervals.push_back(range);
+        if (m_debug)
+            printf("slot %d: %d..%d in %s%d\n", range.slot, range.start, range.end, range.xmm ? "xmm" : "r", range.reg);
+    }
+}
@@ -17,6 +17,7 @@ public:
         case INT: return "Int";
         case DOUBLE: return "Double";
         case STRING: return "String";
+        case LIST: return "List";
         case VOID: return "Void";
         case UNKNOWN:
         default: return "unknown";
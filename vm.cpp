@@ -1,344 +1,878 @@
+#include <atomic>
 #include <iostream>
+#include <mutex>
+#include <signal.h>
 #include "vm.h"
 
-extern int debug;
+void ToyVm::setMark()
+{
+    m_mark = (int)m_code.size();
+}
+
+int ToyVm::getMarkOffset()
+{
+    return m_mark - (int)m_code.size() - 1;
+}
+
+int ToyVm::getCurrent()
+{
+    return m_code.size();
+}
+
+/*
+    Make sure the program is terminated by END_OF_CODE, so that neither
+    interpreter loop has to bounds check the program counter.
+*/
+void ToyVm::seal()
+{
+    if (m_code.empty() || (m_code.back() >> 24) != END_OF_CODE)
+        encode(END_OF_CODE);
+}
+
+std::shared_ptr<const Program> ToyVm::link(uint32 main)
+{
+    seal();
+    std::shared_ptr<Program> program = std::make_shared<Program>();
+    program->code.swap(m_code.own());
+    program->constants = std::move(m_pool);
+    program->main = main;
+    load(program);
+    return program;
+}
+
+void ToyVm::load(const std::shared_ptr<const Program> &program)
+{
+    if (program == m_program)
+        return;
+    m_program = program;
+    m_code.share(program->code);
+    m_constants = &program->constants;
+    m_threaded.clear();
+    m_native.clear();
+}
+
+void ToyVm::run(int start_pc)
+{
+    seal();
+    if (m_native.size() != m_code.size()) {
+        m_call_counts.assign(m_code.size(), 0);
+        m_loop_counts.assign(m_code.size(), 0);
+        m_native.assign(m_code.size(), 0);
+    }
+    if (m_profiling) {
+        if (m_pair_counts.empty())
+            collect_pair_histogram();
+        m_pc_counts.assign(m_code.size(), 0);
+        m_pc_cycles.assign(m_code.size(), 0);
+        m_profile_pc = m_code.size();
+    }
+    m_start_pc = start_pc;
+    sigjmp_buf recover;
+    if (sigsetjmp(recover, 1)) {
+        m_recover = 0;
+        operand_stack_overflow();
+    }
+    m_recover = &recover;
+    m_sp = interpret(start_pc, STACK_SLOTS - 1, m_frames);
+    m_recover = 0;
+    if (m_profiling)
+        charge_cycles();
+    m_out.flush();
+}
 
-std::string replace_all(const std::string &str, const std::string &search_val, const std::string &replace_val)
+/*
+    Picks the interpreter loop. Only the watching ones look at every
+    instruction, for the trace, the pair histogram or the profile.
+*/
+uint32 ToyVm::interpret(uint32 start_pc, uint32 sp, IValue *frame)
 {
-    size_t start = 0;
-    std::string result = str;
-    while(1) {
-        size_t where = result.find(search_val, start);
-        if(where == std::string::npos) {
-            break;
+    const bool watching = m_tracing || m_profiling || !m_pair_counts.empty();
+    if (m_dispatch == THREADED_DISPATCH)
+        return watching ? execute<true, true>(start_pc, sp, frame) : execute<true, false>(start_pc, sp, frame);
+    return watching ? execute<false, true>(start_pc, sp, frame) : execute<false, false>(start_pc, sp, frame);
+}
+
+/*
+    Called from native code for a function that has not been compiled
+    (yet); runs it to its RET in whichever tier it is in.
+*/
+uint64 ToyVm::call_function(uint32 target, uint64 sp, IValue *frame)
+{
+    if (m_tiering && ++m_call_counts[target] == HOT_CALLS)
+        tier_up(target);
+    if (m_native[target])
+        return enter(m_native[target], sp, frame);
+    return interpret(target, sp, frame);
+}
+
+void ToyVm::stack_overflow()
+{
+    if (m_parent)
+        throw Failure{ Failure::CALL_STACK_OVERFLOW };
+    m_out.flush();
+    dump_trace();
+    std::cout << "Error! Call stack overflow" << std::endl;
+    exit(0);
+}
+
+void ToyVm::operand_stack_overflow()
+{
+    if (m_parent)
+        throw Failure{ Failure::OPERAND_STACK_OVERFLOW };
+    m_out.flush();
+    dump_trace();
+    std::cout << "Error! Operand stack overflow" << std::endl;
+    exit(0);
+}
+
+namespace {
+
+const size_t STACK_BYTES = (ToyVm::GUARD_SLOTS + ToyVm::STACK_SLOTS) * sizeof(IValue);
+
+/*
+    The reservation of every operand stack, for the SIGSEGV handler. The
+    handler can't take the lock, so a range is published by storing its
+    vm last.
+*/
+enum { MAX_STACKS = 1024 };
+struct StackRange {
+    std::atomic<ToyVm *> vm;
+    uintptr_t begin, end;
+};
+StackRange stack_ranges[MAX_STACKS];
+std::mutex stack_ranges_lock;
+struct sigaction previous_fault_action;
+
+void operand_stack_fault(int sig, siginfo_t *info, void *context)
+{
+    const uintptr_t addr = (uintptr_t)info->si_addr;
+    for (int i = 0; i < MAX_STACKS; i++) {
+        ToyVm *vm = stack_ranges[i].vm.load(std::memory_order_acquire);
+        if (vm && addr >= stack_ranges[i].begin && addr < stack_ranges[i].end)
+            vm->unwind_operand_stack();
+    }
+    // some other fault, for the handler there was before, or else crash
+    // as usual when the instruction is retried
+    if (previous_fault_action.sa_flags & SA_SIGINFO)
+        previous_fault_action.sa_sigaction(sig, info, context);
+    else if (previous_fault_action.sa_handler != SIG_DFL && previous_fault_action.sa_handler != SIG_IGN)
+        previous_fault_action.sa_handler(sig);
+    else
+        signal(sig, SIG_DFL);
+}
+
+}
+
+IValue *ToyVm::map_operand_stack()
+{
+    char *base = (char *)mmap(0, STACK_BYTES, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        std::cout << "Error! Can't reserve the operand stack" << std::endl;
+        exit(0);
+    }
+    IValue *stack = (IValue *)base + GUARD_SLOTS;
+    mprotect(stack, STACK_SLOTS * sizeof(IValue), PROT_READ | PROT_WRITE);
+
+    std::lock_guard<std::mutex> lock(stack_ranges_lock);
+    int i = 0;
+    while (i < MAX_STACKS && stack_ranges[i].vm)
+        i++;
+    if (i == MAX_STACKS) {
+        std::cout << "Error! Too many virtual machines" << std::endl;
+        exit(0);
+    }
+    stack_ranges[i].begin = (uintptr_t)base;
+    stack_ranges[i].end = (uintptr_t)base + STACK_BYTES;
+    stack_ranges[i].vm.store(this, std::memory_order_release);
+
+    static bool installed = false;
+    if (!installed) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = operand_stack_fault;
+        sa.sa_flags = SA_SIGINFO;
+        sigaction(SIGSEGV, &sa, &previous_fault_action);
+        installed = true;
+    }
+    return stack;
+}
+
+ToyVm::~ToyVm()
+{
+    for (auto worker : m_workers)
+        delete worker;
+    {
+        std::lock_guard<std::mutex> lock(stack_ranges_lock);
+        for (int i = 0; i < MAX_STACKS; i++) {
+            if (stack_ranges[i].vm == this)
+                stack_ranges[i].vm.store(0);
         }
-        result.replace(where, search_val.size(), replace_val);
-        start = where + replace_val.size();
     }
-    return result;
+    munmap(m_mem - GUARD_SLOTS, STACK_BYTES);
+    munmap(m_frames, FRAME_SLOTS * sizeof(IValue));
 }
 
+uint32 ToyVm::concat(uint32 sp, const IValue *frame)
+{
+    stack(sp + 2).str_value = m_heap.concat(stack(sp + 2).str_value, stack(sp + 1).str_value, roots(sp, frame));
+    return sp + 1;
+}
 
+bool ToyVm::equal(const std::string *a, const std::string *b)
+{
+    return m_heap.flatten(a) == m_heap.flatten(b);
+}
 
-void ToyVm::setMark()
+void ToyVm::print_list(const List *list)
 {
-    m_mark = (int)m_code.size();
+    for (uint32 i = 0; i < list->size(); i++) {
+        m_out.write_int(list->at(i).int_value);
+        m_out.write(", ", 2);
+    }
 }
 
-int ToyVm::getMarkOffset()
+/* ASSERT; what was printed before a failed one still comes out */
+void ToyVm::check(int val)
 {
-    return m_mark - (int)m_code.size() - 1;
+    if (!val && m_parent)
+        throw Failure{ Failure::ASSERTION };
+    if (!val) {
+        m_out.flush();
+        dump_trace();
+    }
+    assert(val != 0);
 }
 
-int ToyVm::getCurrent()
+uint32 ToyVm::make_list(uint32 sp, const IValue *frame, uint32 n, int element_type)
 {
-    return m_code.size();
+    // the elements stay on the stack until the list holds them
+    List *lst = m_heap.new_list(element_type, n, roots(sp, frame));
+    // the first element is the deepest on the stack
+    sp += n;
+    for (uint32 i = 0; i < n; i++)
+        lst->push_back(stack(sp - i));
+    stack(sp--).list_value = lst;
+    return sp;
 }
 
-void ToyVm::run(int start_pc)
+int ToyVm::length(int code)
 {
-    uint32 reg[2] = { 0, 0 };
-    const size_t end = m_code.size();
+#define TOYVM_LENGTH(op, len) len,
+    static const int lengths[NUM_CODES] = { TOYVM_OPCODES(TOYVM_LENGTH) };
+#undef TOYVM_LENGTH
+    return lengths[code];
+}
+
+const char *ToyVm::name(int code)
+{
+#define TOYVM_NAME(op, len) #op,
+    static const char *const names[NUM_CODES] = { TOYVM_OPCODES(TOYVM_NAME) };
+#undef TOYVM_NAME
+    return names[code];
+}
+
+int ToyVm::code_from_name(const std::string &str)
+{
+    for (int code = 0; code < NUM_CODES; code++) {
+        if (str == name(code))
+            return code;
+    }
+    return -1;
+}
+
+/*
+    True for instructions whose immediate is a code address.
+*/
+bool ToyVm::is_branch(int code)
+{
+    switch (code) {
+    case JE: case JNE: case JMP:
+    case CALL: case PARALLEL: case ITER_NEXT_OR_JUMP:
+    case CLT_I_JE: case CLT_I_JNE:
+    case CLT_D_JE: case CLT_D_JNE:
+    case CMP_I_JE: case CMP_I_JNE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* True for the branches whose target is the entry point of a function. */
+bool ToyVm::is_call(int code)
+{
+    return code == CALL || code == PARALLEL;
+}
+
+/*
+    Called before every instruction when tracing, profiling or when
+    collecting the opcode pair histogram. The profile's clock stops while
+    it runs, so its own cost isn't charged to the instructions.
+*/
+void ToyVm::observe(uint32 pc, uint32 sp, const IValue *frame)
+{
+    if (m_profiling) {
+        charge_cycles();
+        m_pc_counts[pc]++;
+        m_profile_pc = pc;
+    }
+    if (!m_pair_counts.empty()) {
+        uint32 code = m_code[pc] >> 24;
+        if (m_prev_code != NUM_CODES)
+            m_pair_counts[m_prev_code * NUM_CODES + code]++;
+        m_prev_code = code;
+    }
+    if (m_tracing)
+        trace(pc, sp, frame);
+    if (m_profiling)
+        m_profile_start = Xbyak::util::Clock::getRdtsc();
+}
+
+void ToyVm::charge_cycles()
+{
+    if (m_profile_pc < m_pc_cycles.size())
+        m_pc_cycles[m_profile_pc] += Xbyak::util::Clock::getRdtsc() - m_profile_start;
+}
+
+void ToyVm::trace(uint32 pc, uint32 sp, const IValue *frame)
+{
+    if (m_trace.empty())
+        m_trace.resize(TRACE_ENTRIES);
+    TraceEntry &e = m_trace[m_trace_count++ % TRACE_ENTRIES];
+    e.pc = pc;
+    e.sp = sp;
+    e.frame = frame - m_frames;
+    for (uint32 i = 0; i < TRACE_TOP && sp + 1 + i < STACK_SLOTS; i++)
+        e.top[i] = stack(sp + 1 + i);
+}
+
+/* the traced instructions, oldest first, with the top of the stack before each */
+void ToyVm::dump_trace()
+{
+    if (m_trace.empty())
+        return;
+    const uint64 count = std::min<uint64>(m_trace_count, TRACE_ENTRIES);
+    printf("--- last %llu instructions\n", (unsigned long long)count);
+    for (uint64 n = m_trace_count - count; n < m_trace_count; n++) {
+        const TraceEntry &e = m_trace[n % TRACE_ENTRIES];
+        uint32 code, imm;
+        int t;
+        decode(code, t, imm, m_code[e.pc]);
+        printf("%5u  frame %-6u sp %-5u [", e.pc, e.frame, e.sp);
+        for (uint32 i = 0; i < TRACE_TOP && e.sp + 1 + i < STACK_SLOTS; i++)
+            printf(" %x", e.top[i].int_value);
+        printf(" ]  ");
+        print_code(code, imm, length(code) > 1 ? m_code[e.pc + 1] : 0);
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+/*
+    The interpreter loop. Every handler is written once and reached either
+    through the switch below or, when Threaded is set, by jumping straight
+    to its label through the handler address stored in m_threaded. The
+    threaded stream is built from m_code the first time it is needed.
+
+    Handlers of two word instructions read their extra operands with
+    OPERAND() and continue with NEXT2().
+*/
+#ifdef PRISM_THREADED_DISPATCH
+#define TARGET(op) case op: L_##op:
+#define DISPATCH() \
+    do { \
+        if (Watching) observe(pc, sp, frame); \
+        if (Threaded) { \
+            x = stream[pc].word; \
+            imm = x & 0xffff; \
+            goto *stream[pc].handler; \
+        } \
+        goto dispatch; \
+    } while (0)
+#else
+#define TARGET(op) case op:
+#define DISPATCH() \
+    do { \
+        if (Watching) observe(pc, sp, frame); \
+        goto dispatch; \
+    } while (0)
+#endif
+#ifdef PRISM_THREADED_DISPATCH
+#define OPERAND() (Threaded ? stream[pc + 1].word : program[pc + 1])
+#else
+#define OPERAND() (program[pc + 1])
+#endif
+#define NEXT() do { pc++; DISPATCH(); } while (0)
+#define NEXT2() do { pc += 2; DISPATCH(); } while (0)
+#define JUMP(target) do { pc = (target); DISPATCH(); } while (0)
+#define RETURN() \
+    do { \
+        if (callstack.empty()) \
+            return sp; \
+        pc = callstack.back().pc; \
+        frame = callstack.back().frame; \
+        callstack.pop_back(); \
+        DISPATCH(); \
+    } while (0)
+/*
+    A taken backward branch ends a loop iteration. Once the loop is hot
+    the rest of the function runs as native code, so what is left to do
+    here is the function's RET.
+*/
+#define BRANCH(target) \
+    do { \
+        if (tiering && (target) <= pc) { \
+            const uint8 *native = backedge(target); \
+            if (native) { \
+                sp = enter(native, sp, frame); \
+                program = &m_code[0]; \
+                RETURN(); \
+            } \
+        } \
+        JUMP(target); \
+    } while (0)
+
+/*
+    Runs from start_pc until the RET of the function it is in, with the
+    operand stack pointer at sp and its locals in frame. Each invocation
+    keeps the return addresses of the calls it makes, as native code may
+    call back into the interpreter; the frames are in m_frames for both.
+*/
+template <bool Threaded, bool Watching>
+uint32 ToyVm::execute(uint32 start_pc, uint32 start_sp, IValue *frame)
+{
+    // signed, so that running past the bottom indexes the guard
+    int32_t sp = start_sp;
+    struct Return {
+        uint32 pc;
+        IValue *frame;
+    };
     uint32 pc = start_pc;
-    uint32 sp = 65535;
-    uint32 call_sp = 0;
+    std::vector<Return> callstack;
+    uint32 x, code, imm;
+    int t;
+    const bool tiering = m_tiering && !Watching;
 
-    for (;;) {
-        uint32 x = m_code[pc];
-        uint32 code, r, imm;
-        ::Type t;
-        decode(code, t.id, imm, x);
-        switch (code) {
-        case ADD: {
-            switch (t.id) {
-            case ::Type::INT: {
-                int a = m_mem[++sp].int_value;
-                int b = m_mem[++sp].int_value;
-                m_mem[sp--].int_value = a + b;
-            } break;
-            case ::Type::DOUBLE: {
-                double a = m_mem[++sp].float_value;
-                double b = m_mem[++sp].float_value;
-                m_mem[sp--].float_value = a + b;
-            } break;
-            case ::Type::STRING: {
-                const std::string* a = m_mem[++sp].str_value;
-                const std::string* b = m_mem[++sp].str_value;
-                m_mem[sp--].str_value = new std::string(*b + *a);
-            } break;
-            default:
-                assert(false);
-            }
-            } break;
-
-        case SUB: {
-            switch (t.id) {
-            case ::Type::INT: {
-                int a = m_mem[++sp].int_value;
-                int b = m_mem[++sp].int_value;
-                m_mem[sp--].int_value = b - a;
-            } break;
-            case ::Type::DOUBLE: {
-                double a = m_mem[++sp].float_value;
-                double b = m_mem[++sp].float_value;
-                m_mem[sp--].float_value = b - a;
-            } break;
-            default:
-                assert(false);
-            }
-            } break;
-        case ::Type::STRING: {
-            } break;
-        case PUSHI:
-            m_mem[sp--].int_value = imm;
-            break;
-        case PUSH_CONSTANT:
-            m_mem[sp--] = m_constants[imm];
-            break;
-        case PUSHM:
-            m_mem[sp--] = m_mem[imm];
-            break;
-        case POPM:
-            m_mem[imm] = m_mem[++sp];
-            break;
-        case MUL: {
-            switch (t.id) {
-            case ::Type::INT: {
-                int a = m_mem[++sp].int_value;
-                int b = m_mem[++sp].int_value;
-                m_mem[sp--].int_value = a * b;
-                } break;
-            case ::Type::DOUBLE: {
-                double a = m_mem[++sp].float_value;
-                double b = m_mem[++sp].float_value;
-                m_mem[sp--].float_value = a * b;
-                } break;
-            default:
-                assert(false);
-            }
-            } break;
-        case AND: {
-            switch (t.id) {
-            case ::Type::INT: {
-                int a = m_mem[++sp].int_value;
-                int b = m_mem[++sp].int_value;
-                m_mem[sp--].int_value = a && b;
-                } break;
-            default:
-                assert(false);
-            }
-            } break;
-        case DIV: {
-            switch (t.id) {
-            case ::Type::INT: {
-                int a = m_mem[++sp].int_value;
-                int b = m_mem[++sp].int_value;
-                m_mem[sp--].int_value = b / a;
-                } break;
-            case ::Type::DOUBLE: {
-                double a = m_mem[++sp].float_value;
-                double b = m_mem[++sp].float_value;
-                m_mem[sp--].float_value = b / a;
-                } break;
-            default:
-                assert(false);
-            }
-            } break;
-        case CMP: {
-            switch (t.id) {
-            case ::Type::INT: {
-                int a = m_mem[++sp].int_value;
-                int b = m_mem[++sp].int_value;
-                m_mem[sp--].int_value = a == b;
-                } break;
-            case ::Type::DOUBLE: {
-                double a = m_mem[++sp].float_value;
-                double b = m_mem[++sp].float_value;
-                m_mem[sp--].int_value = a == b;
-                } break;
-            case ::Type::STRING: {
-                const std::string* a = m_mem[++sp].str_value;
-                const std::string* b = m_mem[++sp].str_value;
-                m_mem[sp--].int_value = *a == *b;
-                } break;
-            default:
-                assert(false);
-            }
-            } break;
-        case CLT: {
-            switch (t.id) {
-            case ::Type::INT: {
-                int a = m_mem[++sp].int_value;
-                int b = m_mem[++sp].int_value;
-                m_mem[sp--].int_value = b < a;
-                } break;
-            case ::Type::DOUBLE: {
-                double a = m_mem[++sp].float_value;
-                double b = m_mem[++sp].float_value;
-                m_mem[sp--].int_value = b < a;
-                } break;
-            default:
-                assert(false);
-            }
-            } break;
-        case JE: {
-            int val =  m_mem[++sp].int_value;
-            if (val == 1)
-                pc = imm - 1;
-            }
-            break;
-        case JNE: {
-            int val =  m_mem[++sp].int_value;
-            if (val == 0)
-                pc = imm - 1;
-            }
-            break;
-        case JMP:
-            pc = imm - 1;
-            break;
-        case CALL:
-            m_callstack[call_sp++] = pc;
-            pc = imm - 1;
-            break;
-
-        case RET:
-            if (call_sp == 0)
-                break;
-            pc = m_callstack[--call_sp];
-            break;
-        case ASSERT: {
-            int val =  m_mem[++sp].int_value;
-            assert(val != 0);
-            } break;
-        case PRINT: {
-            switch (t.id) {
-            case ::Type::INT:
-                printf("%d", m_mem[++sp].int_value);
-                break;
-            case ::Type::STRING:
-                printf("%s", replace_all(*m_mem[++sp].str_value,"\\n","\n").c_str());
-                break;
-            case ::Type::DOUBLE:
-                printf("%f", m_mem[++sp].float_value);
-                break;
-            case ::Type::LIST: {
-                std::list<IValue>* val =  m_mem[++sp].list_value;
-                for(auto it : *val)
-                    printf("%d, ", it.int_value);
-                printf("");
-                } break;
-            default:
-                assert(false);
-            }
-            } break;
-        case MAKE_ITER:
-            m_mem[sp].list_iter = new std::list<IValue>::iterator();
-            *m_mem[sp].list_iter = m_mem[sp + 1].list_value->begin();
-            sp--;
-            break;
-        case LOOP_ITER: {
-            std::list<IValue>::iterator *it = m_mem[sp + 1].list_iter;
-            std::list<IValue> *list = m_mem[sp + 2].list_value;
-            (*it)++;
-            if (*it != list->end()) {
-                pc = imm - 1;
-            }
-            } break;
-        case ITER_VALUE: {
-            std::list<IValue>::iterator *it = m_mem[sp + 1].list_iter;
-            m_mem[sp--] = (**it);
-            } break;
-        case MAKE_LIST: {
-            std::list<IValue> *lst = new std::list<IValue>;
-            for(int i=0; i < imm; i++) {
-                IValue& value = m_mem[++sp];
-                lst->push_front(value);
-            }
-            m_mem[sp--].list_value = lst;
-            } break;
-        default:
-            assert(0);
-            break;
-        }
-        if (debug) {
-            printf("---\n");
-            printf("m_mem[] = ");
-            for(int i=0;i<8;i++)
-                printf("%04x ", m_mem[i].int_value);
-            printf("\nsp %d : [ ", sp);
-            for(int i=sp+1;i<65536;i++)
-                printf("%x ", m_mem[i].int_value);
-
-            printf("]\npc= %d: ", pc);
-            print_code(code, imm);
-            printf("\n");
+#ifdef PRISM_THREADED_DISPATCH
+#define TOYVM_LABEL(op, len) &&L_##op,
+    static const void* const handlers[NUM_CODES] = { TOYVM_OPCODES(TOYVM_LABEL) };
+#undef TOYVM_LABEL
+    // each instantiation has its own handlers
+    if (Threaded && (m_threaded.size() != m_code.size() || m_handlers != handlers)) {
+        m_threaded.resize(m_code.size());
+        for (size_t i = 0; i < m_code.size(); i++)
+            m_threaded[i].word = m_code[i];
+        for (size_t i = 0; i < m_code.size(); i += length(m_code[i] >> 24))
+            m_threaded[i].handler = handlers[m_code[i] >> 24];
+        m_handlers = handlers;
+    }
+#else
+    assert(!Threaded);
+#endif
+
+    IValue* const mem = m_mem;
+    // reloaded after whatever may tier up, as the first patch to a
+    // shared Program copies its code (Bytecode::own)
+    const uint32* program = &m_code[0];
+    const int* const ints = m_constants->ints().data();
+    const double* const doubles = m_constants->doubles().data();
+    const std::string* const* const strings = m_constants->strings().data();
+#ifdef PRISM_THREADED_DISPATCH
+    const ThreadedInsn* const stream = Threaded ? &m_threaded[0] : 0;
+#endif
+
+    DISPATCH();
+
+dispatch:
+    x = program[pc];
+    decode(code, t, imm, x);
+    switch (code) {
+    TARGET(ADD_I) {
+        int a = mem[++sp].int_value;
+        int b = mem[++sp].int_value;
+        mem[sp--].int_value = a + b;
+        } NEXT();
+    TARGET(ADD_D) {
+        double a = mem[++sp].float_value;
+        double b = mem[++sp].float_value;
+        mem[sp--].float_value = a + b;
+        } NEXT();
+    TARGET(ADD_S)
+        sp = concat(sp, frame);
+        NEXT();
+    TARGET(SUB_I) {
+        int a = mem[++sp].int_value;
+        int b = mem[++sp].int_value;
+        mem[sp--].int_value = b - a;
+        } NEXT();
+    TARGET(SUB_D) {
+        double a = mem[++sp].float_value;
+        double b = mem[++sp].float_value;
+        mem[sp--].float_value = b - a;
+        } NEXT();
+    TARGET(PUSHI)
+        mem[sp--].int_value = imm;
+        NEXT();
+    TARGET(PUSH_CONST_I)
+        mem[sp--].int_value = ints[imm];
+        NEXT();
+    TARGET(PUSH_CONST_D)
+        mem[sp--].float_value = doubles[imm];
+        NEXT();
+    TARGET(PUSH_CONST_S)
+        mem[sp--].str_value = strings[imm];
+        NEXT();
+    TARGET(LOADL)
+        mem[sp--] = frame[imm];
+        NEXT();
+    TARGET(STOREL)
+        frame[imm] = mem[++sp];
+        NEXT();
+    TARGET(MUL_I) {
+        int a = mem[++sp].int_value;
+        int b = mem[++sp].int_value;
+        mem[sp--].int_value = a * b;
+        } NEXT();
+    TARGET(MUL_D) {
+        double a = mem[++sp].float_value;
+        double b = mem[++sp].float_value;
+        mem[sp--].float_value = a * b;
+        } NEXT();
+    TARGET(AND) {
+        int a = mem[++sp].int_value;
+        int b = mem[++sp].int_value;
+        mem[sp--].int_value = a && b;
+        } NEXT();
+    TARGET(DIV_I) {
+        int a = mem[++sp].int_value;
+        int b = mem[++sp].int_value;
+        mem[sp--].int_value = b / a;
+        } NEXT();
+    TARGET(DIV_D) {
+        double a = mem[++sp].float_value;
+        double b = mem[++sp].float_value;
+        mem[sp--].float_value = b / a;
+        } NEXT();
+    TARGET(CMP_I) {
+        int a = mem[++sp].int_value;
+        int b = mem[++sp].int_value;
+        mem[sp--].int_value = a == b;
+        } NEXT();
+    TARGET(CMP_D) {
+        double a = mem[++sp].float_value;
+        double b = mem[++sp].float_value;
+        mem[sp--].int_value = a == b;
+        } NEXT();
+    TARGET(CMP_S) {
+        const std::string* a = mem[++sp].str_value;
+        const std::string* b = mem[++sp].str_value;
+        mem[sp--].int_value = equal(a, b);
+        } NEXT();
+    TARGET(CLT_I) {
+        int a = mem[++sp].int_value;
+        int b = mem[++sp].int_value;
+        mem[sp--].int_value = b < a;
+        } NEXT();
+    TARGET(CLT_D) {
+        double a = mem[++sp].float_value;
+        double b = mem[++sp].float_value;
+        mem[sp--].int_value = b < a;
+        } NEXT();
+    TARGET(JE) {
+        int val =  mem[++sp].int_value;
+        if (val == 1)
+            BRANCH(imm);
+        } NEXT();
+    TARGET(JNE) {
+        int val =  mem[++sp].int_value;
+        if (val == 0)
+            BRANCH(imm);
+        } NEXT();
+    TARGET(JMP)
+        BRANCH(imm);
+    TARGET(CALL)
+        // once compiled, this call site has become a CALL_NATIVE
+        if (tiering && ++m_call_counts[imm] == HOT_CALLS && tier_up(imm)) {
+            program = &m_code[0];
+            DISPATCH();
         }
-        pc++;
-        if (pc >= end) break;
-    } // for (;;)
+        callstack.push_back(Return{ pc + 2, frame });
+        frame = push_frame(frame, OPERAND());
+        JUMP(imm);
+    TARGET(CALL_NATIVE)
+        sp = enter(m_native_functions[imm], sp, push_frame(frame, OPERAND()));
+        program = &m_code[0];
+        NEXT2();
+    TARGET(PARALLEL)
+        sp = parallel(sp, frame, imm, (x >> 16) & 0xff, OPERAND());
+        program = &m_code[0];
+        NEXT2();
+    TARGET(RET)
+        RETURN();
+    TARGET(ASSERT)
+        check(mem[++sp].int_value);
+        NEXT();
+    TARGET(PRINT_I)
+        print_int(mem[++sp].int_value);
+        NEXT();
+    TARGET(PRINT_S)
+        print_string(mem[++sp].str_value);
+        NEXT();
+    TARGET(PRINT_D)
+        print_double(mem[++sp].float_value);
+        NEXT();
+    TARGET(PRINT_L)
+        print_list(mem[++sp].list_value);
+        NEXT();
+    TARGET(LENGTH)
+        mem[sp + 1].int_value = mem[sp + 1].list_value->size();
+        NEXT();
+    TARGET(ELEMENT) {
+        const uint32 index = mem[++sp].int_value;
+        mem[sp + 1] = mem[sp + 1].list_value->at(index);
+        } NEXT();
+    TARGET(ITER_NEXT_OR_JUMP) {
+        const uint32 y = OPERAND();
+        if (++frame[y & 0xffff].int_value < frame[y >> 16].int_value)
+            BRANCH(imm);
+        } NEXT2();
+    TARGET(MAKE_LIST)
+        sp = make_list(sp, frame, imm, (x >> 16) & 0xff);
+        NEXT();
+    TARGET(END_OF_CODE)
+        return sp;
+
+    /* superinstructions */
+    TARGET(LOADL_LOADL)
+        mem[sp--] = frame[imm];
+        mem[sp--] = frame[OPERAND() & 0xffff];
+        NEXT2();
+    TARGET(LOADL_STOREL)
+        frame[OPERAND() & 0xffff] = frame[imm];
+        NEXT2();
+    TARGET(PUSHI_STOREL)
+        frame[OPERAND() & 0xffff].int_value = imm;
+        NEXT2();
+    TARGET(ADD_I_MM)
+        mem[sp--].int_value = frame[imm].int_value + frame[OPERAND() & 0xffff].int_value;
+        NEXT2();
+    TARGET(ADD_D_MM)
+        mem[sp--].float_value = frame[imm].float_value + frame[OPERAND() & 0xffff].float_value;
+        NEXT2();
+    TARGET(SUB_I_MM)
+        mem[sp--].int_value = frame[imm].int_value - frame[OPERAND() & 0xffff].int_value;
+        NEXT2();
+    TARGET(SUB_D_MM)
+        mem[sp--].float_value = frame[imm].float_value - frame[OPERAND() & 0xffff].float_value;
+        NEXT2();
+    TARGET(MUL_I_MM)
+        mem[sp--].int_value = frame[imm].int_value * frame[OPERAND() & 0xffff].int_value;
+        NEXT2();
+    TARGET(MUL_D_MM)
+        mem[sp--].float_value = frame[imm].float_value * frame[OPERAND() & 0xffff].float_value;
+        NEXT2();
+    TARGET(ADD_I_MM_M) {
+        uint32 y = OPERAND();
+        frame[y >> 16].int_value = frame[imm].int_value + frame[y & 0xffff].int_value;
+        } NEXT2();
+    TARGET(ADD_D_MM_M) {
+        uint32 y = OPERAND();
+        frame[y >> 16].float_value = frame[imm].float_value + frame[y & 0xffff].float_value;
+        } NEXT2();
+    TARGET(SUB_I_MM_M) {
+        uint32 y = OPERAND();
+        frame[y >> 16].int_value = frame[imm].int_value - frame[y & 0xffff].int_value;
+        } NEXT2();
+    TARGET(SUB_D_MM_M) {
+        uint32 y = OPERAND();
+        frame[y >> 16].float_value = frame[imm].float_value - frame[y & 0xffff].float_value;
+        } NEXT2();
+    TARGET(MUL_I_MM_M) {
+        uint32 y = OPERAND();
+        frame[y >> 16].int_value = frame[imm].int_value * frame[y & 0xffff].int_value;
+        } NEXT2();
+    TARGET(MUL_D_MM_M) {
+        uint32 y = OPERAND();
+        frame[y >> 16].float_value = frame[imm].float_value * frame[y & 0xffff].float_value;
+        } NEXT2();
+    TARGET(ADD_I_MI_M) {
+        uint32 y = OPERAND();
+        frame[y >> 16].int_value = frame[imm].int_value + (y & 0xffff);
+        } NEXT2();
+    TARGET(CLT_I_JE) {
+        int a = mem[++sp].int_value;
+        int b = mem[++sp].int_value;
+        if (b < a)
+            BRANCH(imm);
+        } NEXT();
+    TARGET(CLT_I_JNE) {
+        int a = mem[++sp].int_value;
+        int b = mem[++sp].int_value;
+        if (!(b < a))
+            BRANCH(imm);
+        } NEXT();
+    TARGET(CLT_D_JE) {
+        double a = mem[++sp].float_value;
+        double b = mem[++sp].float_value;
+        if (b < a)
+            BRANCH(imm);
+        } NEXT();
+    TARGET(CLT_D_JNE) {
+        double a = mem[++sp].float_value;
+        double b = mem[++sp].float_value;
+        if (!(b < a))
+            BRANCH(imm);
+        } NEXT();
+    TARGET(CMP_I_JE) {
+        int a = mem[++sp].int_value;
+        int b = mem[++sp].int_value;
+        if (a == b)
+            BRANCH(imm);
+        } NEXT();
+    TARGET(CMP_I_JNE) {
+        int a = mem[++sp].int_value;
+        int b = mem[++sp].int_value;
+        if (a != b)
+            BRANCH(imm);
+        } NEXT();
+
+    TARGET(POP)
+        sp++;
+        NEXT();
+
+    TARGET(LD)
+    TARGET(LDI)
+    TARGET(ST)
+    TARGET(PUSH)
+    default:
+        assert(0);
+        return sp;
+    }
 }
 
+#undef TARGET
+#undef DISPATCH
+#undef OPERAND
+#undef NEXT
+#undef NEXT2
+#undef JUMP
+#undef RETURN
+#undef BRANCH
+
 void ToyVm::dump()
 {
     const size_t end = m_code.size();
-    for (int i=0;i<end;i++) {
+    for (int i=0;i<end;i+=length(m_code[i] >> 24)) {
         uint32 x = m_code[i];
         ::Type t;
         uint32 code, imm;
         decode(code, t.id, imm, x);
         printf("%02d: ", i);
-        print_code(code, imm);
+        print_code(code, imm, length(code) > 1 ? m_code[i + 1] : 0);
         printf("\n");
     }
 }
 
-void ToyVm::print_code(int code, int imm)
+void ToyVm::print_code(int code, int imm, uint32 operand)
 {
+    const int b = operand & 0xffff;
+    const int c = operand >> 16;
+    std::string mnemonic = name(code);
+    for (auto &ch : mnemonic)
+        ch = ch == '_' ? '-' : tolower(ch);
+
     switch (code) {
     case PUSHI:
         printf("push %d", imm);
         break;
-    case PUSH_CONSTANT:
-        printf("push-constant %d", imm);
+    case PUSH_CONST_I:
+        printf("push-const-int %d ; %d", imm, m_constants->ints()[imm]);
         break;
-    case PUSHM:
+    case PUSH_CONST_D:
+        printf("push-const-double %d ; %g", imm, m_constants->doubles()[imm]);
+        break;
+    case PUSH_CONST_S:
+        printf("push-const-string %d", imm);
+        break;
+    case LOADL:
         printf("push [%d]", imm);
         break;
-    case POPM:
+    case STOREL:
         printf("pop [%d]", imm);
         break;
+    case POP:
+        printf("pop");
+        break;
     case CALL:
-        printf("call %d", imm);
+        printf("call %d, frame +%u", imm, operand);
+        break;
+    case CALL_NATIVE:
+        printf("call-native %d, frame +%u", imm, operand);
+        break;
+    case PARALLEL:
+        printf("parallel %d, frame +%u", imm, operand);
         break;
     case RET:
         printf("ret");
         break;
-    case ADD:
-        printf("add");
+    case ADD_I:
+        printf("add-int");
+        break;
+    case ADD_D:
+        printf("add-double");
+        break;
+    case ADD_S:
+        printf("add-string");
+        break;
+    case SUB_I:
+        printf("sub-int");
+        break;
+    case SUB_D:
+        printf("sub-double");
         break;
-    case SUB:
-        printf("add");
+    case MUL_I:
+        printf("mul-int");
         break;
-    case MUL:
-        printf("mul");
+    case MUL_D:
+        printf("mul-double");
         break;
-    case DIV:
-        printf("div");
+    case DIV_I:
+        printf("div-int");
+        break;
+    case DIV_D:
+        printf("div-double");
         break;
     case AND:
         printf("and");
         break;
-    case CMP:
-        printf("cmp");
+    case CMP_I:
+        printf("cmp-int");
+        break;
+    case CMP_D:
+        printf("cmp-double");
+        break;
+    case CMP_S:
+        printf("cmp-string");
         break;
-    case CLT:
-        printf("clt");
+    case CLT_I:
+        printf("clt-int");
+        break;
+    case CLT_D:
+        printf("clt-double");
         break;
     case ASSERT:
         printf("assert");
         break;
-    case PRINT:
-        printf("print");
+    case PRINT_I:
+        printf("print-int");
+        break;
+    case PRINT_D:
+        printf("print-double");
+        break;
+    case PRINT_S:
+        printf("print-string");
+        break;
+    case PRINT_L:
+        printf("print-list");
         break;
     case JE:
         printf("je %d", imm);
@@ -352,14 +886,53 @@ void ToyVm::print_code(int code, int imm)
     case MAKE_LIST:
         printf("make-list %d", imm);
         break;
-    case MAKE_ITER:
-        printf("make-iter");
+    case LENGTH:
+        printf("length");
+        break;
+    case ELEMENT:
+        printf("element");
+        break;
+    case ITER_NEXT_OR_JUMP:
+        printf("iter-next-or-jump [%d], [%d], %d", b, c, imm);
+        break;
+    case END_OF_CODE:
+        printf("end");
+        break;
+    case LOADL_LOADL:
+        printf("push [%d], [%d]", imm, b);
         break;
-    case LOOP_ITER:
-        printf("loop-iter: %d", imm);
+    case LOADL_STOREL:
+        printf("mov [%d], [%d]", b, imm);
         break;
-    case ITER_VALUE:
-        printf("push *iter");
+    case PUSHI_STOREL:
+        printf("mov [%d], %d", b, imm);
+        break;
+    case ADD_I_MM:
+    case ADD_D_MM:
+    case SUB_I_MM:
+    case SUB_D_MM:
+    case MUL_I_MM:
+    case MUL_D_MM:
+        printf("%s [%d], [%d]", mnemonic.c_str(), imm, b);
+        break;
+    case ADD_I_MM_M:
+    case ADD_D_MM_M:
+    case SUB_I_MM_M:
+    case SUB_D_MM_M:
+    case MUL_I_MM_M:
+    case MUL_D_MM_M:
+        printf("%s [%d], [%d] -> [%d]", mnemonic.c_str(), imm, b, c);
+        break;
+    case ADD_I_MI_M:
+        printf("%s [%d], %d -> [%d]", mnemonic.c_str(), imm, b, c);
+        break;
+    case CLT_I_JE:
+    case CLT_I_JNE:
+    case CLT_D_JE:
+    case CLT_D_JNE:
+    case CMP_I_JE:
+    case CMP_I_JNE:
+        printf("%s %d", mnemonic.c_str(), imm);
         break;
     default:
         printf("Unknown code %d\n", code);
@@ -368,120 +941,6 @@ void ToyVm::print_code(int code, int imm)
     }
 }
 
-void ToyVm::recompile()
-{
-    using namespace Xbyak;
-    /*
-            esi : A
-            edi : B
-            ebx : m_mem
-            for speed up
-            m_mem[0] : eax
-            m_mem[1] : ecx
-            m_mem[2] : edx
-        */
-    push(rbp);
-    push(rbx);
-    push(r12);
-    push(r13);
-    push(r14);
-    push(r15);
-    mov(rbp, rsp);
-
-    const Reg32e reg[7] = { esi, edi, r8d, r9d, r10d, r12d, r13d };
-    const Reg32e mem(r15);
-    const Reg32e &vsp = r14;
-    int sp = 0;
-    mov(mem, (size_t)m_mem);
-    mov(vsp, (size_t)65535);
-    const size_t end = m_code.size();
-    uint32 pc = 0;
-    uint32 labelNum = 0;
-    for (;;) {
-        uint32 x = m_code[pc];
-        ::Type t;
-        uint32 code, imm;
-        decode(code, t.id, imm, x);
-        L(Label::toStr(labelNum++).c_str());
-        switch (code) {
-        case PUSHI:
-            if (sp < 7) {
-                mov(reg[sp++], imm);
-            } else {
-                mov(dword[mem + vsp * 4], imm);
-                dec(vsp);
-            }
-            break;
-        case PUSHM:
-            if (sp < 7) {
-                mov(reg[sp++], dword[mem + imm * 4]);
-            } else {
-                mov(eax, dword[mem + imm * 4]);
-                mov(dword[mem + vsp * 4], eax);
-                dec(vsp);
-            }
-            break;
-        case ADD:
-            if (sp < 7) {
-                const Reg32e& a=reg[--sp];
-                const Reg32e& b=reg[sp - 1];
-                add(b, a);
-            } else {
-                mov(eax, dword[mem + vsp * 4 + 4]);
-                mov(ebx, dword[mem + vsp * 4 + 8]);
-                add(eax, ebx);
-                mov(dword[mem + vsp * 4 + 8], eax);
-                inc(vsp);
-            }
-            break;
-        case MUL:
-            if (sp < 7) {
-                const Reg32e& a=reg[--sp];
-                const Reg32e& b=reg[sp - 1];
-                imul(b, a);
-            } else {
-                mov(eax, dword[mem + vsp * 4 + 4]);
-                mov(ebx, dword[mem + vsp * 4 + 8]);
-                imul(eax, ebx);
-                mov(dword[mem + vsp * 4 + 8], eax);
-                inc(vsp);
-            }
-            break;
-        case POPM:
-            if (sp < 7) {
-                mov(dword[mem + imm * 4], reg[--sp]);
-            } else {
-                inc(vsp);
-                mov(eax, dword[mem + vsp * 4]);
-                mov(dword[mem + imm * 4], eax);
-            }
-            break;
-        case RET:
-            break;
-        default:
-            assert(0);
-            break;
-        }
-        pc++;
-        if (pc >= end) break;
-    } // for (;;)
-
-
-    L("exit");
-    mov(rax, (size_t)&m_sp);
-    mov(dword[rax], r14d);
-    mov(rsp, rbp);
-    pop(r15);
-    pop(r14);
-    pop(r13);
-    pop(r12);
-    pop(rbx);
-    pop(rbp);
-    ret();
-}
-
-
-
 /*
     the code generated by Xbyak
    push        ebx
@@ -24,68 +24,417 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <memory.h>
+#include <setjmp.h>
+#include <sys/mman.h>
+#include <map>
+#include <memory>
 #include <vector>
 
 #include "xbyak/xbyak.h"
 #include "xbyak/xbyak_util.h"
 
 #include "type.h"
+#include "heap.h"
+#include "output.h"
 #define NUM_OF_ARRAY(x) (sizeof(x) / sizeof(x[0]))
 
 using namespace Xbyak;
 
-struct IValue;
+class List;
 
 struct IValue {
     union {
         int int_value;
         double float_value;
         const std::string *str_value;
-        std::list<IValue> *list_value;
-        std::list<IValue>::iterator *list_iter;
+        List *list_value;
     };
 };
 
+/*
+    A list is one growable array. A list of only Ints is stored unboxed
+    as 4 byte ints and one of only Doubles as doubles; any other list
+    stores IValues. The first INLINE_BYTES of elements live in the List
+    itself, so short lists take a single allocation.
+
+    The JIT reads m_size, m_shift and m_data directly, they must stay the
+    first members.
+*/
+class List {
+public:
+    enum { INLINE_BYTES = 32 };
+
+    List(int element_type, uint32 capacity)
+        : m_size(0), m_shift(element_type == ::Type::INT ? 2 : 3),
+          m_data(m_inline), m_capacity(INLINE_BYTES >> m_shift), m_type(element_type)
+    {
+        reserve(capacity);
+    }
+
+    ~List()
+    {
+        if (m_data != m_inline)
+            free(m_data);
+    }
+
+    uint32 size() const { return m_size; }
+    // ::Type::INT or ::Type::DOUBLE when unboxed, ::Type::UNKNOWN otherwise
+    int element_type() const { return m_type; }
+
+    IValue at(uint32 i) const
+    {
+        IValue v;
+        if (m_shift == 2)
+            v.int_value = ((const int *)m_data)[i];
+        else
+            v = ((const IValue *)m_data)[i];
+        return v;
+    }
+
+    void push_back(IValue v)
+    {
+        if (m_size == m_capacity)
+            reserve(m_capacity * 2);
+        if (m_shift == 2)
+            ((int *)m_data)[m_size++] = v.int_value;
+        else
+            ((IValue *)m_data)[m_size++] = v;
+    }
+
+    void reserve(uint32 capacity)
+    {
+        if (capacity <= m_capacity)
+            return;
+        char *data = (char *)malloc((size_t)capacity << m_shift);
+        memcpy(data, m_data, (size_t)m_size << m_shift);
+        if (m_data != m_inline)
+            free(m_data);
+        m_data = data;
+        m_capacity = capacity;
+    }
+
+private:
+    friend class ToyVm;
+    List(const List &);
+    List &operator=(const List &);
+
+    uint32 m_size;
+    uint32 m_shift;
+    char *m_data;
+    uint32 m_capacity;
+    int m_type;
+    union {
+        char m_inline[INLINE_BYTES];
+        IValue m_align;
+    };
+};
+
+/*
+    Every opcode understood by the interpreter, in encoding order, with its
+    length in 32-bit words. The list is expanded into the Code enum, the
+    length and name tables and the handler table of the threaded
+    interpreter, so none of them can get out of sync.
+
+    Operators are monomorphic: the code generator knows the operand types
+    statically and picks the _I (Int), _D (Double), _S (String) or _L (List)
+    variant, so no handler has to look at the type again at run time.
+
+    Variables live in the frame of the function call they belong to.
+    LOADL and STOREL push and pop local n of the current frame; CALL jumps
+    to the function at imm and has the size of the caller's frame in its
+    second word, the callee's frame starts right after it, where the
+    caller stored the arguments. Frames are rounded up to whole cache
+    lines (see FRAME_ALIGN). PARALLEL runs the function at imm for every
+    index of a parallel foreach (see ToyVm::parallel); it takes the
+    start, stop and step of the indices and the values for the other
+    parameters from the stack, their number is in the type field.
+
+    MAKE_LIST collects the top imm values into a List, unboxed when its
+    type field says they are all Int or all Double. A foreach keeps the
+    list, its length and the index of the current element in locals:
+    ELEMENT pushes list[index], and ITER_NEXT_OR_JUMP advances the index
+    in local b and jumps back to the body at imm unless it reached the
+    length in local c. Iterating allocates nothing.
+
+    The second group are superinstructions, only produced by the peephole
+    pass (peephole.cpp). They fuse a common sequence into one dispatch;
+    M stands for a local and I for an immediate, so ADD_I_MM_M is
+    "push [a]; push [b]; add-int; pop [c]". Two word superinstructions keep
+    their first operand in the immediate field and the other two in the
+    low and high half of the following word.
+*/
+#define TOYVM_OPCODES(V) \
+    V(LD, 1) V(LDI, 1) V(ST, 1) \
+    V(ADD_I, 1) V(ADD_D, 1) V(ADD_S, 1) \
+    V(MUL_I, 1) V(MUL_D, 1) \
+    V(DIV_I, 1) V(DIV_D, 1) \
+    V(SUB_I, 1) V(SUB_D, 1) \
+    V(AND, 1) \
+    V(CMP_I, 1) V(CMP_D, 1) V(CMP_S, 1) \
+    V(CLT_I, 1) V(CLT_D, 1) \
+    V(PUSHI, 1) V(PUSH, 1) V(LOADL, 1) V(POP, 1) V(STOREL, 1) \
+    V(PUSH_CONST_I, 1) V(PUSH_CONST_D, 1) V(PUSH_CONST_S, 1) \
+    V(MAKE_LIST, 1) V(LENGTH, 1) V(ELEMENT, 1) V(ITER_NEXT_OR_JUMP, 2) \
+    V(CALL, 2) V(CALL_NATIVE, 2) V(PARALLEL, 2) V(RET, 1) \
+    V(ASSERT, 1) V(PRINT_I, 1) V(PRINT_D, 1) V(PRINT_S, 1) V(PRINT_L, 1) \
+    V(JE, 1) V(JNE, 1) V(JMP, 1) \
+    V(END_OF_CODE, 1) \
+    \
+    V(LOADL_LOADL, 2) V(LOADL_STOREL, 2) V(PUSHI_STOREL, 2) \
+    V(ADD_I_MM, 2) V(ADD_D_MM, 2) V(SUB_I_MM, 2) V(SUB_D_MM, 2) \
+    V(MUL_I_MM, 2) V(MUL_D_MM, 2) \
+    V(ADD_I_MM_M, 2) V(ADD_D_MM_M, 2) V(SUB_I_MM_M, 2) V(SUB_D_MM_M, 2) \
+    V(MUL_I_MM_M, 2) V(MUL_D_MM_M, 2) \
+    V(ADD_I_MI_M, 2) \
+    V(CLT_I_JE, 1) V(CLT_I_JNE, 1) V(CLT_D_JE, 1) V(CLT_D_JNE, 1) \
+    V(CMP_I_JE, 1) V(CMP_I_JNE, 1)
+
+/*
+    The literals of a program. Each distinct value is stored once, in the
+    section for its type; PUSH_CONST_I, PUSH_CONST_D and PUSH_CONST_S
+    push an entry of the Int, Double and String section. Int literals
+    that fit the 16 bit immediate don't need one, they use PUSHI.
+*/
+class ConstantPool {
+public:
+    int add(int i)
+    {
+        return intern(m_int_index, i, m_ints, i);
+    }
+
+    int add(double d)
+    {
+        // by representation, so 0.0 and -0.0 stay apart
+        uint64 bits;
+        memcpy(&bits, &d, sizeof(bits));
+        return intern(m_double_index, bits, m_doubles, d);
+    }
+
+    int add(const std::string *str)
+    {
+        const int i = intern(m_string_index, *str, m_strings, str);
+        // the pool keeps its own text, a Program outlives the AST
+        m_strings[i] = &m_string_index.find(*str)->first;
+        return i;
+    }
+
+    const std::vector<int> &ints() const { return m_ints; }
+    const std::vector<double> &doubles() const { return m_doubles; }
+    const std::vector<const std::string*> &strings() const { return m_strings; }
+
+    ConstantPool() { }
+    // moving keeps the index nodes, which the strings section points into
+    ConstantPool(const ConstantPool &) = delete;
+    ConstantPool &operator=(ConstantPool &&) = default;
+
+private:
+    template <class Key, class T>
+    static int intern(std::map<Key, int> &index, const Key &key, std::vector<T> &section, const T &value)
+    {
+        typename std::map<Key, int>::iterator it = index.find(key);
+        if (it != index.end())
+            return it->second;
+        if (section.size() > 0xffff) {
+            std::cout << "Error! Too many constants" << std::endl;
+            exit(0);
+        }
+        section.push_back(value);
+        index[key] = section.size() - 1;
+        return section.size() - 1;
+    }
+
+    std::vector<int> m_ints;
+    std::vector<double> m_doubles;
+    std::vector<const std::string*> m_strings;
+    std::map<int, int> m_int_index;
+    std::map<uint64, int> m_double_index;
+    std::map<std::string, int> m_string_index;
+};
+
+/*
+    The bytecode of a VM. It is either the VM's own, which the code
+    generator appends to, or the code of a Program that other VMs run as
+    well; the first change, such as a call site patched by tiering, makes
+    it the VM's own copy. Only the const operator[] exists, changes go
+    through set() and own().
+*/
+class Bytecode {
+public:
+    typedef std::vector<uint32> Words;
+
+    Bytecode() : m_words(&m_own) { }
+    Bytecode(const Bytecode &) = delete;
+    Bytecode &operator=(const Bytecode &) = delete;
+
+    /* run words, which whoever calls this keeps alive */
+    void share(const Words &words)
+    {
+        m_own.clear();
+        m_words = &words;
+    }
+
+    Words &own()
+    {
+        if (m_words != &m_own) {
+            m_own = *m_words;
+            m_words = &m_own;
+        }
+        return m_own;
+    }
+
+    const uint32 &operator[](size_t i) const { return (*m_words)[i]; }
+    size_t size() const { return m_words->size(); }
+    bool empty() const { return m_words->empty(); }
+    uint32 back() const { return m_words->back(); }
+    void push_back(uint32 x) { own().push_back(x); }
+    void set(size_t i, uint32 x) { own()[i] = x; }
+
+private:
+    Words m_own;
+    const Words *m_words;
+};
+
+/*
+    A compiled script: its sealed bytecode, its constants and the entry
+    point of main. Nothing changes a Program once ToyVm::link made it, so
+    any number of VMs on any threads can load and run the same one, each
+    with its own stacks, heap, output and native code (isolates).
+*/
+struct Program {
+    Bytecode::Words code;
+    ConstantPool constants;
+    uint32 main;
+};
+
+/*
+    Computed goto ("labels as values") is a GCC extension. Without it the
+    interpreter always uses the portable switch loop.
+*/
+#if defined(PRISM_THREADED_DISPATCH) && !defined(__GNUC__)
+#undef PRISM_THREADED_DISPATCH
+#endif
+
 class ToyVm : public Xbyak::CodeGenerator {
-    typedef std::vector<uint32> Buffer;
+    typedef Bytecode::Words Buffer;
 public:
     enum Code {
-        LD, LDI, ST, ADD, MUL, DIV, SUB,
-        AND,
-        CMP, CLT,
-        PUSHI, PUSH, PUSHM, POP, POPM,
-        PUSH_CONSTANT,
-        MAKE_LIST, MAKE_ITER, LOOP_ITER, ITER_VALUE,
-        CALL, RET,
-        ASSERT, PRINT,
-        JE, JNE, JMP,
-        END_OF_CODE
+#define TOYVM_ENUM(op, len) op,
+        TOYVM_OPCODES(TOYVM_ENUM)
+#undef TOYVM_ENUM
+        NUM_CODES
+    };
+
+    enum {
+        JIT_CODE_SIZE = 4 << 20
+    };
+
+    /*
+        The call stack is reserved up front and the system only commits
+        the pages deep recursion touches. A call that could run past the
+        end, counting a frame of the largest size an operand can address,
+        is a stack overflow.
+    */
+    enum {
+        FRAME_SLOTS = 1 << 22,
+        MAX_FRAME = 1 << 16,
+        FRAME_ALIGN = 8
+    };
+
+    /*
+        The operand stack holds STACK_SLOTS values and grows down from the
+        top, with GUARD_SLOTS of inaccessible reservation below it. Both
+        tiers treat sp as a signed index, see stack(), so running past the
+        bottom lands in the guard, which faults instead of overwriting
+        anything, and the SIGSEGV handler reports it as a stack overflow.
+        Pages are committed on first use.
+    */
+    enum {
+        STACK_SLOTS = 1 << 16,
+        GUARD_SLOTS = 1 << 16
+    };
+
+    enum Dispatch {
+        SWITCH_DISPATCH,
+        THREADED_DISPATCH
     };
 
     ToyVm()
-         : m_mark(0)
+         : Xbyak::CodeGenerator(JIT_CODE_SIZE)
+         , m_mark(0)
+#ifdef PRISM_THREADED_DISPATCH
+         , m_dispatch(THREADED_DISPATCH)
+#else
+         , m_dispatch(SWITCH_DISPATCH)
+#endif
+         , m_tracing(false)
+         , m_trace_count(0)
+         , m_profiling(false)
+         , m_profile_pc(0)
+         , m_profile_start(0)
+         , m_fusions(NUM_CODES, true)
+         , m_prev_code(NUM_CODES)
+         , m_tiering(false)
+         , m_handlers(0)
+         , m_enter(0)
+         , m_leave(0)
+         , m_jit_entry(0)
+         , m_compiling_all(false)
+         , m_parent(0)
+         , m_recover(0)
+         , m_threads(0)
+         , m_debug(false)
     {
-        m_mem = new IValue[65536];
+        m_constants = &m_pool;
+        m_mem = map_operand_stack();
+        m_frames = (IValue *)mmap(0, FRAME_SLOTS * sizeof(IValue), PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (m_frames == MAP_FAILED) {
+            std::cout << "Error! Can't reserve the call stack" << std::endl;
+            exit(0);
+        }
+        m_frame_limit = m_frames + FRAME_SLOTS - MAX_FRAME;
     }
 
+    ~ToyVm();
+
     void vpush(uint16 imm)
     {
         encode(PUSHI, imm);
     }
 
-    void vpush_constant(uint16 imm)
+    void vpush_int(int i)
     {
-        encode(PUSH_CONSTANT, imm);
+        if (i >= 0 && i <= 0xffff)
+            encode(PUSHI, i);
+        else
+            encode(PUSH_CONST_I, m_pool.add(i));
     }
 
-    void vpushm(uint16 idx)
+    void vpush_double(double d)
     {
-        encode(PUSHM, idx);
+        encode(PUSH_CONST_D, m_pool.add(d));
     }
 
-    void vcall(uint16 idx)
+    void vpush_string(const std::string *str)
     {
-        encode(CALL, idx);
+        encode(PUSH_CONST_S, m_pool.add(str));
+    }
+
+    void vloadl(uint16 idx)
+    {
+        encode(LOADL, idx);
+    }
+
+    void vcall(uint16 target, uint16 frame_size)
+    {
+        encode(CALL, target);
+        m_code.push_back(frame_size);
+    }
+
+    void vparallel(uint16 entry, int values, uint16 frame_size)
+    {
+        m_code.push_back((PARALLEL << 24) | (values << 16) | entry);
+        m_code.push_back(frame_size);
     }
 
     void vret()
@@ -93,45 +442,70 @@ public:
         encode(RET);
     }
 
-    void vpop(uint16 idx)
+    void vstorel(uint16 idx)
     {
-        encode(POPM, idx);
+        encode(STOREL, idx);
     }
 
-    void vmake_list(int num)
+    void vmake_list(int num, ::Type element_type)
     {
-        encode(MAKE_LIST, num);
+        encode(MAKE_LIST, element_type, num);
     }
 
-    void vmake_iter()
+    void vlength()
     {
-        encode(MAKE_ITER);
+        encode(LENGTH);
     }
 
-    void vloop_iter(int pc)
+    void velement(::Type t)
     {
-        encode(LOOP_ITER, pc);
+        encode(ELEMENT, t);
     }
 
-    void viter_value()
+    void viter_next_or_jump(int pc, uint16 index, uint16 length)
     {
-        encode(ITER_VALUE);
+        encode(ITER_NEXT_OR_JUMP, pc);
+        m_code.push_back(index | length << 16);
+    }
+
+    /*
+        The typed helpers below return false when the operation is not
+        defined for operands of type t; nothing is emitted in that case.
+    */
+    bool vadd(::Type t) {
+        return encode_typed(t, ADD_I, ADD_D, ADD_S);
+    }
+
+    bool vsub(::Type t) {
+        return encode_typed(t, SUB_I, SUB_D);
+    }
+
+    bool vmul(::Type t) {
+        return encode_typed(t, MUL_I, MUL_D);
     }
 
-    void vadd(::Type t) {
-        encode(ADD, t);
+    bool vdiv(::Type t) {
+        return encode_typed(t, DIV_I, DIV_D);
     }
 
-    void vmul(::Type t) {
-        encode(MUL, t);
+    bool vand(::Type t) {
+        return encode_typed(t, AND);
+    }
+
+    bool vcmp(::Type t) {
+        return encode_typed(t, CMP_I, CMP_D, CMP_S);
+    }
+
+    bool vclt(::Type t) {
+        return encode_typed(t, CLT_I, CLT_D);
     }
 
     void vassert() {
         encode(ASSERT);
     }
 
-    void vprint(::Type t) {
-        encode(PRINT, t);
+    bool vprint(::Type t) {
+        return encode_typed(t, PRINT_I, PRINT_D, PRINT_S, PRINT_L);
     }
 
     void vje(uint16 imm) {
@@ -160,31 +534,80 @@ public:
     int getCurrent();
 
     void run(int start_pc);
-    void recompile();
-
-    void dump();
 
-    void runByJIT()
+    /*
+        link() seals the generated code and moves it and the constants
+        into a Program, which this VM goes on to run; load() makes this VM
+        run program, which stays shared with the VMs that run it too.
+        run() starts main of the program.
+    */
+    std::shared_ptr<const Program> link(uint32 main);
+    void load(const std::shared_ptr<const Program> &program);
+    void run() { run(m_program->main); }
+
+    // program output goes to *to instead of stdout, or stdout again for 0
+    void set_output(std::string *to) { m_out.capture(to); }
+    void set_debug(bool enabled) { m_debug = enabled; m_heap.set_debug(enabled); }
+    bool debug() const { return m_debug; }
+    void set_dispatch(Dispatch d) { m_dispatch = d; }
+    void set_tracing(bool enabled) { m_tracing = enabled; }
+    void set_profiling(bool enabled) { m_profiling = enabled; }
+    // worker threads for parallel foreach, 0 for one per core
+    void set_threads(int n) { m_threads = n; }
+
+    /* jit.cpp */
+    void recompile(int start_pc);
+    void runByJIT();
+
+    /*
+        Tiered execution. With tiering enabled run() counts calls per
+        function and taken backward branches per loop header. A function
+        whose count reaches HOT_CALLS is compiled and its call sites are
+        patched to CALL_NATIVE; a loop whose header reaches HOT_LOOP has
+        its function compiled and the interpreter continues in the native
+        code at the loop header (on-stack replacement), which is cheap as
+        both tiers share the operand stack in m_mem and the call frames.
+    */
+    enum {
+        HOT_CALLS = 100,
+        HOT_LOOP = 1000
+    };
+    void set_tiering(bool enabled) { m_tiering = enabled; }
+    uint64 call_function(uint32 target, uint64 sp, IValue *frame);
+    void stack_overflow();
+    void operand_stack_overflow();
+    /*
+        Called by the SIGSEGV handler on the thread whose operand stack
+        overflowed: jumps back to where run() or a worker entered the
+        code, which reports it. Returns if no code runs.
+    */
+    void unwind_operand_stack()
     {
-        printf("Size = %ld\n", getSize());
-        {
-          FILE *fp = fopen("distmp.tmp", "wb");
-          fwrite(getCode(), 1, getSize(), fp);
-          fclose(fp);
-          system("objdump -m i386 -M x86-64,intel -b binary -D distmp.tmp; rm distmp.tmp");
-        }
-        ((void (*)())(const void*)getCode())();
+        if (m_recover)
+            siglongjmp(*m_recover, 1);
+    }
 
+    /*
+        ADD_S and MAKE_LIST for both tiers. They take the operand stack at
+        sp and return the new sp; as they allocate, which may collect,
+        frame must be the frame of the running function.
+    */
+    uint32 concat(uint32 sp, const IValue *frame);
+    uint32 make_list(uint32 sp, const IValue *frame, uint32 n, int element_type);
+    /* PARALLEL for both tiers, see parallel.cpp */
+    uint32 parallel(uint32 sp, IValue *frame, uint32 entry, uint32 values, uint32 frame_size);
+    /* CMP_S and PRINT_S, strings made by ADD_S are flattened first */
+    bool equal(const std::string *a, const std::string *b);
+    void print_string(const std::string *str) { m_out.write(m_heap.flatten(str)); }
+
+    /* program output, buffered in m_out until the program stops */
+    void print_int(int i) { m_out.write_int(i); }
+    void print_double(double d) { m_out.write_double(d); }
+    void print_list(const List *list);
+    void check(int val);
+    void print_gc_stats() { m_heap.print_stats(stdout); }
 
-        printf("---\n");
-        printf("m_mem[] = ");
-        for(int i=0;i<8;i++)
-            printf("%04x ", m_mem[i].int_value);
-        printf("\nsp %d : [ ", m_sp);
-        for(int i=m_sp+1;i<65536;i++)
-            printf("%x ", m_mem[i].int_value);
-        printf("]\n");
-    }
+    void dump();
 
     void encode(Code code, uint16 imm)
     {
@@ -199,48 +622,295 @@ public:
     }
 
 
+    bool encode_typed(::Type t, Code i, Code d = NUM_CODES, Code s = NUM_CODES, Code l = NUM_CODES)
+    {
+        Code code = NUM_CODES;
+        switch (t.id) {
+        case ::Type::INT: code = i; break;
+        case ::Type::DOUBLE: code = d; break;
+        case ::Type::STRING: code = s; break;
+        case ::Type::LIST: code = l; break;
+        }
+        if (code == NUM_CODES)
+            return false;
+        encode(code);
+        return true;
+    }
+
     void encode_at(int idx, Code code, uint16 imm)
     {
         uint32 x = (code << 24) | (0 << 16) | imm;
-        m_code[idx] = x;
+        m_code.set(idx, x);
     }
 
     void encode_at(int idx, Code code, ::Type t = ::Type::UNKNOWN, uint16 imm = 0)
     {
         uint32 x = (code << 24) | (t.id << 16) | imm;
-        m_code[idx] = x;
+        m_code.set(idx, x);
     }
 
-    void print_code(int code, int imm);
-    int add_constant(const std::string* str)
+    /* point the instruction at idx, emitted before its target was known, at entry */
+    void patch_entry(int idx, uint16 entry)
     {
-        IValue value;
-        value.str_value = str;
-        m_constants.push_back(value);
-        printf("Add string constant at %ld\n", m_constants.size() - 1);
-        return m_constants.size() - 1;
+        m_code.set(idx, (m_code[idx] & 0xffff0000) | entry);
     }
 
-    int add_constant(double d)
+    void print_code(int code, int imm, uint32 operand = 0);
+
+    static int length(int code);
+    static const char *name(int code);
+    static int code_from_name(const std::string &name);
+    static bool is_branch(int code);
+    static bool is_call(int code);
+
+    /*
+        Peephole superinstruction pass, see peephole.cpp. optimize() rewrites
+        m_code in place and returns the new address of every old one, which
+        callers use to relocate addresses they hold on to.
+    */
+    std::vector<int> optimize(const std::vector<int> &entries);
+    void set_fusion(bool enabled);
+    bool select_fusions(FILE *histogram);
+    void collect_pair_histogram();
+    void write_pair_histogram(FILE *fp);
+
+    /*
+        Profile of an interpreted run, see profile.cpp. names maps the
+        entry points of functions to their names; functions it doesn't
+        know are called by address.
+    */
+    void write_profile(FILE *fp, const std::map<uint32, std::string> &names);
+
+private:
+    /*
+        One entry of the threaded code stream: the address of the handler
+        for the instruction and the original instruction word, from which
+        the handler reads its operands.
+    */
+    struct ThreadedInsn {
+        const void *handler;
+        uint32 word;
+    };
+
+    /*
+        With tracing on the interpreter records every instruction it runs
+        in a ring of the last TRACE_ENTRIES, along with the top TRACE_TOP
+        operands, and prints them when an assert fails or a stack
+        overflows. The loops that don't watch have no trace code at all.
+    */
+    enum {
+        TRACE_ENTRIES = 4096,
+        TRACE_TOP = 4
+    };
+    struct TraceEntry {
+        uint32 pc;
+        uint32 sp;
+        uint32 frame;
+        IValue top[TRACE_TOP];
+    };
+
+    uint32 interpret(uint32 start_pc, uint32 sp, IValue *frame);
+    template <bool Threaded, bool Watching> uint32 execute(uint32 start_pc, uint32 sp, IValue *frame);
+    void seal();
+    void observe(uint32 pc, uint32 sp, const IValue *frame);
+    void charge_cycles();
+    void trace(uint32 pc, uint32 sp, const IValue *frame);
+    void dump_trace();
+
+    IValue *map_operand_stack();
+
+    /*
+        A parallel foreach runs on worker VMs, kept in m_workers for the
+        next one. A worker interprets the Program of its parent without
+        tiering, has a heap of its own and hands its output to the Job, see
+        parallel.cpp. What stops an iteration is thrown as a Failure and
+        reported by the VM that started the loop.
+    */
+    enum {
+        MAX_WORKERS = 32
+    };
+    struct Job;
+    struct Failure {
+        enum Kind {
+            ASSERTION,
+            CALL_STACK_OVERFLOW,
+            OPERAND_STACK_OVERFLOW
+        } kind;
+    };
+    void adopt(ToyVm &parent);
+    void work(Job &job, int self);
+
+    /* the frame of a call from a function whose own frame has size slots */
+    IValue *push_frame(IValue *frame, uint32 size)
     {
-        IValue value;
-        value.float_value = d;
-        m_constants.push_back(value);
-        printf("Add double constant at %ld\n", m_constants.size() - 1);
-        return m_constants.size() - 1;
+        frame += size;
+        if (frame > m_frame_limit)
+            stack_overflow();
+        return frame;
     }
 
-private:
+    /*
+        What the collector scans: the operand stack above sp and every
+        frame up to the largest one the running function can have.
+    */
+    Heap::Roots roots(uint32 sp, const IValue *frame) const
+    {
+        Heap::Roots r = { &stack(sp + 1), m_mem + STACK_SLOTS, m_frames, frame + MAX_FRAME };
+        return r;
+    }
 
-    IValue* m_mem;
+    /*
+        Slot sp of the operand stack. The index is signed, as one past the
+        bottom is -1, in the guard, rather than 4G slots up.
+    */
+    IValue &stack(uint32 sp) const { return m_mem[(int32_t)sp]; }
+
+    /*
+        JIT lowering (jit.cpp, regalloc.cpp). Within a basic block the
+        operand stack is kept at compile time as a stack of Locs, which
+        only reach m_mem when the block ends or an instruction needs the
+        real operand stack. Slots with an Interval live in a register
+        from its start to its end pc.
+    */
+    struct Micro {
+        uint32 code;
+        uint32 imm;
+        Micro(uint32 c = 0, uint32 i = 0) : code(c), imm(i) { }
+    };
+    struct Loc {
+        enum Kind {
+            IMM,        // immediate n
+            CONSTANT,   // Double constant n
+            SLOT,       // local n, or the register of its interval
+            STACK,      // operand stack entry n above the vsp register
+            GPR,        // temporary register n
+            XMM
+        } kind;
+        int n;
+        Loc(Kind k, int i) : kind(k), n(i) { }
+    };
+    struct Interval {
+        uint32 slot;
+        uint32 start, end;
+        bool xmm;
+        int reg;
+        Interval(uint32 s = 0, uint32 from = 0, uint32 to = 0)
+            : slot(s), start(from), end(to), xmm(false), reg(-1) { }
+        bool covers(uint32 pc) const { return start <= pc && pc <= end; }
+    };
+    struct EdgeStub {
+        std::string label;
+        uint32 from, to;
+    };
 
-    std::vector<IValue> m_constants;
+    /* jit.cpp */
+    void jit_call(const void *fn);
+    void emit_enter();
+    void emit_function(uint32 begin, uint32 end);
+    void emit_stack_insn(uint32 code, int t, uint32 imm, uint32 operand, uint32 begin, uint32 end);
+    void lower_int(uint32 code, const Micro *branch, uint32 pc);
+    void lower_double(uint32 code, const Micro *branch, uint32 pc);
+    void lower_branch(const Micro &micro, uint32 pc);
+    void lower_list(uint32 code, ::Type t, uint32 pc);
+    void push_value(const Loc &v);
+    Loc pop_value();
+    Loc alloc_temp(bool xmm);
+    void release(const Loc &v);
+    int register_of(const Loc &v, bool *xmm) const;
+    Address address(const Loc &v);
+    Address address(const Loc &v, const AddressFrame &size);
+    void load_gpr(const Reg64 &r, const Loc &v);
+    void load_xmm(const Xmm &x, const Loc &v);
+    void store(const Address &dst, const Loc &v);
+    void assign(uint32 slot, const Loc &v);
+    void flush();
+    void sync();
+    void spill_slots(uint32 pc);
+    void fill_slots(uint32 pc);
+    bool crosses(uint32 from, uint32 to) const;
+    void transfer(uint32 from, uint32 to);
+    void jump(uint32 from, uint32 to, int cond);
+    uint32 enter(const uint8 *code, uint32 sp, IValue *frame);
+    uint32 function_end(uint32 entry);
+    const uint8 *tier_up(uint32 entry);
+    const uint8 *backedge(uint32 header);
+
+    /* regalloc.cpp */
+    static int expand(const uint32 *insn, Micro *out);
+    void allocate_registers(uint32 begin, uint32 end, const std::vector<bool> &leader);
+    const Interval *interval_of(uint32 slot) const;
 
-    uint32 m_callstack[128];
-    Buffer m_code;
+    IValue* m_mem;
+    // the call stack, see FRAME_SLOTS
+    IValue* m_frames;
+    IValue* m_frame_limit;
+
+    ConstantPool m_pool;
+    Heap m_heap;
+    Output m_out;
+
+    Bytecode m_code;
+    // what m_code and m_constants come from once linked or loaded
+    std::shared_ptr<const Program> m_program;
+    const ConstantPool *m_constants;
     int m_sp;
     int m_mark;
     std::map<std::string, int> m_labels;
+    Dispatch m_dispatch;
+    std::vector<ThreadedInsn> m_threaded;
+    bool m_tracing;
+    std::vector<TraceEntry> m_trace;
+    uint64 m_trace_count;
+
+    /*
+        With profiling on the interpreter counts the executions of every
+        instruction and reads the time stamp counter before each one; the
+        cycles until the next reading are charged to the instruction at
+        m_profile_pc.
+    */
+    bool m_profiling;
+    std::vector<uint64> m_pc_counts;
+    std::vector<uint64> m_pc_cycles;
+    uint32 m_profile_pc;
+    uint64 m_profile_start;
+
+    // superinstructions the peephole pass may produce, indexed by Code
+    std::vector<bool> m_fusions;
+    // dynamic opcode pair counts, indexed by previous * NUM_CODES + next
+    std::vector<uint64> m_pair_counts;
+    uint32 m_prev_code;
+
+    bool m_tiering;
+    uint32 m_start_pc;
+    std::vector<uint32> m_call_counts;
+    std::vector<uint32> m_loop_counts;
+    // threaded handler of every opcode, to patch CALL sites in m_threaded
+    const void *const *m_handlers;
+    // native address of every instruction that has been compiled
+    std::vector<const uint8 *> m_native;
+    // entry points of compiled functions, indexed by CALL_NATIVE
+    std::vector<const uint8 *> m_native_functions;
+    // uint64 enter(const uint8 *code, uint64 sp, IValue *frame) and its return path
+    const uint8 *m_enter;
+    const uint8 *m_leave;
+    const uint8 *m_jit_entry;
+
+    // state of the function being compiled
+    std::vector<Loc> m_vstack;
+    int m_adjust;
+    uint32 m_free_temps;
+    std::vector<Interval> m_intervals;
+    std::map<uint32, int> m_slot_interval;
+    std::vector<EdgeStub> m_edge_stubs;
+    bool m_compiling_all;
+
+    // the VM a worker runs a parallel foreach for, 0 in others
+    ToyVm *m_parent;
+    // where unwind_operand_stack() goes, while code runs
+    sigjmp_buf *m_recover;
+    int m_threads;
+    std::vector<ToyVm *> m_workers;
+    bool m_debug;
 
     void decode(uint32& code, int& t, uint32& imm, uint32 x)
     {